@@ -18,15 +18,49 @@
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include "rANS_static4x16.h"
 
 typedef enum {
-    CAT, RLE, RANS0, RANS1, PACK0, PACK1, RLE0, RLE1, PACK_RLE0, PACK_RLE1, X4
+    CAT, RLE, RANS0, RANS1, PACK0, PACK1, RLE0, RLE1, PACK_RLE0, PACK_RLE1, X4,
+    RANS2, // encoder only; the order is held in the rANS stream itself
+    X2, X8,
+    INT32,  // 32-bit integers, delta and zig-zag then X4
+    INT_V, INT_DZV, INT_DZB, // encoder only; INT32 with other transforms
+    TANS,   // order-0 tANS
+    ARITH,  // adaptive binary arithmetic coding, order-0
+    ARITH1, // encoder only; ARITH order-1
+    NCODEC
 } codec_t;
 
-int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int no_X4);
-int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len);
+// Statistics of one input, gathered once and shared by the size
+// estimates and the candidate encoders.
+typedef struct {
+    int F0[256];                // order-0 counts
+    int F1[256][256], T1[256];  // order-1, from context 0; rows 0 and F0 only
+    int nsym;                   // symbols present
+    uint64_t rle_len;           // rle_encode output size
+} codec_stats;
+
+/*
+ * Compression levels.  At CODEC_LEVEL_EST and below the method is chosen
+ * from cheap size estimates alone and encoded once.  Up to
+ * CODEC_LEVEL_TRIAL the two best estimates are trial encoded.  Above that
+ * every method is tried.
+ */
+#define CODEC_LEVEL_EST     3
+#define CODEC_LEVEL_TRIAL   6
+#define CODEC_LEVEL_DEFAULT 9
+
+int codec_compress(uint8_t *in, uint64_t in_len, uint8_t *out,
+		   uint64_t *out_len, int no_XN, int level);
+int codec_compress_m(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len, int no_XN, int level, int *method);
+int codec_compress_with(uint8_t *in, uint64_t in_len, uint8_t *out,
+			uint64_t *out_len, int method, int level);
+int codec_uncompress(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len);
 
 //#define DEBUG
 
@@ -42,6 +76,13 @@ int i7put(uint8_t *buf, uint64_t val) {
     return b-buf;
 }
 
+int i7len(uint64_t val) {
+    int n = 1;
+    while (val >>= 7)
+	n++;
+    return n;
+}
+
 int i7get(uint8_t *buf, uint64_t *val) {
     uint64_t v = 0;
     uint8_t *b = buf;
@@ -188,19 +229,28 @@ int64_t rle_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len
 
 //-----------------------------------------------------------------------------
 // rANS codec
-int rans_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int method) {
+// st, if non-NULL, holds the statistics of in.
+int rans_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+		int method, codec_stats *st) {
     unsigned int olen = *out_len-10;
+    uint8_t *cp;
+    rans_ctx *ctx = rans_ctx_create();
+    if (!ctx)
+	return -1;
     *out = RANS0;
 
-    if (rans_compress_to_4x16(in, in_len, out+10, &olen, method) == NULL)
+    if (st)
+	rans_ctx_set_hist(ctx, st->F0, st->F1, st->T1);
+    cp = rans_compress_to_4x16_ctx(ctx, in, in_len, out+10, &olen, method);
+    rans_ctx_destroy(ctx);
+    if (!cp)
 	return -1;
 
     int nb = i7put(out+1, in_len);
     nb += i7put(out+1+nb, olen);
 
     assert(nb <= 9);
-    if (nb < 9)
-	memmove(out+1+nb, out+10, olen);
+    memmove(out+1+nb, cp, olen);
 
     //fprintf(stderr, "ENC %d %d\n", (int)in_len, (int)olen);
 
@@ -219,7 +269,7 @@ int64_t rans_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_le
     nb += i7get(in+1+nb, &clen);
 
     olen = ulen;
-    if (rans_uncompress_to_4x16(in+1+nb, in_len, out, &olen, method) == NULL)
+    if (rans_uncompress_to_4x16(in+1+nb, clen, out, &olen) == NULL)
 	return -1;
 
     //fprintf(stderr, "DEC %d %d %d %d\n", (int)in_len, (int)olen, (int)*out_len, (int)olen2);
@@ -245,7 +295,7 @@ int64_t rans0_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_l
     unsigned int olen = *out_len;
     assert(*in == RANS0);
 
-    if (rans_uncompress_to_4x16(in+5, in_len, out, &olen, 0) == NULL)
+    if (rans_uncompress_to_4x16(in+5, *(uint32_t *)(in+1), out, &olen) == NULL)
 	return -1;
 
     *out_len = olen;
@@ -270,7 +320,7 @@ int64_t rans1_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_l
     unsigned int olen = *out_len;
     assert(*in == RANS1);
 
-    if (rans_uncompress_to_4x16(in+5, in_len, out, &olen, 1) == NULL)
+    if (rans_uncompress_to_4x16(in+5, *(uint32_t *)(in+1), out, &olen) == NULL)
 	return -1;
 
     *out_len = olen;
@@ -278,52 +328,569 @@ int64_t rans1_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_l
 }
 
 //-----------------------------------------------------------------------------
-// X4: splitting 32-bit data into 4 8-bit data streams and encoding
-// separately.
-int x4_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
-    uint64_t j, i4[4];
-    uint64_t len4 = (in_len+3)&~3, olen4, olen4_space;
-    uint8_t *in4 = malloc(len4);
-    uint8_t *out4;
-    if (!in4) return -1;
-
-    // Split the 4 interleave signals into their respective arrays
-    len4 /= 4;
-    for (j = 0; j < 4; j++)
-	i4[j] = j*len4;
-
-    for (j = 0; i4[0] < len4; i4[0]++, i4[1]++, i4[2]++, i4[3]++, j+=4) {
-	in4[i4[0]] = in[j+0];
-	in4[i4[1]] = in[j+1];
-	in4[i4[2]] = in[j+2];
-	in4[i4[3]] = in[j+3];
-    }
-
-    // Encode each signal using the best method per portion.
-    out4 = out;
-    *out4++ = X4;
-    out4 += i7put(out4, in_len);
-    olen4 = out4-out;
-
-    for (j = 0; j < 4; j++) {
-	olen4_space = *out_len - olen4;
-	if (compress(in4 + j*len4, len4, out4, &olen4_space, 1) < 0) return -1;
-	olen4 += olen4_space;
-	out4  += olen4_space;
-    }
-
-    *out_len = olen4;
-    free(in4);
+// Encode jobs, for the exhaustive search in codec_compress() and the XN
+// lanes.
+// Each job writes to its own buffer so the winner can be copied to out
+// instead of encoded a second time.
+//
+// Inputs of CODEC_MT_MIN bytes or more run their jobs concurrently.
+// Smaller ones don't gain enough to pay for starting the threads.  The
+// threads come from a process wide budget of one per CPU, shared with
+// any nested job sets (eg the XN lanes of a candidate), and each takes
+// jobs in turn until none are left.  When searching for the best method
+// each thread only keeps its best so far, so memory grows with the
+// number of threads rather than the number of candidates.
+
+#ifndef CODEC_MT_MIN
+#define CODEC_MT_MIN (64<<10)
+#endif
+
+typedef struct {
+    codec_t m;        // method, if !lane
+    int lane;         // best method without XN, via codec_compress()
+    uint8_t *in, *out;
+    uint64_t in_len, out_len;
+    codec_stats *st;  // statistics of in, if !lane
+    int level, err;
+} enc_job;
+
+static int encode_method(codec_t m, uint8_t *in, uint64_t in_len,
+			 codec_stats *st, uint8_t *out, uint64_t *out_len,
+			 int level);
+
+static void *enc_worker(void *arg) {
+    enc_job *j = (enc_job *)arg;
+    j->err = j->lane
+	? codec_compress(j->in, j->in_len, j->out, &j->out_len, 1, j->level)
+	: encode_method(j->m, j->in, j->in_len, j->st, j->out, &j->out_len,
+			j->level);
+    return NULL;
+}
+
+// Encodes with each of job[0..njobs-1] and leaves the smallest in out,
+// picking the earliest on a tie.  Only one extra buffer is needed: each
+// job encodes to whichever of out and tmp doesn't hold the best so far.
+// Returns 0 on success, -1 on failure.
+static int encode_best(enc_job *job, int njobs, uint8_t *out,
+		       uint64_t *out_len, codec_t *method) {
+    uint8_t *tmp = njobs > 1 ? malloc(*out_len) : NULL;
+    int i, best = -1;
+
+    if (njobs > 1 && !tmp)
+	return -1;
+
+    for (i = 0; i < njobs; i++) {
+	job[i].out = best >= 0 && job[best].out == out ? tmp : out;
+	job[i].out_len = *out_len;
+	enc_worker(&job[i]);
+	if (job[i].err < 0) {
+	    free(tmp);
+	    return -1;
+	}
+#ifdef DEBUG
+	fprintf(stderr, "Method %d -> %ld\n", job[i].m, (long)job[i].out_len);
+#endif
+	if (best < 0 || job[best].out_len > job[i].out_len)
+	    best = i;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "Best method = %d, %ld -> %ld\n", job[best].m,
+	    (long)job[best].in_len, (long)job[best].out_len);
+#endif
+
+    if (job[best].out != out)
+	memcpy(out, job[best].out, job[best].out_len);
+    *out_len = job[best].out_len;
+    *method = job[best].m;
+    free(tmp);
+
+    return 0;
+}
+
+#ifndef NO_THREADS
+#include <pthread.h>
+
+static int codec_ncpu;      // CPUs online, once known
+static int codec_nthreads;  // threads started and not yet joined
+
+static void codec_ncpu_init(void) {
+    codec_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Whether jobs on in_len bytes are worth running concurrently.
+static int codec_mt(uint64_t in_len) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, codec_ncpu_init);
+    return in_len >= CODEC_MT_MIN && codec_ncpu > 1;
+}
+
+// Claims up to want threads from the budget, returning how many were
+// given.  They're handed back with codec_threads_put().
+static int codec_threads_get(int want) {
+    int n, got;
+    do {
+	n = codec_nthreads;
+	got = codec_ncpu-1 - n < want ? codec_ncpu-1 - n : want;
+	if (got <= 0)
+	    return 0;
+    } while (!__sync_bool_compare_and_swap(&codec_nthreads, n, n+got));
+    return got;
+}
+
+static void codec_threads_put(int n) {
+    __sync_fetch_and_sub(&codec_nthreads, n);
+}
+
+// One thread's share of a job set.  With buf[] set, jobs are written to
+// whichever of the two doesn't hold this thread's best, as per
+// encode_best(); otherwise each job has its own out buffer.
+typedef struct {
+    enc_job *job;
+    int njobs, *next;
+    uint8_t *buf[2];
+    uint64_t buf_len;
+    int best, err;
+} enc_runner;
+
+static void *enc_runner_main(void *arg) {
+    enc_runner *r = (enc_runner *)arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(r->next, 1)) < r->njobs) {
+	enc_job *j = &r->job[i];
+	if (r->buf[0]) {
+	    j->out = r->best >= 0 && r->job[r->best].out == r->buf[0]
+		? r->buf[1] : r->buf[0];
+	    j->out_len = r->buf_len;
+	}
+	enc_worker(j);
+	if (j->err < 0) {
+	    r->err = 1;
+	    continue;
+	}
+	// Jobs are taken in order, so ties keep the earliest as serially.
+	if (r->best < 0 || r->job[r->best].out_len > j->out_len)
+	    r->best = i;
+    }
+
+    return NULL;
+}
+
+// Runs all jobs on the calling thread plus nr-1 new ones, returning the
+// number of runners that had a job fail.  Runners that can't get a
+// thread just leave their share to the others.
+static int run_jobs_mt(enc_runner *r, int nr) {
+    pthread_t tid[NCODEC];
+    int started[NCODEC] = {0}, i, nerr = 0;
+
+    for (i = 1; i < nr; i++)
+	started[i] = pthread_create(&tid[i], NULL, enc_runner_main, &r[i]) == 0;
+    enc_runner_main(&r[0]);
+    for (i = 0; i < nr; i++) {
+	if (started[i])
+	    pthread_join(tid[i], NULL);
+	nerr += r[i].err;
+    }
+
+    return nerr;
+}
+
+// As encode_best, but spread over as many threads as the budget allows,
+// each with two *out_len sized buffers.  The choice is the same as
+// encode_best's.  Returns 0 on success, -1 on failure.
+static int encode_best_mt(enc_job *job, int njobs, uint8_t *out,
+			  uint64_t *out_len, codec_t *method) {
+    enc_runner r[NCODEC];
+    int nr, next = 0, i, best = -1, err = 0;
+
+    if ((nr = 1 + codec_threads_get(njobs-1)) == 1)
+	return encode_best(job, njobs, out, out_len, method);
+
+    for (i = 0; i < nr; i++) {
+	r[i].job = job;
+	r[i].njobs = njobs;
+	r[i].next = &next;
+	r[i].buf[0] = i ? malloc(*out_len) : out;
+	r[i].buf[1] = malloc(*out_len);
+	r[i].buf_len = *out_len;
+	r[i].best = -1;
+	r[i].err = 0;
+	if (!r[i].buf[0] || !r[i].buf[1])
+	    err = 1;
+    }
+
+    if (!err && run_jobs_mt(r, nr) == 0) {
+	for (i = 0; i < nr; i++) {
+	    int b = r[i].best;
+	    if (b >= 0 && (best < 0 || job[best].out_len > job[b].out_len ||
+			   (job[best].out_len == job[b].out_len && b < best)))
+		best = b;
+	}
+	if (job[best].out != out)
+	    memcpy(out, job[best].out, job[best].out_len);
+	*out_len = job[best].out_len;
+	*method = job[best].m;
+    } else {
+	err = 1;
+    }
+
+    for (i = 0; i < nr; i++) {
+	if (i)
+	    free(r[i].buf[0]);
+	free(r[i].buf[1]);
+    }
+    codec_threads_put(nr-1);
+
+    return err ? -1 : 0;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// XN: splitting data of N-byte elements (eg 16, 32 or 64-bit integers)
+// into N byte lanes and encoding each separately, for N of 2, 4 or 8.
+// The tag byte is X2, X4 or X8 and lanes are in_len/N bytes each, so
+// in_len must be a multiple of N.
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#  define CODEC_X86_KERNELS
+#  include <immintrin.h>
+#  define TARGET(x) __attribute__((target(x)))
+#endif
+
+static int xn_tag(int n) {
+    return n == 2 ? X2 : n == 4 ? X4 : X8;
+}
+
+static int xn_width(int tag) {
+    return tag == X2 ? 2 : tag == X4 ? 4 : tag == X8 ? 8 : 0;
+}
+
+// Whether in_len bytes can be split into n lanes, with enough to be worth
+// it.
+static int xn_ok(uint64_t in_len, int n) {
+    return in_len % n == 0 && in_len >= 8*n;
+}
+
+// Interleaved to lanes, for elements [i,len/n), and back again.
+static void xn_split_scalar(uint8_t *in, uint64_t len, int n, uint8_t *lanes,
+			    uint64_t i) {
+    uint64_t l = len/n;
+    int j;
+    for (; i < l; i++)
+	for (j = 0; j < n; j++)
+	    lanes[j*l + i] = in[i*n + j];
+}
+
+static void xn_merge_scalar(uint8_t *lanes, uint64_t len, int n, uint8_t *out,
+			    uint64_t i) {
+    uint64_t l = len/n;
+    int j;
+    for (; i < l; i++)
+	for (j = 0; j < n; j++)
+	    out[i*n + j] = lanes[j*l + i];
+}
+
+#ifdef CODEC_X86_KERNELS
+/*
+ * The vector versions do 16 elements per lane per step.  Split groups
+ * each element's bytes by lane with a byte shuffle and then transposes
+ * the 16/n byte groups across registers; merge is the usual unpack
+ * cascade.  AVX2 merges 32 elements at a time, but its in-lane unpacks
+ * leave the two 128-bit halves to be swapped back into order at the end.
+ */
+TARGET("ssse3")
+static uint64_t xn_split_ssse3(uint8_t *in, uint64_t len, int n,
+			       uint8_t *lanes) {
+    uint64_t l = len/n, i;
+    uint8_t *l0 = lanes, *l1 = l0+l, *l2 = l1+l, *l3 = l2+l;
+    uint8_t *l4 = l3+l, *l5 = l4+l, *l6 = l5+l, *l7 = l6+l;
+
+    switch (n) {
+    case 2: {
+	__m128i s = _mm_setr_epi8(0,2,4,6,8,10,12,14, 1,3,5,7,9,11,13,15);
+	for (i = 0; i+16 <= l; i += 16) {
+	    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+2*i)), s);
+	    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+2*i+16)), s);
+	    _mm_storeu_si128((__m128i *)(l0+i), _mm_unpacklo_epi64(a, b));
+	    _mm_storeu_si128((__m128i *)(l1+i), _mm_unpackhi_epi64(a, b));
+	}
+	break;
+    }
+
+    case 4: {
+	__m128i s = _mm_setr_epi8(0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+	for (i = 0; i+16 <= l; i += 16) {
+	    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+4*i)), s);
+	    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+4*i+16)), s);
+	    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+4*i+32)), s);
+	    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+4*i+48)), s);
+	    __m128i ab0 = _mm_unpacklo_epi32(a, b), ab1 = _mm_unpackhi_epi32(a, b);
+	    __m128i cd0 = _mm_unpacklo_epi32(c, d), cd1 = _mm_unpackhi_epi32(c, d);
+	    _mm_storeu_si128((__m128i *)(l0+i), _mm_unpacklo_epi64(ab0, cd0));
+	    _mm_storeu_si128((__m128i *)(l1+i), _mm_unpackhi_epi64(ab0, cd0));
+	    _mm_storeu_si128((__m128i *)(l2+i), _mm_unpacklo_epi64(ab1, cd1));
+	    _mm_storeu_si128((__m128i *)(l3+i), _mm_unpackhi_epi64(ab1, cd1));
+	}
+	break;
+    }
+
+    case 8: {
+	__m128i s = _mm_setr_epi8(0,8, 1,9, 2,10, 3,11, 4,12, 5,13, 6,14, 7,15);
+	for (i = 0; i+16 <= l; i += 16) {
+	    __m128i v[8], w[8];
+	    int k;
+	    for (k = 0; k < 8; k++)
+		v[k] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(in+8*i+16*k)), s);
+	    // 8x8 transpose of 16-bit words
+	    for (k = 0; k < 8; k += 2) {
+		w[k]   = _mm_unpacklo_epi16(v[k], v[k+1]);
+		w[k+1] = _mm_unpackhi_epi16(v[k], v[k+1]);
+	    }
+	    for (k = 0; k < 8; k += 4) {
+		v[k]   = _mm_unpacklo_epi32(w[k],   w[k+2]);
+		v[k+1] = _mm_unpackhi_epi32(w[k],   w[k+2]);
+		v[k+2] = _mm_unpacklo_epi32(w[k+1], w[k+3]);
+		v[k+3] = _mm_unpackhi_epi32(w[k+1], w[k+3]);
+	    }
+	    _mm_storeu_si128((__m128i *)(l0+i), _mm_unpacklo_epi64(v[0], v[4]));
+	    _mm_storeu_si128((__m128i *)(l1+i), _mm_unpackhi_epi64(v[0], v[4]));
+	    _mm_storeu_si128((__m128i *)(l2+i), _mm_unpacklo_epi64(v[1], v[5]));
+	    _mm_storeu_si128((__m128i *)(l3+i), _mm_unpackhi_epi64(v[1], v[5]));
+	    _mm_storeu_si128((__m128i *)(l4+i), _mm_unpacklo_epi64(v[2], v[6]));
+	    _mm_storeu_si128((__m128i *)(l5+i), _mm_unpackhi_epi64(v[2], v[6]));
+	    _mm_storeu_si128((__m128i *)(l6+i), _mm_unpacklo_epi64(v[3], v[7]));
+	    _mm_storeu_si128((__m128i *)(l7+i), _mm_unpackhi_epi64(v[3], v[7]));
+	}
+	break;
+    }
+
+    default:
+	return 0;
+    }
+
+    return i;
+}
+
+TARGET("ssse3")
+static uint64_t xn_merge_ssse3(uint8_t *lanes, uint64_t len, int n,
+			       uint8_t *out) {
+    uint64_t l = len/n, i;
+    uint8_t *l0 = lanes, *l1 = l0+l, *l2 = l1+l, *l3 = l2+l;
+    uint8_t *l4 = l3+l, *l5 = l4+l, *l6 = l5+l, *l7 = l6+l;
+    __m128i *o = (__m128i *)out;
+
+#define LD(p) _mm_loadu_si128((__m128i *)((p)+i))
+    switch (n) {
+    case 2:
+	for (i = 0; i+16 <= l; i += 16, o += 2) {
+	    __m128i a = LD(l0), b = LD(l1);
+	    _mm_storeu_si128(o+0, _mm_unpacklo_epi8(a, b));
+	    _mm_storeu_si128(o+1, _mm_unpackhi_epi8(a, b));
+	}
+	break;
+
+    case 4:
+	for (i = 0; i+16 <= l; i += 16, o += 4) {
+	    __m128i a = LD(l0), b = LD(l1), c = LD(l2), d = LD(l3);
+	    __m128i ab0 = _mm_unpacklo_epi8(a, b), ab1 = _mm_unpackhi_epi8(a, b);
+	    __m128i cd0 = _mm_unpacklo_epi8(c, d), cd1 = _mm_unpackhi_epi8(c, d);
+	    _mm_storeu_si128(o+0, _mm_unpacklo_epi16(ab0, cd0));
+	    _mm_storeu_si128(o+1, _mm_unpackhi_epi16(ab0, cd0));
+	    _mm_storeu_si128(o+2, _mm_unpacklo_epi16(ab1, cd1));
+	    _mm_storeu_si128(o+3, _mm_unpackhi_epi16(ab1, cd1));
+	}
+	break;
+
+    case 8:
+	for (i = 0; i+16 <= l; i += 16, o += 8) {
+	    __m128i v[8] = {LD(l0), LD(l1), LD(l2), LD(l3),
+			    LD(l4), LD(l5), LD(l6), LD(l7)}, w[8];
+	    int k;
+	    for (k = 0; k < 8; k += 2) {
+		w[k]   = _mm_unpacklo_epi8(v[k], v[k+1]);
+		w[k+1] = _mm_unpackhi_epi8(v[k], v[k+1]);
+	    }
+	    for (k = 0; k < 8; k += 4) {
+		v[k]   = _mm_unpacklo_epi16(w[k],   w[k+2]);
+		v[k+1] = _mm_unpackhi_epi16(w[k],   w[k+2]);
+		v[k+2] = _mm_unpacklo_epi16(w[k+1], w[k+3]);
+		v[k+3] = _mm_unpackhi_epi16(w[k+1], w[k+3]);
+	    }
+	    _mm_storeu_si128(o+0, _mm_unpacklo_epi32(v[0], v[4]));
+	    _mm_storeu_si128(o+1, _mm_unpackhi_epi32(v[0], v[4]));
+	    _mm_storeu_si128(o+2, _mm_unpacklo_epi32(v[1], v[5]));
+	    _mm_storeu_si128(o+3, _mm_unpackhi_epi32(v[1], v[5]));
+	    _mm_storeu_si128(o+4, _mm_unpacklo_epi32(v[2], v[6]));
+	    _mm_storeu_si128(o+5, _mm_unpackhi_epi32(v[2], v[6]));
+	    _mm_storeu_si128(o+6, _mm_unpacklo_epi32(v[3], v[7]));
+	    _mm_storeu_si128(o+7, _mm_unpackhi_epi32(v[3], v[7]));
+	}
+	break;
+
+    default:
+	return 0;
+    }
+#undef LD
+
+    return i;
+}
+
+TARGET("avx2")
+static uint64_t xn_merge_avx2(uint8_t *lanes, uint64_t len, int n,
+			      uint8_t *out) {
+    uint64_t l = len/n, i;
+    uint8_t *l0 = lanes, *l1 = l0+l, *l2 = l1+l, *l3 = l2+l;
+    __m256i *o = (__m256i *)out;
+
+#define LD(p) _mm256_loadu_si256((__m256i *)((p)+i))
+    switch (n) {
+    case 2:
+	for (i = 0; i+32 <= l; i += 32, o += 2) {
+	    __m256i a = LD(l0), b = LD(l1);
+	    __m256i lo = _mm256_unpacklo_epi8(a, b), hi = _mm256_unpackhi_epi8(a, b);
+	    _mm256_storeu_si256(o+0, _mm256_permute2x128_si256(lo, hi, 0x20));
+	    _mm256_storeu_si256(o+1, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	break;
+
+    case 4:
+	for (i = 0; i+32 <= l; i += 32, o += 4) {
+	    __m256i a = LD(l0), b = LD(l1), c = LD(l2), d = LD(l3);
+	    __m256i ab0 = _mm256_unpacklo_epi8(a, b), ab1 = _mm256_unpackhi_epi8(a, b);
+	    __m256i cd0 = _mm256_unpacklo_epi8(c, d), cd1 = _mm256_unpackhi_epi8(c, d);
+	    __m256i e0 = _mm256_unpacklo_epi16(ab0, cd0); // elements 0-3, 16-19
+	    __m256i e1 = _mm256_unpackhi_epi16(ab0, cd0); // 4-7, 20-23
+	    __m256i e2 = _mm256_unpacklo_epi16(ab1, cd1); // 8-11, 24-27
+	    __m256i e3 = _mm256_unpackhi_epi16(ab1, cd1); // 12-15, 28-31
+	    _mm256_storeu_si256(o+0, _mm256_permute2x128_si256(e0, e1, 0x20));
+	    _mm256_storeu_si256(o+1, _mm256_permute2x128_si256(e2, e3, 0x20));
+	    _mm256_storeu_si256(o+2, _mm256_permute2x128_si256(e0, e1, 0x31));
+	    _mm256_storeu_si256(o+3, _mm256_permute2x128_si256(e2, e3, 0x31));
+	}
+	break;
+
+    default:
+	// X8 rows are already 128 bytes per step; no gain over SSSE3.
+	return xn_merge_ssse3(lanes, len, n, out);
+    }
+#undef LD
+
+    return i;
+}
+#endif /* CODEC_X86_KERNELS */
+
+static void xn_split(uint8_t *in, uint64_t len, int n, uint8_t *lanes) {
+    uint64_t i = 0;
+#ifdef CODEC_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	i = xn_split_ssse3(in, len, n, lanes);
+#endif
+    xn_split_scalar(in, len, n, lanes, i);
+}
+
+static void xn_merge(uint8_t *lanes, uint64_t len, int n, uint8_t *out) {
+    uint64_t i = 0;
+#ifdef CODEC_X86_KERNELS
+    int cpu = rans_cpu_level();
+    if (cpu >= RANS_CPU_AVX2)
+	i = xn_merge_avx2(lanes, len, n, out);
+    else if (cpu >= RANS_CPU_SSE4)
+	i = xn_merge_ssse3(lanes, len, n, out);
+#endif
+    xn_merge_scalar(lanes, len, n, out, i);
+}
+
+int xn_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+	      int n, int level) {
+    uint64_t j, len_n = in_len/n, olen_n, olen_n_space;
+    uint8_t *in_n, *out_n;
+
+    if (in_len % n || !(in_n = malloc(in_len)))
+	return -1;
+    xn_split(in, in_len, n, in_n);
+
+    // Encode each lane using the best method per portion.
+    out_n = out;
+    *out_n++ = xn_tag(n);
+    out_n += i7put(out_n, in_len);
+    olen_n = out_n-out;
+
+#ifndef NO_THREADS
+    int nr;
+    if (codec_mt(len_n) && (nr = 1 + codec_threads_get(n-1)) > 1) {
+	// Lanes in parallel, into separate buffers, then concatenated.
+	enc_job job[8];
+	enc_runner r[8];
+	int err = 0, next = 0;
+	uint64_t lane_len = 1.5 * rans_compress_bound_4x16(len_n, 2);
+	if (lane_len > *out_len - olen_n)
+	    lane_len = *out_len - olen_n;
+	for (j = 0; j < n; j++) {
+	    job[j].lane = 1;
+	    job[j].in = in_n + j*len_n;
+	    job[j].in_len = len_n;
+	    job[j].level = level;
+	    job[j].out_len = lane_len;
+	    if (!(job[j].out = malloc(lane_len)))
+		err = 1;
+	}
+	for (j = 0; j < nr; j++) {
+	    r[j].job = job;
+	    r[j].njobs = n;
+	    r[j].next = &next;
+	    r[j].buf[0] = r[j].buf[1] = NULL;
+	    r[j].best = -1;
+	    r[j].err = 0;
+	}
+	if (!err && run_jobs_mt(r, nr) != 0)
+	    err = 1;
+	codec_threads_put(nr-1);
+	for (j = 0; j < n; j++) {
+	    if (!err && olen_n + job[j].out_len > *out_len)
+		err = 1;
+	    if (!err) {
+		memcpy(out_n, job[j].out, job[j].out_len);
+		olen_n += job[j].out_len;
+		out_n  += job[j].out_len;
+	    }
+	    free(job[j].out);
+	}
+	free(in_n);
+	if (err)
+	    return -1;
+
+	*out_len = olen_n;
+	return 0;
+    }
+#endif
+
+    for (j = 0; j < n; j++) {
+	olen_n_space = *out_len - olen_n;
+	if (codec_compress(in_n + j*len_n, len_n, out_n, &olen_n_space, 1,
+			   level) < 0) {
+	    free(in_n);
+	    return -1;
+	}
+	olen_n += olen_n_space;
+	out_n  += olen_n_space;
+    }
+
+    *out_len = olen_n;
+    free(in_n);
 
     return 0;
 }
 
-int x4_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
+// The lanes decode to a temporary buffer and merge straight into out.
+int xn_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
     uint8_t *i = in, *o, *o_orig;
-    uint64_t ulen, olen, i4[4], j;
-    assert(*i == X4);
-    i++;
+    uint64_t ulen, olen, len_n, j;
+    int n = xn_width(*i++);
+
     i += i7get(i, &ulen);
+    if (!n || ulen % n || ulen > *out_len)
+	return -1;
 
     o = o_orig = malloc(ulen);
     if (!o)
@@ -332,33 +899,895 @@ int x4_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
     in_len -= (i-in);
 
     // Uncompress
-    uint64_t len4 = (ulen+3)&~3;
-    len4 /= 4;
-    for (j = 0; j < 4; j++) {
-	i4[j] = j*len4;
-	olen = *out_len - (o-o_orig);
-	int64_t clen = uncompress(i, in_len, o, &olen);
-	if (clen < 0) {
+    len_n = ulen / n;
+    for (j = 0; j < n; j++) {
+	olen = len_n;
+	int64_t clen = codec_uncompress(i, in_len, o, &olen);
+	if (clen < 0 || olen != len_n) {
 	    free(o_orig);
 	    return -1;
 	}
 	i += clen;
+	in_len -= clen;
 	o += olen;
     }
 
     // Reorder
+    xn_merge(o_orig, ulen, n, out);
+    free(o_orig);
+
+    *out_len = ulen;
+    return i-in;
+}
+
+//-----------------------------------------------------------------------------
+// INT32: transforms of 32-bit little-endian integers, as written by the
+// name tokeniser's encode_token_int, ahead of the entropy encoders.  In
+// order, optionally:
+//
+//   INT_DELTA   each value minus the previous one
+//   INT_ZIGZAG  signed to unsigned; 0,-1,1,-2 to 0,1,2,3
+//
+// then at most one of:
+//
+//   INT_VARINT  7 bits per byte, as per i7put
+//   INT_BITS    bit-planes: bit 0 of every value, then bit 1, etc
+//
+// with the result encoded by codec_compress() without XN if either of
+// those is used, or as X4 otherwise.  The format is the tag, i7 length,
+// flags, the number of bit-planes if INT_BITS, the i7 transformed length,
+// and then the nested stream.
+
+#define INT_DELTA  1
+#define INT_ZIGZAG 2
+#define INT_VARINT 4
+#define INT_BITS   8
+
+// The transforms used by each INT32 method.
+static int int_flags(int m) {
+    switch (m) {
+    case INT32:   return INT_DELTA | INT_ZIGZAG;
+    case INT_V:   return INT_VARINT;
+    case INT_DZV: return INT_DELTA | INT_ZIGZAG | INT_VARINT;
+    case INT_DZB: return INT_DELTA | INT_ZIGZAG | INT_BITS;
+    default:      return -1;
+    }
+}
+
+static int int_ok(uint64_t in_len) {
+    return in_len % 4 == 0 && in_len >= 64;
+}
+
+static void int_delta(uint32_t *v, uint64_t n, int flags) {
+    uint32_t last = 0, d;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+	d = v[i];
+	if (flags & INT_DELTA)
+	    d -= last, last = v[i];
+	if (flags & INT_ZIGZAG)
+	    d = (d << 1) ^ -(d >> 31);
+	v[i] = d;
+    }
+}
+
+// The inverse of int_delta from v[i] onwards.
+static void int_undelta_scalar(uint32_t *v, uint64_t n, int flags,
+			       uint64_t i) {
+    uint32_t last = i ? v[i-1] : 0, d;
+
+    for (; i < n; i++) {
+	d = v[i];
+	if (flags & INT_ZIGZAG)
+	    d = (d >> 1) ^ -(d & 1);
+	if (flags & INT_DELTA)
+	    d += last, last = d;
+	v[i] = d;
+    }
+}
+
+// Bit-planes of n values of nb bits, each plane (n+7)/8 bytes with
+// value i at bit i%8 of byte i/8.
+static void int_bits_scalar(uint32_t *v, uint64_t n, int nb, uint8_t *out,
+			    uint64_t i) {
+    uint64_t pb = (n+7)/8;
+    int b;
+
+    for (; i < n; i++)
+	for (b = 0; b < nb; b++)
+	    out[b*pb + i/8] |= ((v[i] >> b) & 1) << (i&7);
+}
+
+static void int_unbits_scalar(uint8_t *in, uint64_t n, int nb, uint32_t *v,
+			      uint64_t i) {
+    uint64_t pb = (n+7)/8;
+    int b;
+
+    for (; i < n; i++) {
+	uint32_t x = 0;
+	for (b = 0; b < nb; b++)
+	    x |= (uint32_t)((in[b*pb + i/8] >> (i&7)) & 1) << b;
+	v[i] = x;
+    }
+}
+
+#ifdef CODEC_X86_KERNELS
+// These are SSE2 only, which all x86-64 has, but are used alongside the
+// XN kernels so RANS_CPU=scalar disables them too.
+
+// Undoes zig-zag and delta 4 values at a time, the latter by a prefix
+// sum: add the vector shifted by one lane, then by two, then the total
+// so far.  Returns the number of values done.
+static uint64_t int_undelta_sse2(uint32_t *v, uint64_t n, int flags) {
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+    __m128i carry = zero;
+    uint64_t i;
+
+    for (i = 0; i+4 <= n; i += 4) {
+	__m128i x = _mm_loadu_si128((__m128i *)(v+i));
+	if (flags & INT_ZIGZAG)
+	    x = _mm_xor_si128(_mm_srli_epi32(x, 1),
+			      _mm_sub_epi32(zero, _mm_and_si128(x, one)));
+	if (flags & INT_DELTA) {
+	    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+	    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+	    x = _mm_add_epi32(x, carry);
+	    carry = _mm_shuffle_epi32(x, 0xff);
+	}
+	_mm_storeu_si128((__m128i *)(v+i), x);
+    }
+
+    return i;
+}
+
+// 16 values at a time: gather byte k of each, in value order, then
+// movemask picks out one bit of every byte per plane.
+static uint64_t int_bits_sse2(uint32_t *v, uint64_t n, int nb,
+			      uint8_t *out) {
+    __m128i ff = _mm_set1_epi32(0xff);
+    uint64_t pb = (n+7)/8, i;
+    int k, j;
+
+    for (i = 0; i+16 <= n; i += 16) {
+	__m128i a = _mm_loadu_si128((__m128i *)(v+i));
+	__m128i b = _mm_loadu_si128((__m128i *)(v+i+4));
+	__m128i c = _mm_loadu_si128((__m128i *)(v+i+8));
+	__m128i d = _mm_loadu_si128((__m128i *)(v+i+12));
+	for (k = 0; k*8 < nb; k++) {
+	    __m128i w0 = _mm_packs_epi32(
+		_mm_and_si128(_mm_srli_epi32(a, 8*k), ff),
+		_mm_and_si128(_mm_srli_epi32(b, 8*k), ff));
+	    __m128i w1 = _mm_packs_epi32(
+		_mm_and_si128(_mm_srli_epi32(c, 8*k), ff),
+		_mm_and_si128(_mm_srli_epi32(d, 8*k), ff));
+	    __m128i x = _mm_packus_epi16(w0, w1);
+	    for (j = 0; j < 8 && k*8+j < nb; j++) {
+		// Shift bit j to the top of each byte
+		uint16_t m = _mm_movemask_epi8(
+		    _mm_slli_epi16(x, 7-j));
+		memcpy(out + (k*8+j)*pb + i/8, &m, 2);
+	    }
+	}
+    }
+
+    return i;
+}
+
+// The inverse: each plane's 16 bits are spread to one byte per value,
+// set to 1<<j if present, and OR'd into byte k of the values.
+static uint64_t int_unbits_sse2(uint8_t *in, uint64_t n, int nb,
+				uint32_t *v) {
+    __m128i sel = _mm_set_epi8(-128,64,32,16,8,4,2,1, -128,64,32,16,8,4,2,1);
+    __m128i zero = _mm_setzero_si128();
+    uint64_t pb = (n+7)/8, i;
+    int k, j;
+
+    for (i = 0; i+16 <= n; i += 16) {
+	__m128i a = zero, b = zero, c = zero, d = zero;
+	for (k = 0; k*8 < nb; k++) {
+	    __m128i x = zero;
+	    for (j = 0; j < 8 && k*8+j < nb; j++) {
+		uint8_t *p = in + (k*8+j)*pb + i/8;
+		__m128i m = _mm_unpacklo_epi64(_mm_set1_epi8(p[0]),
+					       _mm_set1_epi8(p[1]));
+		m = _mm_cmpeq_epi8(_mm_and_si128(m, sel), sel);
+		x = _mm_or_si128(x, _mm_and_si128(m, _mm_set1_epi8(1<<j)));
+	    }
+	    __m128i lo = _mm_unpacklo_epi8(x, zero);
+	    __m128i hi = _mm_unpackhi_epi8(x, zero);
+	    a = _mm_or_si128(a, _mm_slli_epi32(_mm_unpacklo_epi16(lo, zero), 8*k));
+	    b = _mm_or_si128(b, _mm_slli_epi32(_mm_unpackhi_epi16(lo, zero), 8*k));
+	    c = _mm_or_si128(c, _mm_slli_epi32(_mm_unpacklo_epi16(hi, zero), 8*k));
+	    d = _mm_or_si128(d, _mm_slli_epi32(_mm_unpackhi_epi16(hi, zero), 8*k));
+	}
+	_mm_storeu_si128((__m128i *)(v+i),    a);
+	_mm_storeu_si128((__m128i *)(v+i+4),  b);
+	_mm_storeu_si128((__m128i *)(v+i+8),  c);
+	_mm_storeu_si128((__m128i *)(v+i+12), d);
+    }
+
+    return i;
+}
+#endif /* CODEC_X86_KERNELS */
+
+static void int_undelta(uint32_t *v, uint64_t n, int flags) {
+    uint64_t i = 0;
+#ifdef CODEC_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	i = int_undelta_sse2(v, n, flags);
+#endif
+    int_undelta_scalar(v, n, flags, i);
+}
+
+static void int_bits(uint32_t *v, uint64_t n, int nb, uint8_t *out) {
+    uint64_t i = 0;
+    memset(out, 0, nb * ((n+7)/8));
+#ifdef CODEC_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	i = int_bits_sse2(v, n, nb, out);
+#endif
+    int_bits_scalar(v, n, nb, out, i);
+}
+
+static void int_unbits(uint8_t *in, uint64_t n, int nb, uint32_t *v) {
+    uint64_t i = 0;
+#ifdef CODEC_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	i = int_unbits_sse2(in, n, nb, v);
+#endif
+    int_unbits_scalar(in, n, nb, v, i);
+}
+
+// Applies the transforms in flags to in, returning a malloced buffer of
+// *t_len bytes and the number of bit-planes in *nb, or NULL on failure.
+static uint8_t *int_transform(uint8_t *in, uint64_t in_len, int flags,
+			      uint64_t *t_len, int *nb) {
+    uint64_t n = in_len/4, i;
+    uint32_t *v = malloc(in_len + 4), all = 0;
+    uint8_t *t;
+
+    if (!v)
+	return NULL;
+    memcpy(v, in, in_len);
+    int_delta(v, n, flags);
+    *nb = 0;
+
+    if (flags & INT_VARINT) {
+	if (!(t = malloc(5*n + 1))) {
+	    free(v);
+	    return NULL;
+	}
+	for (*t_len = i = 0; i < n; i++)
+	    *t_len += i7put(t + *t_len, v[i]);
+	free(v);
+	return t;
+    }
+
+    if (flags & INT_BITS) {
+	for (i = 0; i < n; i++)
+	    all |= v[i];
+	*nb = all ? 32 - __builtin_clz(all) : 0;
+	*t_len = *nb * ((n+7)/8);
+	if (!(t = malloc(*t_len + 1))) {
+	    free(v);
+	    return NULL;
+	}
+	int_bits(v, n, *nb, t);
+	free(v);
+	return t;
+    }
+
+    *t_len = in_len;
+    return (uint8_t *)v;
+}
+
+int int_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+	       int flags, int level) {
+    uint64_t t_len, olen;
+    uint8_t *t, *cp = out;
+    int nb, err;
+
+    if (in_len % 4 || flags < 0 || *out_len < 24)
+	return -1;
+    if (!(t = int_transform(in, in_len, flags, &t_len, &nb)))
+	return -1;
+
+    *cp++ = INT32;
+    cp += i7put(cp, in_len);
+    *cp++ = flags;
+    if (flags & INT_BITS)
+	*cp++ = nb;
+    cp += i7put(cp, t_len);
+
+    olen = *out_len - (cp-out);
+    err = flags & (INT_VARINT | INT_BITS)
+	? codec_compress(t, t_len, cp, &olen, 1, level)
+	: xn_encode(t, t_len, cp, &olen, 4, level);
+    free(t);
+    if (err < 0)
+	return -1;
+
+    *out_len = cp-out + olen;
+    return 0;
+}
+
+int int_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
+    uint8_t *cp = in+1, *t;
+    uint64_t ulen, t_len, olen, n, i, j;
+    uint32_t *v;
+    int flags, nb = 0;
+    int64_t clen;
+
+    cp += i7get(cp, &ulen);
+    flags = *cp++;
+    if (flags & INT_BITS)
+	nb = *cp++;
+    cp += i7get(cp, &t_len);
+    n = ulen/4;
+
+    if (ulen % 4 || ulen > *out_len || (flags & ~15) || nb > 32 ||
+	((flags & INT_VARINT) && (flags & INT_BITS)) || cp-in >= in_len)
+	return -1;
+    if (flags & INT_VARINT
+	? t_len > 5*n
+	: t_len != (flags & INT_BITS ? nb * ((n+7)/8) : ulen))
+	return -1;
+
+    if (!(t = malloc(t_len + 4)))
+	return -1;
+    olen = t_len;
+    clen = codec_uncompress(cp, in_len - (cp-in), t, &olen);
+    if (clen < 0 || olen != t_len) {
+	free(t);
+	return -1;
+    }
+
+    if (flags & (INT_VARINT | INT_BITS)) {
+	if (!(v = malloc(ulen + 4))) {
+	    free(t);
+	    return -1;
+	}
+	if (flags & INT_BITS) {
+	    int_unbits(t, n, nb, v);
+	} else {
+	    // As i7get, but bounds checked
+	    for (i = j = 0; i < n; i++) {
+		uint32_t x = 0;
+		int s = 0;
+		do {
+		    if (j >= t_len || s > 28) {
+			free(t);
+			free(v);
+			return -1;
+		    }
+		    x |= (uint32_t)(t[j] & 0x7f) << s;
+		    s += 7;
+		} while (t[j++] & 0x80);
+		v[i] = x;
+	    }
+	    if (j != t_len) {
+		free(t);
+		free(v);
+		return -1;
+	    }
+	}
+	free(t);
+    } else {
+	v = (uint32_t *)t;
+    }
+
+    int_undelta(v, n, flags);
+    memcpy(out, v, ulen);
+    free(v);
+
+    *out_len = ulen;
+    return cp-in + clen;
+}
+
+//-----------------------------------------------------------------------------
+// tANS: table-driven ANS, as per FSE, on order-0 statistics.  Aimed at
+// small skewed alphabets, such as token types, where it has a smaller
+// header than rANS and decodes with one table lookup and a bit read per
+// symbol.
+//
+// Symbol i uses state i%S and bit-stream i%S, with S of 1 for small
+// inputs and TANS_NS otherwise.  Separate bit-streams keep the states
+// independent, so their decoding overlaps.
+//
+// Format: tag, i7 length, table log L plus 16 if S > 1, number of
+// symbols-1, then each symbol and its i7 frequency-1, the frequencies
+// totalling 1<<L.  Then per state the decoder start state (2 bytes) and
+// i7 bit-stream length, followed by the bit-streams.  Bits are least
+// significant first, in decode order.
+
+#define TANS_MAX_LOG 11
+#define TANS_NS      4
+#ifndef TANS_NS_MIN
+#define TANS_NS_MIN  16384 // input size for TANS_NS states
+#endif
+
+typedef struct {
+    uint16_t next;  // next state, minus the bits to read
+    uint8_t  sym;
+    uint8_t  nbits;
+} tans_dec;
+
+static int tans_hb(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+// Normalises counts F, totalling in_len with nsym non-zero, into N which
+// sums to 1<<L and keeps every symbol present.  Returns L.
+static int tans_norm(int *F, uint64_t in_len, int nsym, int *N) {
+    int L = 5, tot, sum = 0, i;
+
+    while (L < TANS_MAX_LOG && ((1<<L) < in_len || (1<<L) < 4*nsym))
+	L++;
+    tot = 1<<L;
+
+    for (i = 0; i < 256; i++) {
+	N[i] = F[i] ? (F[i] * (uint64_t)tot + in_len/2) / in_len : 0;
+	if (F[i] && !N[i])
+	    N[i] = 1;
+	sum += N[i];
+    }
+
+    // Rounding errors go to, or come from, the commonest symbols.
+    while (sum != tot) {
+	int m = 0;
+	for (i = 1; i < 256; i++)
+	    if (N[m] < N[i])
+		m = i;
+	int d = sum < tot ? tot - sum : -(N[m]-1 < sum-tot ? N[m]-1 : sum-tot);
+	N[m] += d;
+	sum += d;
+    }
+
+    return L;
+}
+
+// The symbol at each state, spread so each symbol's states are roughly
+// evenly distributed.  The step is odd, so visits every slot.
+static void tans_spread(int *N, int L, uint8_t *spread) {
+    int tot = 1<<L, mask = tot-1, step = (tot>>1) + (tot>>3) + 3;
+    int s, k, pos = 0;
+
+    for (s = 0; s < 256; s++) {
+	for (k = 0; k < N[s]; k++) {
+	    spread[pos] = s;
+	    pos = (pos + step) & mask;
+	}
+    }
+}
+
+int tans_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+		codec_stats *st) {
+    int F_[256], *F = st ? st->F0 : F_, N[256], nsym = 0, L, tot, i;
+    uint8_t spread[1<<TANS_MAX_LOG], *cp = out;
+    uint16_t etab[1<<TANS_MAX_LOG], *rec;
+    int cum[256], dfind[256];
+    uint32_t dnb[256], x[TANS_NS];
+    uint64_t j;
+
+    if (!st) {
+	memset(F_, 0, sizeof(F_));
+	for (j = 0; j < in_len; j++)
+	    F_[in[j]]++;
+    }
+    for (i = 0; i < 256; i++)
+	nsym += F[i] != 0;
+    if (!nsym)
+	return cat_encode(in, in_len, out, out_len);
+    if (!(rec = malloc(in_len * sizeof(*rec))))
+	return -1;
+
+    L = tans_norm(F, in_len, nsym, N);
+    tot = 1<<L;
+    tans_spread(N, L, spread);
+
+    // Encoder states are tot plus the decoder state.  Each symbol's
+    // states are in etab from cum[s], in state order.
+    for (cum[0] = 0, i = 1; i < 256; i++)
+	cum[i] = cum[i-1] + N[i-1];
+    for (i = 0; i < 256; i++) {
+	if (!N[i])
+	    continue;
+	int maxb = N[i] == 1 ? L : L - tans_hb(N[i]-1);
+	dnb[i] = (maxb << 16) - (N[i] << maxb);
+	dfind[i] = cum[i] - N[i];
+    }
+    for (i = 0; i < tot; i++)
+	etab[cum[spread[i]]++] = tot + i;
+
+    // Encode backwards, recording the bits emitted per symbol as value
+    // plus 11-bit-shifted length, to write out forwards.
+    int ns = in_len < TANS_NS_MIN ? 1 : TANS_NS, k;
+    uint64_t nbytes[TANS_NS] = {0}, tbytes = 0;
+    for (k = 0; k < ns; k++)
+	x[k] = tot;
+    for (j = in_len; j-- > 0;) {
+	uint32_t *xp = &x[j%ns];
+	int s = in[j], nb = (*xp + dnb[s]) >> 16;
+	rec[j] = (*xp & ((1<<nb)-1)) | (nb << 11);
+	nbytes[j%ns] += nb;
+	*xp = etab[(*xp >> nb) + dfind[s]];
+    }
+    for (k = 0; k < ns; k++)
+	tbytes += nbytes[k] = (nbytes[k]+7)/8;
+
+    if (1 + 10 + 2 + 3*nsym + 12*ns + tbytes + 8 > *out_len) {
+	free(rec);
+	return cat_encode(in, in_len, out, out_len);
+    }
+
+    *cp++ = TANS;
+    cp += i7put(cp, in_len);
+    *cp++ = L | (ns > 1) << 4;
+    *cp++ = nsym-1;
+    for (i = 0; i < 256; i++) {
+	if (N[i]) {
+	    *cp++ = i;
+	    cp += i7put(cp, N[i]-1);
+	}
+    }
+    for (k = 0; k < ns; k++) {
+	*cp++ = (x[k]-tot) & 0xff;
+	*cp++ = (x[k]-tot) >> 8;
+	cp += i7put(cp, nbytes[k]);
+    }
+
+    for (k = 0; k < ns; k++) {
+	uint64_t acc = 0;
+	int nacc = 0;
+	for (j = k; j < in_len; j += ns) {
+	    acc |= (uint64_t)(rec[j] & 0x7ff) << nacc;
+	    nacc += rec[j] >> 11;
+	    if (nacc >= 32) {
+		uint32_t w = acc;
+		memcpy(cp, &w, 4);
+		cp += 4;
+		acc >>= 32;
+		nacc -= 32;
+	    }
+	}
+	for (; nacc > 0; nacc -= 8, acc >>= 8)
+	    *cp++ = acc;
+    }
+    free(rec);
+
+    *out_len = cp-out;
+    return 0;
+}
+
+// Returns number of bytes read from 'in' on success,
+//        -1 on failure.
+int64_t tans_decode(uint8_t *in, uint64_t in_len, uint8_t *out,
+		    uint64_t *out_len) {
+    uint8_t *cp = in+1, *end = in+in_len, spread[1<<TANS_MAX_LOG];
+    uint8_t *bs[TANS_NS];
+    tans_dec dt[1<<TANS_MAX_LOG];
+    int N[256] = {0}, next[256], L, tot, nsym, ns, sum = 0, i, k;
+    uint64_t ulen, v, j, nbytes[TANS_NS], pos[TANS_NS] = {0};
+    uint32_t x[TANS_NS];
+
+    cp += i7get(cp, &ulen);
+    L = *cp & 15;
+    ns = *cp++ & 16 ? TANS_NS : 1;
+    nsym = *cp++ + 1;
+    if (ulen > *out_len || L < 1 || L > TANS_MAX_LOG)
+	return -1;
+    tot = 1<<L;
+    for (i = 0; i < nsym && cp < end; i++) {
+	int s = *cp++;
+	cp += i7get(cp, &v);
+	if (N[s] || v >= tot)
+	    return -1;
+	N[s] = v+1;
+	sum += v+1;
+    }
+    if (sum != tot)
+	return -1;
+    for (k = 0; k < ns; k++) {
+	if (cp + 3 > end)
+	    return -1;
+	x[k] = cp[0] | (cp[1]<<8);
+	cp += 2;
+	cp += i7get(cp, &nbytes[k]);
+	if (x[k] >= tot)
+	    return -1;
+    }
+    for (k = 0; k < ns; k++) {
+	if (nbytes[k] > end-cp)
+	    return -1;
+	bs[k] = cp;
+	cp += nbytes[k];
+    }
+
+    tans_spread(N, L, spread);
+    memcpy(next, N, sizeof(next));
+    for (i = 0; i < tot; i++) {
+	int s = spread[i], n = next[s]++, nb = L - tans_hb(n);
+	dt[i].sym = s;
+	dt[i].nbits = nb;
+	dt[i].next = (n << nb) - tot;
+    }
+
+#define TANS_DEC(k) do {					\
+	tans_dec d = dt[x##k];					\
+	out[j+k] = d.sym;					\
+	x##k = d.next + (b##k & ((1u << d.nbits) - 1));		\
+	b##k >>= d.nbits;					\
+	p##k += d.nbits;					\
+    } while (0)
+
+    // One unaligned load gives at least 57 bits, enough for 5 symbols.
     j = 0;
-    while (j < ulen) {
-	out[j++] = o_orig[i4[0]++];
-	out[j++] = o_orig[i4[1]++];
-	out[j++] = o_orig[i4[2]++];
-	out[j++] = o_orig[i4[3]++];
+    if (ns == TANS_NS) {
+	uint32_t x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+	uint64_t p0 = 0, p1 = 0, p2 = 0, p3 = 0;
+	while (j + 5*4 <= ulen &&
+	       (p0>>3) + 8 <= nbytes[0] && (p1>>3) + 8 <= nbytes[1] &&
+	       (p2>>3) + 8 <= nbytes[2] && (p3>>3) + 8 <= nbytes[3]) {
+	    uint64_t b0, b1, b2, b3;
+	    memcpy(&b0, bs[0] + (p0>>3), 8); b0 >>= p0 & 7;
+	    memcpy(&b1, bs[1] + (p1>>3), 8); b1 >>= p1 & 7;
+	    memcpy(&b2, bs[2] + (p2>>3), 8); b2 >>= p2 & 7;
+	    memcpy(&b3, bs[3] + (p3>>3), 8); b3 >>= p3 & 7;
+	    for (k = 0; k < 5; k++, j += 4) {
+		TANS_DEC(0);
+		TANS_DEC(1);
+		TANS_DEC(2);
+		TANS_DEC(3);
+	    }
+	}
+	x[0] = x0, x[1] = x1, x[2] = x2, x[3] = x3;
+	pos[0] = p0, pos[1] = p1, pos[2] = p2, pos[3] = p3;
+    }
+#undef TANS_DEC
+
+    // The remainder a symbol at a time, with bounds checked reads.
+    for (; j < ulen; j++) {
+	uint64_t b = 0, *p = &pos[j%ns];
+	uint32_t *xp = &x[j%ns];
+	uint8_t *c = bs[j%ns];
+	for (k = 0; k < 3 && (*p>>3) + k < nbytes[j%ns]; k++)
+	    b |= (uint64_t)c[(*p>>3) + k] << (8*k);
+	b >>= *p & 7;
+	tans_dec d = dt[*xp];
+	out[j] = d.sym;
+	*xp = d.next + (b & ((1u << d.nbits) - 1));
+	*p += d.nbits;
     }
 
-    free(o_orig);
+    for (k = 0; k < ns; k++)
+	if (pos[k] > nbytes[k]*8)
+	    return -1;
 
-    *out_len = j;
-    return i-in;
+    *out_len = ulen;
+    return cp-in;
+}
+
+//-----------------------------------------------------------------------------
+// ARITH: an adaptive binary range coder, as per LZMA, with no table to
+// transmit.  Meant for descriptors so small that a static frequency table
+// costs more than the data.
+//
+// Symbols are coded a bit at a time down a binary tree, each node having
+// a 16-bit probability.  Nodes adapt quickly at first and then settle,
+// with the rate depending on how many updates they've had.  Order-1 uses
+// the previous symbol as context, which for a token type column is the
+// previous token type.  Its contexts are set up on first use, from the
+// order-0 model so far.
+//
+// Format: tag, i7 length, order, i7 coded length, then the coded bytes.
+// The coder's first byte is always zero, and the decoder reads zeros
+// past the end, so neither the first byte nor any trailing zeros are
+// stored.
+
+#ifndef ARITH_MAX_LEN
+#define ARITH_MAX_LEN (16<<10) // larger inputs decode too slowly
+#endif
+
+typedef struct {
+    uint16_t p[256]; // probability of a 0, per tree node
+    uint8_t  n[256]; // updates so far, up to 15
+} arith_model;
+
+typedef struct {
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache, *out, *end;
+    uint64_t ncache;
+} arith_enc;
+
+typedef struct {
+    uint32_t range, code;
+    uint8_t *in, *end;
+} arith_dec;
+
+static void arith_init(arith_model *m) {
+    int i;
+    for (i = 0; i < 256; i++) {
+	m->p[i] = 1<<15;
+	m->n[i] = 0;
+    }
+}
+
+static void arith_shift_low(arith_enc *rc) {
+    if ((uint32_t)rc->low < 0xff000000 || (rc->low >> 32)) {
+	uint8_t carry = rc->low >> 32, c = rc->cache;
+	do {
+	    if (rc->out < rc->end)
+		*rc->out = c + carry;
+	    rc->out++;
+	    c = 0xff;
+	} while (--rc->ncache);
+	rc->cache = rc->low >> 24;
+    }
+    rc->ncache++;
+    rc->low = (rc->low & 0x00ffffff) << 8;
+}
+
+// The adaption shift for a node updated n times; roughly 1/(n+2) at
+// first, settling at 1/32.
+static const uint8_t arith_sh[16] = {
+    1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 5
+};
+
+static inline void arith_update(arith_model *m, int c, int bit) {
+    int sh = arith_sh[m->n[c]];
+    if (bit)
+	m->p[c] -= m->p[c] >> sh;
+    else
+	m->p[c] += (65536 - m->p[c]) >> sh;
+    m->n[c] += m->n[c] < 15;
+}
+
+static inline void arith_put(arith_enc *rc, arith_model *m, int c, int bit) {
+    uint32_t bound = (rc->range >> 16) * m->p[c];
+    if (bit) {
+	rc->low += bound;
+	rc->range -= bound;
+    } else {
+	rc->range = bound;
+    }
+    arith_update(m, c, bit);
+    while (rc->range < (1u<<24)) {
+	rc->range <<= 8;
+	arith_shift_low(rc);
+    }
+}
+
+static inline int arith_get(arith_dec *rc, arith_model *m, int c) {
+    uint32_t bound = (rc->range >> 16) * m->p[c];
+    int bit = rc->code >= bound;
+    if (bit) {
+	rc->code -= bound;
+	rc->range -= bound;
+    } else {
+	rc->range = bound;
+    }
+    arith_update(m, c, bit);
+    while (rc->range < (1u<<24)) {
+	rc->range <<= 8;
+	rc->code = (rc->code << 8) | (rc->in < rc->end ? *rc->in : 0);
+	rc->in++;
+    }
+    return bit;
+}
+
+// The order-1 model for context c, created from the order-0 one with its
+// counts capped so it still adapts quickly.
+static arith_model *arith_ctx(arith_model **ctx, arith_model *pool,
+			      int *nctx, arith_model *o0, int c) {
+    if (!ctx[c]) {
+	int i;
+	ctx[c] = &pool[(*nctx)++];
+	memcpy(ctx[c]->p, o0->p, sizeof(o0->p));
+	for (i = 0; i < 256; i++)
+	    ctx[c]->n[i] = o0->n[i] < 2 ? o0->n[i] : 2;
+    }
+    return ctx[c];
+}
+
+int arith_encode(uint8_t *in, uint64_t in_len, uint8_t *out,
+		 uint64_t *out_len, int order) {
+    arith_model o0, *ctx[256] = {0}, *pool = NULL, *m = &o0;
+    uint8_t *cp = out;
+    int nctx = 0, last = 0, i;
+    uint64_t j;
+
+    if (*out_len < 32)
+	return -1;
+    if (order && !(pool = malloc(256 * sizeof(*pool))))
+	return -1;
+    arith_init(&o0);
+
+    *cp++ = ARITH;
+    cp += i7put(cp, in_len);
+    *cp++ = order;
+
+    // Leave room for the coded length, moving the data down after.
+    arith_enc rc = {0, 0xffffffff, 0, cp + 9, out + *out_len, 1};
+    for (j = 0; j < in_len; j++) {
+	int c = 1, s = in[j], b;
+	if (order)
+	    m = arith_ctx(ctx, pool, &nctx, &o0, last);
+	for (i = 7; i >= 0; i--) {
+	    b = (s >> i) & 1;
+	    if (order)
+		arith_update(&o0, c, b);
+	    arith_put(&rc, m, c, b);
+	    c = c*2 + b;
+	}
+	last = s;
+    }
+
+    // Any value in low to low+range-1 will do, so pick the one with the
+    // most trailing zeros.
+    for (i = 32; i > 0; i--) {
+	uint64_t mask = (1ull << i) - 1, v = (rc.low + mask) & ~mask;
+	if (v < rc.low + rc.range) {
+	    rc.low = v;
+	    break;
+	}
+    }
+    for (i = 0; i < 5; i++)
+	arith_shift_low(&rc);
+    free(pool);
+
+    if (rc.out > rc.end)
+	return cat_encode(in, in_len, out, out_len);
+    while (rc.out > cp + 10 && rc.out[-1] == 0)
+	rc.out--;
+
+    uint64_t clen = rc.out - (cp + 10);
+    int nb = i7put(cp, clen);
+    memmove(cp + nb, cp + 10, clen);
+
+    *out_len = cp + nb + clen - out;
+    return 0;
+}
+
+// Returns number of bytes read from 'in' on success,
+//        -1 on failure.
+int64_t arith_decode(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len) {
+    arith_model o0, *ctx[256] = {0}, *pool = NULL, *m = &o0;
+    uint8_t *cp = in+1;
+    uint64_t ulen, clen, j;
+    int nctx = 0, last = 0, order, i;
+
+    cp += i7get(cp, &ulen);
+    order = *cp++;
+    cp += i7get(cp, &clen);
+    if (ulen > *out_len || order > 1 || clen > in_len - (cp-in))
+	return -1;
+    if (order && !(pool = malloc(256 * sizeof(*pool))))
+	return -1;
+    arith_init(&o0);
+
+    arith_dec rc = {0xffffffff, 0, cp, cp+clen};
+    for (i = 0; i < 4; i++)
+	rc.code = (rc.code << 8) | (rc.in < rc.end ? *rc.in : 0), rc.in++;
+
+    for (j = 0; j < ulen; j++) {
+	int c = 1;
+	if (order)
+	    m = arith_ctx(ctx, pool, &nctx, &o0, last);
+	for (i = 0; i < 8; i++) {
+	    int b = arith_get(&rc, m, c);
+	    if (order)
+		arith_update(&o0, c, b);
+	    c = c*2 + b;
+	}
+	out[j] = last = c & 0xff;
+    }
+    free(pool);
+
+    *out_len = ulen;
+    return cp-in + clen;
 }
 
 //-----------------------------------------------------------------------------
@@ -397,132 +1826,477 @@ static unsigned char *load(char *fn, uint64_t *lenp) {
     return data;
 }
 
-int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int no_X4) {
-    uint64_t best_sz = UINT64_MAX;
-    codec_t best = CAT;
-    uint64_t olen = *out_len;
+//-----------------------------------------------------------------------------
+// Input analysis and size estimates.  The estimates are used by the
+// lower levels to pick a method without trial encoding, and are in bytes
+// including the codec headers.
 
-    *out_len = olen;
-    if (cat_encode(in, in_len, out, out_len) < 0) return -1;
-#ifdef DEBUG
-    fprintf(stderr, "CAT   -> %ld\n", (long)*out_len);
-#endif
-    if (best_sz > *out_len) {
-	best_sz = *out_len;
-	best = CAT;
+// Exact size of rle_encode output, without writing it.
+static uint64_t est_rle(uint8_t *in, uint64_t in_len) {
+    uint64_t i, k = 1 + (uint64_t)i7len(in_len);
+    int last = -1, run_len = 0;
+
+    for (i = 0; i <= in_len; i++) {
+	if (i < in_len && in[i] == last) {
+	    run_len++;
+	    k += 1 + (last == GUARD);
+	    continue;
+	}
+	if (++run_len >= RUN_LEN) {
+	    k -= run_len * (1 + (last==GUARD));
+	    k += 2;
+	    while (run_len >>= 7)
+		k++;
+	    k++;
+	}
+	run_len = 0;
+	if (i < in_len)
+	    k += 1 + (in[i] == GUARD);
+	last = i < in_len ? in[i] : -1;
     }
 
-    *out_len = olen;
-    if (rle_encode(in, in_len, out, out_len) < 0) return -1;
-#ifdef DEBUG
-    fprintf(stderr, "RLE   -> %ld\n", (long)*out_len);
-#endif
-    if (best_sz > *out_len) {
-	best_sz = *out_len;
-	best = RLE;
+    return k;
+}
+
+// The order-0 and order-1 counts, plus the RLE size.
+static void codec_analyse(uint8_t *in, uint64_t in_len, codec_stats *st) {
+    int i;
+
+    rans_hist_4x16(in, in_len, st->F0, st->F1, st->T1);
+    for (st->nsym = i = 0; i < 256; i++)
+	st->nsym += st->F0[i] != 0;
+
+    st->rle_len = est_rle(in, in_len);
+}
+
+// sum F log2(T/F) for one frequency row, in bits.
+static double est_row(int *F, int T, int *nnz) {
+    double bits = 0;
+    int j;
+    for (j = 0; j < 256; j++) {
+	if (F[j]) {
+	    bits += F[j] * log2((double)T / F[j]);
+	    (*nnz)++;
+	}
     }
+    return bits;
+}
 
-    int rmethods[] = {0,1,128,129,64,65,192,193}, m;
-    for (m = 0; m < 2; m++) {
-	//for (m = 0; m < 8; m++) {
-	*out_len = olen;
-	if (rans_encode(in, in_len, out, out_len, rmethods[m]) < 0) return -1;
-#ifdef DEBUG
-	fprintf(stderr, "RANS0+%d -> %ld\n", m, (long)*out_len);
-#endif
-	if (best_sz > *out_len) {
-	    best_sz = *out_len;
-	    best = RANS0+m;
+// Order-0 and order-1 static rANS.  Table costs are approximate, at
+// one or two bytes per stored frequency.
+static void est_rans01(codec_stats *st, uint64_t in_len,
+		       double *o0, double *o1) {
+    int i, nnz0 = 0, nnz1 = 0, nctx = 0;
+    double b0, b1 = 0;
+
+    b0 = est_row(st->F0, in_len, &nnz0);
+    for (i = 0; i < 256; i++) {
+	if (st->T1[i]) {
+	    b1 += est_row(st->F1[i], st->T1[i], &nnz1);
+	    nctx++;
 	}
     }
 
-//    *out_len = olen;
-//    if (rans0_encode(in, in_len, out, out_len) < 0) return -1;
-//#ifdef DEBUG
-//    fprintf(stderr, "RANS0 -> %ld\n", (long)*out_len);
-//#endif
-//    if (best_sz > *out_len) {
-//	best_sz = *out_len;
-//	best = RANS0;
-//    }
-//
-//    if (in_len >= 4) {
-//	*out_len = olen;
-//	if (rans1_encode(in, in_len, out, out_len) < 0) return -1;
-//#ifdef DEBUG
-//	fprintf(stderr, "RANS1 -> %ld\n", (long)*out_len);
-//#endif
-//	if (best_sz > *out_len) {
-//	    best_sz = *out_len;
-//	    best = RANS1;
-//	}
-//    }
-
-    if (!no_X4 && in_len%4 == 0 && in_len >= 32) {
+    // rans_encode header ~5, order byte, 4 states
+    *o0 = b0/8 + 1.5*nnz0 + 22;
+    *o1 = b1/8 + 1.2*nnz1 + 2*nctx + nnz0 + 22;
+}
+
+// tANS, from its normalised frequencies.
+static double est_tans(codec_stats *st, uint64_t in_len) {
+    int N[256], L, i;
+    double bits = 0, hdr;
+
+    if (!st->nsym)
+	return 1e30;
+    L = tans_norm(st->F0, in_len, st->nsym, N);
+    hdr = 1 + i7len(in_len) + 2 +
+	(in_len < TANS_NS_MIN ? 1 : TANS_NS) * (2 + i7len(in_len*L/32));
+    for (i = 0; i < 256; i++) {
+	if (N[i]) {
+	    bits += st->F0[i] * (L - log2(N[i]));
+	    hdr += 1 + i7len(N[i]-1);
+	}
+    }
+
+    return bits/8 + hdr;
+}
+
+// Adaptive coding of one context's T symbols, nnz of them distinct: the
+// entropy plus the cost of learning it, about 1 + log2(T/nnz)/2 bits per
+// symbol seen, or h0 if more, plus a floor of ~0.008 bits per symbol
+// once fully adapted.  Fitted to tokenise_name3 descriptors.
+static double est_adapt(int *F, int T, double h0) {
+    int nnz = 0;
+    double bits = est_row(F, T, &nnz);
+    double learn = 1 + 0.5*log2((double)T/nnz + 1);
+    return bits + 0.8 * nnz * (learn > h0 ? learn : h0) + 0.008*T;
+}
+
+// ARITH order-0 and order-1.  New order-1 contexts start from the
+// order-0 model, so learn at no less than the order-0 cost.
+static void est_arith(codec_stats *st, uint64_t in_len,
+		      double *o0, double *o1) {
+    double hdr = 1 + i7len(in_len) + 3, b0, b1 = 0;
+    int i, nnz = 0;
+
+    if (!in_len || in_len > ARITH_MAX_LEN)
+	return;
+    b0 = est_row(st->F0, in_len, &nnz) / in_len;
+    for (i = 0; i < 256; i++)
+	if (st->T1[i])
+	    b1 += est_adapt(st->F1[i], st->T1[i], b0);
+    // Lean towards the static codecs on close calls, as they decode
+    // much faster.
+    *o0 = 1.05 * (est_adapt(st->F0, in_len, 0)/8 + hdr);
+    *o1 = 1.05 * (b1/8 + hdr);
+}
+
+// Order-2 rANS, mirroring the context reduction in rans_enc_O2_4x16:
+// a dense alphabet of D symbols with contexts d1*K + d2%K.  Returns a
+// huge size if order-2 isn't applicable.
+static double est_rans2(uint8_t *in, uint64_t in_len, codec_stats *st) {
+    int dense[256], D = 0, K, i;
+    uint64_t j;
+
+    if (in_len < 4000)
+	return 1e30;
+
+    // Byte 0 is always dense id 0, the initial context
+    dense[0] = D++;
+    for (i = 1; i < 256; i++)
+	if (st->F0[i])
+	    dense[i] = D++;
+    if (D > 64)
+	return 1e30;
+
+    K = rans_o2_K_4x16(D, in_len);
+
+    int nctx = D*K, *F = calloc((size_t)nctx*D, sizeof(*F));
+    if (!F)
+	return 1e30;
+    int d1 = 0, d2 = 0;
+    for (j = 0; j < in_len; j++) {
+	int d = dense[in[j]];
+	F[(d1*K + d2%K)*D + d]++;
+	d2 = d1;
+	d1 = d;
+    }
+
+    double bits = 0;
+    int nnz = 0, used = 0;
+    for (i = 0; i < nctx; i++) {
+	int *Fi = F + i*D, T = 0, k;
+	for (k = 0; k < D; k++)
+	    T += Fi[k];
+	if (!T)
+	    continue;
+	used++;
+	for (k = 0; k < D; k++) {
+	    if (Fi[k]) {
+		bits += Fi[k] * log2((double)T / Fi[k]);
+		nnz++;
+	    }
+	}
+    }
+    free(F);
+
+    return bits/8 + 1.2*nnz + 2*used + D + 22;
+}
+
+static void est_methods(uint8_t *in, uint64_t in_len, codec_stats *st,
+			int no_XN, double *est);
+
+// The best estimate without XN or INT32, using st as scratch space.
+static double est_best(uint8_t *in, uint64_t in_len, codec_stats *st) {
+    double est[NCODEC], best;
+    int m;
+
+    codec_analyse(in, in_len, st);
+    est_methods(in, in_len, st, 1, est);
+    for (best = est[0], m = 1; m < NCODEC; m++)
+	if (best > est[m])
+	    best = est[m];
+
+    return best;
+}
+
+// XN, each lane getting the best of the other methods.  in_n is in_len
+// bytes of scratch space.
+static double est_xn(uint8_t *in, uint64_t in_len, int n, uint8_t *in_n,
+		     codec_stats *st_n) {
+    uint64_t len_n = in_len/n;
+    double est = 1 + i7len(in_len);
+    int j;
+
+    xn_split(in, in_len, n, in_n);
+    for (j = 0; j < n; j++)
+	est += est_best(in_n + j*len_n, len_n, st_n);
+
+    return est;
+}
+
+// INT32 with the transforms in flags.
+static double est_int(uint8_t *in, uint64_t in_len, int flags,
+		      uint8_t *in_n, codec_stats *st_n) {
+    uint64_t t_len;
+    uint8_t *t;
+    double est;
+    int nb;
+
+    if (!(t = int_transform(in, in_len, flags, &t_len, &nb)))
+	return 1e30;
+    est = 3 + i7len(in_len) + i7len(t_len) + ((flags & INT_BITS) != 0);
+    est += flags & (INT_VARINT | INT_BITS)
+	? est_best(t, t_len, st_n)
+	: est_xn(t, t_len, 4, in_n, st_n);
+    free(t);
+
+    return est;
+}
+
+// Estimated output size for each method.  Methods not applicable are
+// left as a huge size.
+static void est_methods(uint8_t *in, uint64_t in_len, codec_stats *st,
+			int no_XN, double *est) {
+    int m;
+    for (m = 0; m < NCODEC; m++)
+	est[m] = 1e30;
+
+    est[CAT] = 1 + i7len(in_len) + in_len;
+    est[RLE] = st->rle_len;
+    est_rans01(st, in_len, &est[RANS0], &est[RANS1]);
+    est[RANS2] = est_rans2(in, in_len, st);
+    est[TANS] = est_tans(st, in_len);
+    est_arith(st, in_len, &est[ARITH], &est[ARITH1]);
+
+    if (no_XN || !xn_ok(in_len, 2))
+	return;
+
+    uint8_t *in_n = malloc(in_len);
+    codec_stats *st_n = malloc(sizeof(*st_n));
+    int n;
+    for (n = 2; in_n && st_n && n <= 8 && xn_ok(in_len, n); n *= 2)
+	est[xn_tag(n)] = est_xn(in, in_len, n, in_n, st_n);
+    for (m = INT32; in_n && st_n && m <= INT_DZB && int_ok(in_len); m++)
+	est[m] = est_int(in, in_len, int_flags(m), in_n, st_n);
+    free(in_n);
+    free(st_n);
+}
+
+// Encodes with a specific method.  st, if non-NULL, holds the statistics
+// of in.
+static int encode_method(codec_t m, uint8_t *in, uint64_t in_len,
+			 codec_stats *st, uint8_t *out, uint64_t *out_len,
+			 int level) {
+    int rmethods[] = {16,1,128,129,64,65,192,193};
+
+    switch (m) {
+    case CAT:
+	return cat_encode(in, in_len, out, out_len);
+    case RLE:
+	return rle_encode(in, in_len, out, out_len);
+    case RANS0:
+    case RANS1:
+	return rans_encode(in, in_len, out, out_len, rmethods[m-RANS0], st);
+    case RANS2:
+	return rans_encode(in, in_len, out, out_len, 2, st);
+    case X2:
+    case X4:
+    case X8:
+	return xn_encode(in, in_len, out, out_len, xn_width(m), level);
+    case INT32:
+    case INT_V:
+    case INT_DZV:
+    case INT_DZB:
+	return int_encode(in, in_len, out, out_len, int_flags(m), level);
+    case TANS:
+	return tans_encode(in, in_len, out, out_len, st);
+    case ARITH:
+    case ARITH1:
+	return arith_encode(in, in_len, out, out_len, m == ARITH1);
+    default:
+	return -1;
+    }
+}
+
+// Levels up to CODEC_LEVEL_TRIAL: choose from the estimates.
+static int compress_est(uint8_t *in, uint64_t in_len, codec_stats *st,
+			uint8_t *out, uint64_t *out_len, int no_XN, int level,
+			codec_t *method) {
+    double est[NCODEC];
+    uint64_t olen = *out_len, sz1;
+    codec_t m1 = CAT, m2 = CAT;
+    int m;
+
+    est_methods(in, in_len, st, no_XN, est);
+    for (m = 1; m < NCODEC; m++)
+	if (est[m1] > est[m])
+	    m1 = m;
+    for (m = 0; m < NCODEC; m++)
+	if (m != m1 && (m2 == m1 || est[m2] > est[m]))
+	    m2 = m;
+
 #ifdef DEBUG
-	fprintf(stderr, "\n");
+    fprintf(stderr, "Estimates %ld: CAT %.0f RLE %.0f R0 %.0f R1 %.0f R2 %.0f"
+	    " X2 %.0f X4 %.0f X8 %.0f -> %d, %d\n", (long)in_len, est[CAT],
+	    est[RLE], est[RANS0], est[RANS1], est[RANS2], est[X2], est[X4],
+	    est[X8], m1, m2);
 #endif
+
+    if (level <= CODEC_LEVEL_EST || est[m2] > 1.1*est[m1]) {
+	if (encode_method(m1, in, in_len, st, out, out_len, level) < 0)
+	    return -1;
+	// rANS stores raw data if out is too small for its bound; don't
+	// pay its header on top.
+	*method = m1;
+	if (*out_len <= est[CAT])
+	    return 0;
 	*out_len = olen;
-	if (x4_encode(in, in_len, out, out_len) < 0) return -1;
-#ifdef DEBUG
-	fprintf(stderr, "X4    -> %ld\n", (long)*out_len);
-#endif
-	if (best_sz > *out_len) {
-	    best_sz = *out_len;
-	    best = X4;
-	}
+	*method = CAT;
+	return cat_encode(in, in_len, out, out_len);
     }
 
-#ifdef DEBUG
-    fprintf(stderr, "Best method = %d, %ld -> %ld\n", best, (long)in_len, (long)best_sz);
+    // Close call; try the runner up first so the likely winner is
+    // usually the last written and needs no re-encode.
+    if (encode_method(m2, in, in_len, st, out, out_len, level) < 0)
+	return -1;
+    sz1 = *out_len;
+
+    *out_len = olen;
+    if (encode_method(m1, in, in_len, st, out, out_len, level) < 0)
+	return -1;
+    *method = m1;
+    if (*out_len <= sz1)
+	return 0;
+
+    *out_len = olen;
+    *method = m2;
+    return encode_method(m2, in, in_len, st, out, out_len, level);
+}
+
+int codec_compress(uint8_t *in, uint64_t in_len, uint8_t *out,
+		   uint64_t *out_len, int no_XN, int level) {
+    int method;
+    return codec_compress_m(in, in_len, out, out_len, no_XN, level, &method);
+}
+
+// As codec_compress(), also returning the method chosen in *method.  This
+// is only meaningful to codec_compress_with(); the tag byte alone doesn't
+// tell apart all methods.
+int codec_compress_m(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len, int no_XN, int level, int *method) {
+    enc_job job[NCODEC];
+    codec_t cand[NCODEC], m = CAT;
+    codec_stats st;
+    int ncand = 0, i, err;
+
+    codec_analyse(in, in_len, &st);
+    if (level <= CODEC_LEVEL_TRIAL) {
+	err = compress_est(in, in_len, &st, out, out_len, no_XN, level, &m);
+	*method = m;
+	return err;
+    }
+
+    cand[ncand++] = CAT;
+    cand[ncand++] = RANS0;
+    cand[ncand++] = RANS1;
+    if (in_len)
+	cand[ncand++] = TANS;
+    if (in_len && in_len <= ARITH_MAX_LEN) {
+	cand[ncand++] = ARITH;
+	cand[ncand++] = ARITH1;
+    }
+    // Order-2 only pays off with enough data to populate its contexts.
+    if (in_len >= 4000)
+	cand[ncand++] = RANS2;
+    if (!no_XN && xn_ok(in_len, 2))
+	cand[ncand++] = X2;
+    if (!no_XN && xn_ok(in_len, 4))
+	cand[ncand++] = X4;
+    if (!no_XN && xn_ok(in_len, 8))
+	cand[ncand++] = X8;
+    for (m = INT32; !no_XN && m <= INT_DZB && int_ok(in_len); m++)
+	cand[ncand++] = m;
+
+    for (i = 0; i < ncand; i++) {
+	job[i].m = cand[i];
+	job[i].lane = 0;
+	job[i].in = in;
+	job[i].in_len = in_len;
+	job[i].st = &st;
+	job[i].level = level;
+    }
+
+#ifndef NO_THREADS
+    if (codec_mt(in_len)) {
+	if (encode_best_mt(job, ncand, out, out_len, &m) < 0)
+	    return -1;
+    } else
 #endif
+    if (encode_best(job, ncand, out, out_len, &m) < 0)
+	return -1;
 
-    switch (best) {
-    case CAT:
-	if (cat_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
+    // RLE's size is already known, so it's only encoded if it wins.  On
+    // a tie it comes after CAT but before the rest.
+    if (st.rle_len < *out_len || (st.rle_len == *out_len && *out != CAT)) {
+	*method = RLE;
+	return rle_encode(in, in_len, out, out_len);
+    }
 
-    case RLE:
-	if (rle_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
+    *method = m;
+    return 0;
+}
+
+// Encodes with a method previously returned by codec_compress_m(),
+// skipping the analysis and search.  XN lanes still choose their own
+// methods, at the given level.  As with codec_compress(), data that
+// doesn't compress is stored with CAT.
+int codec_compress_with(uint8_t *in, uint64_t in_len, uint8_t *out,
+			uint64_t *out_len, int method, int level) {
+    uint64_t olen = *out_len;
 
+    switch (method) {
+    case RLE:
     case RANS0:
     case RANS1:
-    case PACK0:
-    case PACK1:
-    case RLE0:
-    case RLE1:
-    case PACK_RLE0:
-    case PACK_RLE1:
-	*out_len = olen;
-	int rmethods[] = {0,1,128,129,64,65,192,193}, m;
-	if (rans_encode(in, in_len, out, out_len, rmethods[best-RANS0]) < 0) return -1;
+    case RANS2:
+    case TANS:
+    case ARITH:
+    case ARITH1:
 	break;
-
-//    case RANS0:
-//	*out_len = olen;
-//	if (rans0_encode(in, in_len, out, out_len) < 0) return -1;
-//	break;
-//
-//    case RANS1:
-//	*out_len = olen;
-//	if (rans1_encode(in, in_len, out, out_len) < 0) return -1;
-//	// last method and already in this format.
-
-    default:
+    case INT32:
+    case INT_V:
+    case INT_DZV:
+    case INT_DZB:
+	if (!int_ok(in_len))
+	    method = CAT;
 	break;
+    default:
+	if (!xn_width(method) || !xn_ok(in_len, xn_width(method)))
+	    method = CAT;
     }
+    if (encode_method(method, in, in_len, NULL, out, out_len, level) < 0)
+	return -1;
+    if (method == CAT || *out_len <= in_len + 1 + i7len(in_len))
+	return 0;
 
-    return 0;
+    *out_len = olen;
+    return cat_encode(in, in_len, out, out_len);
 }
 
-uint64_t uncompressed_size(uint8_t *in, uint64_t in_len) {
+uint64_t codec_uncompressed_size(uint8_t *in, uint64_t in_len) {
     uint64_t ulen;
 
     switch(*in) {
     case CAT:
     case RLE:
+    case X2:
     case X4:
+    case X8:
+    case INT32:
+    case TANS:
+    case ARITH:
     case RANS0:
     case RANS1:
     case PACK0:
@@ -541,7 +2315,8 @@ uint64_t uncompressed_size(uint8_t *in, uint64_t in_len) {
     return ulen;
 }
 
-int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
+int codec_uncompress(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len) {
     switch (*in) {
     case CAT:
 	return cat_decode(in, in_len, out, out_len);
@@ -557,7 +2332,7 @@ int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
     case RLE1:
     case PACK_RLE0:
     case PACK_RLE1: {
-	int rmethods[] = {0,1,128,129,64,65,192,193}, m;
+	int rmethods[] = {16,1,128,129,64,65,192,193}, m;
 	return rans_decode(in, in_len, out, out_len, rmethods[*in - RANS0]);
     }
 
@@ -567,8 +2342,19 @@ int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
 //    case RANS1:
 //	return rans1_decode(in, in_len, out, out_len);
 
+    case X2:
     case X4:
-	return x4_decode(in, in_len, out, out_len);
+    case X8:
+	return xn_decode(in, in_len, out, out_len);
+
+    case INT32:
+	return int_decode(in, in_len, out, out_len);
+
+    case TANS:
+	return tans_decode(in, in_len, out, out_len);
+
+    case ARITH:
+	return arith_decode(in, in_len, out, out_len);
 
     default:
 	return -1;
@@ -579,6 +2365,14 @@ int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
 int main(int argc, char **argv) {
     uint8_t *in, *out;
     uint64_t in_len, out_len;
+    int level = CODEC_LEVEL_DEFAULT;
+
+    if (argc > 2 && strcmp(argv[1], "-l") == 0) {
+	// Compression level, 1 to 9
+	level = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
+    }
 
     if (argc > 1 && strcmp(argv[1], "-d") == 0) {
 	// Unpack a serialised list of compressed blocks to separate filenames.
@@ -586,11 +2380,11 @@ int main(int argc, char **argv) {
 
 	if (*in == 255) {
 	    // single file mode
-	    out_len = uncompressed_size(in+1, in_len-1);
+	    out_len = codec_uncompressed_size(in+1, in_len-1);
 	    out = malloc(out_len);
 	    assert(out);
 
-	    if (uncompress(in+1, in_len-1, out, &out_len) < 0)
+	    if (codec_uncompress(in+1, in_len-1, out, &out_len) < 0)
 		abort();
 
 	    if (out_len != write(1, out, out_len))
@@ -610,13 +2404,13 @@ int main(int argc, char **argv) {
 	    uint64_t clen;
 
 	    // fixme: realloc this
-	    out_len = uncompressed_size(in2, in_len);
+	    out_len = codec_uncompressed_size(in2, in_len);
 	    out = malloc(out_len);
 	    assert(out);
 
 	    //fprintf(stderr, "uncomp %d -> %d -> ", (int)in_len, (int)out_len);
 
-	    if ((clen = uncompress(in2, in_len, out, &out_len)) < 0)
+	    if ((clen = codec_uncompress(in2, in_len, out, &out_len)) < 0)
 		abort();
 
 	    //fprintf(stderr, "%d\n", (int)out_len);
@@ -650,11 +2444,11 @@ int main(int argc, char **argv) {
 	    // stdin, just for a quick single file test
 	    in = load(NULL, &in_len);
 
-	    out_len = 1.5 * rans_compress_bound_4x16(in_len, 1); // guesswork
+	    out_len = 1.5 * rans_compress_bound_4x16(in_len, 2); // guesswork
 	    out = malloc(out_len);
 	    assert(out);
 
-	    if (compress(in, in_len, out, &out_len, 0) < 0)
+	    if (codec_compress(in, in_len, out, &out_len, 0, level) < 0)
 		abort();
 
 	    uint8_t single = 255; // marker for single file format.
@@ -684,14 +2478,14 @@ int main(int argc, char **argv) {
 	    
 	    in = load(argv[i], &in_len);
 
-	    out_len = 1.5 * rans_compress_bound_4x16(in_len, 1); // guesswork
+	    out_len = 1.5 * rans_compress_bound_4x16(in_len, 2); // guesswork
 	    out = malloc(out_len);
 	    assert(out);
 
 	    uint8_t ttype8 = ttype;
 	    write(1, &ttype8, 1);
 
-	    if (compress(in, in_len, out, &out_len, 0) < 0)
+	    if (codec_compress(in, in_len, out, &out_len, 0, level) < 0)
 		abort();
 
 	    if (out_len != write(1, out, out_len))
@@ -705,3 +2499,63 @@ int main(int argc, char **argv) {
     return 0;
 }
 #endif
+
+/*
+ * Levels, on the tokenise_name3 descriptor streams in 32KB chunks
+ * (codec_compress() only):
+ *
+ *           bytes     time
+ * level 1   679421    183ms   estimates only
+ * level 6   679381    230ms   plus trial of close calls
+ * level 9   678319    381ms   exhaustive
+ *
+ * In 4KB chunks levels 1 and 9 are 705516 and 705368 bytes, at 277ms
+ * vs 982ms.
+ */
+
+/*
+ * XN on 80000 bytes of little-endian counters (i*3 + rand()%50) at the
+ * matching width:
+ *
+ *            level 1   level 9
+ * 16-bit X2  43785     41990
+ * 32-bit X4  22607     22563
+ * 64-bit X8  12017     12037
+ *
+ * Name descriptors are unchanged, as they rarely have fixed width fields.
+ */
+
+/*
+ * INT32, tokenise_name3 output at levels 1 / 9:
+ *
+ *                  before            after
+ * illumina.names   617449 / 617372   607700 / 607700
+ * pacbio.names      36604 /  36591    36586 /  36573
+ * small.names               1351               1275
+ */
+
+/*
+ * TANS, tokenise_name3 output at level 9:
+ *
+ * illumina.names   607700 -> 607608
+ * pacbio.names      36573 ->  36556
+ * small.names        1275 ->   1244
+ *
+ * Mostly from small descriptors, where its header is 10 or so bytes
+ * smaller than rANS.  On large order-0 streams the two are within 0.1%
+ * and the 4 state decoder runs at ~670MB/s vs ~620MB/s for rANS O0.
+ */
+
+/*
+ * ARITH, tokenise_name3 output at levels 1 / 6 / 9:
+ *
+ *                  before                     after
+ * illumina.names   607700 / 607700 / 607608   607756 / 606436 / 606237
+ * pacbio.names      36586 /  36572 /  36556    36569 /  36555 /  36237
+ * small.names        1275 /   1244 /   1244     1244 /   1200 /   1197
+ *
+ * It decodes at only ~20MB/s, so illumina decode goes from ~0.23s to
+ * ~0.27s.  Allowing inputs over 16KB saves just 42 more bytes there.
+ * On multi-megabyte order-1 streams it can beat static rANS by 2x, but
+ * it is far too slow for those.
+ */
@@ -1,6 +1,8 @@
 #ifndef RANS_STATIC4x16_H
 #define RANS_STATIC4x16_H
 
+typedef struct rans_ctx rans_ctx;
+
 unsigned int rans_compress_bound_4x16(unsigned int size, int order);
 unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
 				     unsigned char *out, unsigned int *out_size,
@@ -8,9 +10,45 @@ unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
 unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
 				  unsigned int *out_size, int order);
 unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
-				       unsigned char *out, unsigned int *out_size,
-				       int order);
+				       unsigned char *out, unsigned int *out_size);
 unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
-				    unsigned int *out_size, int order);
+				    unsigned int *out_size);
+
+// Reusable workspace variants; no heap allocation once warmed up.
+// The compressed data is written to the end of out and the return value
+// points to its start, which need not be out.  Out must not be NULL.
+rans_ctx *rans_ctx_create(void);
+void rans_ctx_destroy(rans_ctx *ctx);
+unsigned char *rans_compress_to_4x16_ctx(rans_ctx *ctx,
+					 unsigned char *in,  unsigned int in_size,
+					 unsigned char *out, unsigned int *out_size,
+					 int order);
+unsigned char *rans_uncompress_to_4x16_ctx(rans_ctx *ctx,
+					   unsigned char *in,  unsigned int in_size,
+					   unsigned char *out, unsigned int *out_size);
+
+// Order-0 and order-1 histograms.  F0 holds the order-0 counts.
+// F1[a][b] counts b following a, with the first symbol following 0;
+// only row 0 and the rows of symbols present are filled out.  T1 holds
+// the row totals.
+void rans_hist_4x16(unsigned char *in, unsigned int in_size,
+		    int *F0, int (*F1)[256], int *T1);
+
+// Histograms of the next rans_compress_to_4x16_ctx input, as per
+// rans_hist_4x16, if the caller already has them, saving the encoder from
+// counting again.  F1 and T1 may be NULL.  Only used for the next call,
+// and only if the data isn't PACKed or RLEd.
+void rans_ctx_set_hist(rans_ctx *ctx, int *F0, int (*F1)[256], int *T1);
+
+// The order-2 context reduction K picked by the encoder for an alphabet
+// of D dense symbols (byte 0 always counting as one) and in_size bytes.
+// Contexts are d1*K + d2%K.
+int rans_o2_K_4x16(int D, unsigned int in_size);
+
+// The run time CPU dispatch level, found once on first use: the best
+// vector kernels the host supports, lowered by RANS_CPU=scalar|sse4|
+// avx2|avx512 in the environment.  SSE4 implies SSSE3.
+enum {RANS_CPU_SCALAR, RANS_CPU_SSE4, RANS_CPU_AVX2, RANS_CPU_AVX512};
+int rans_cpu_level(void);
 
 #endif /* RANS_STATIC4x16_H */
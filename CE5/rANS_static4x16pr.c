@@ -5,6 +5,29 @@
 // top bits in order byte
 #define X_PACK 0x80
 #define X_RLE  0x40
+#define X_CAT  0x20 // raw data, no entropy encoding
+#define X_TAB  0x10 // frequency table not stored: order-1 reuses the
+                    // previous block's, order-0 uses a built-in model
+#define X_32   0x04 // 32-way interleaving instead of 4-way; order-0 only
+
+// Below this size we don't bother with rANS at all and just store the
+// data verbatim (X_CAT).  Four states take 16 bytes to flush, plus the
+// frequency table, so it can never win.
+#ifndef RANS_MIN_SIZE
+#define RANS_MIN_SIZE 20
+#endif
+
+// Below this size order-1 is demoted to order-0.  The order-1 frequency
+// tables cost far more than they save on small blocks, and building them
+// dominates the CPU time too.
+#ifndef RANS_O1_MIN_SIZE
+#define RANS_O1_MIN_SIZE 1000
+#endif
+
+// Likewise order-2 is demoted to order-1.
+#ifndef RANS_O2_MIN_SIZE
+#define RANS_O2_MIN_SIZE 4000
+#endif
 
 /*-------------------------------------------------------------------------- */
 // From here to "#endif // RANS_BYTE_HEADER" below are derived from rans_byte.h
@@ -411,6 +434,8 @@ static inline void RansDecRenorm(RansState* r, uint8_t** pptr)
 #include <string.h>
 #include <sys/time.h>
 
+#include "rANS_static4x16.h"
+
 #define TF_SHIFT 12
 #define TOTFREQ (1<<TF_SHIFT)
 
@@ -420,6 +445,25 @@ static inline void RansDecRenorm(RansState* r, uint8_t** pptr)
 #endif
 #define TOTFREQ_O1 (1<<TF_SHIFT_O1)
 
+// Range of per-block precisions for order-1 and order-2.  The minimum
+// leaves room for all 256 symbols; the maximum is bound by the 12-bit
+// bias field in the order-1 decoder tables.
+#define TF_SHIFT_MIN 8
+#define TF_SHIFT_MAX 12
+
+#ifndef TF_SHIFT_O2
+#define TF_SHIFT_O2 10
+#endif
+#define TOTFREQ_O2 (1<<TF_SHIFT_O2)
+
+// Order-2 model size limits; see rans_enc_O2_4x16
+#define O2_MAX_ENT (1<<18) // max contexts * symbols
+#define O2_MAX_CTX 4096    // max contexts, reached at 64 symbols
+#define O2_TAB_MAX (257*3 + 5*O2_MAX_CTX + 3*O2_MAX_ENT)
+#ifndef O2_KDIV
+#define O2_KDIV 4
+#endif
+
 
 /*-----------------------------------------------------------------------------
  * Memory to memory compression functions.
@@ -498,6 +542,253 @@ static void present8(unsigned char *in, unsigned int in_size, int F0[256]) {
 	F0[i] += F1[i] + F2[i] + F3[i] + F4[i] + F5[i] + F6[i] + F7[i];
 }
 
+#ifdef UNUSED
+static void hist1_1(unsigned char *in, unsigned int in_size,
+		    int F0[256][256], int T0[256]) {
+    unsigned int last_i, i;
+    unsigned char c;
+
+    for (last_i=i=0; i<in_size; i++) {
+	F0[last_i][c = in[i]]++;
+	T0[last_i]++;
+	last_i = c;
+    }
+}
+#endif
+
+// Order-1 histogram, as 4 interleaved streams to break the dependency
+// between consecutive updates.  Runs are the worst case, with every
+// stream repeatedly incrementing the same F0[c][c] cell, so whole runs of
+// 8 are spotted with a single 64-bit compare and counted in one go.
+static void hist1_4(unsigned char *in, unsigned int in_size,
+		    int F0[256][256], int *T0) {
+    int T1[256+MAGIC] = {0}, T2[256+MAGIC] = {0}, T3[256+MAGIC] = {0};
+    unsigned int idiv4 = in_size/4;
+    int i;
+    unsigned char c;
+
+    unsigned char *in0 = in + 0;
+    unsigned char *in1 = in + idiv4;
+    unsigned char *in2 = in + idiv4*2;
+    unsigned char *in3 = in + idiv4*3;
+
+    unsigned char last_0 = 0, last_1 = in1[-1], last_2 = in2[-1], last_3 = in3[-1];
+    //unsigned char last_0 = 0, last_1 = 0, last_2 = 0, last_3 = 0;
+
+    unsigned char *in0_end = in1;
+
+#define H1_STEP(k)				\
+    do {					\
+	F0[last_##k][c = *in##k++]++;		\
+	T##k[last_##k]++;			\
+	last_##k = c;				\
+    } while (0)
+
+#define H1_STEP8(k)						\
+    do {							\
+	uint64_t w;						\
+	memcpy(&w, in##k, 8);					\
+	if (w == last_##k * 0x0101010101010101ULL) {		\
+	    F0[last_##k][last_##k] += 8;			\
+	    T##k[last_##k] += 8;				\
+	    in##k += 8;						\
+	} else {						\
+	    H1_STEP(k); H1_STEP(k); H1_STEP(k); H1_STEP(k);	\
+	    H1_STEP(k); H1_STEP(k); H1_STEP(k); H1_STEP(k);	\
+	}							\
+    } while (0)
+
+    while (in0 + 8 <= in0_end) {
+	H1_STEP8(0);
+	H1_STEP8(1);
+	H1_STEP8(2);
+	H1_STEP8(3);
+    }
+
+    while (in0 < in0_end) {
+	H1_STEP(0);
+	H1_STEP(1);
+	H1_STEP(2);
+	H1_STEP(3);
+    }
+
+    while (in3 < in + in_size)
+	H1_STEP(3);
+
+#undef H1_STEP
+#undef H1_STEP8
+
+    for (i = 0; i < 256; i++) {
+	T0[i]+=T1[i]+T2[i]+T3[i];
+    }
+}
+
+#ifndef NO_THREADS
+/*
+ * Histograms for very large blocks, split over several threads each with
+ * their own tables, which are summed at the end.  The calling thread
+ * does the first part itself, directly into the caller's tables.
+ *
+ * Typical blocks are far too small for the thread start up and extra
+ * tables to pay off, so this only kicks in at HIST_MT_MIN bytes.
+ */
+#include <pthread.h>
+
+#ifndef HIST_MT_MIN
+#define HIST_MT_MIN (8<<20)
+#endif
+#define HIST_MT_MAX 8
+
+typedef struct {
+    unsigned char *in;
+    unsigned int in_size;
+    int order;
+    int *F;   // [256] or [256][256]
+    int *T;   // [256], order-1 only
+} hist_job;
+
+static void *hist_worker(void *arg) {
+    hist_job *j = (hist_job *)arg;
+
+    if (j->order == 0) {
+	hist8(j->in, j->in_size, j->F);
+    } else {
+	// Starts one byte early so the first symbol has its real context,
+	// then removes the spurious initial context-0 count.
+	int (*F)[256] = (int (*)[256])j->F;
+	hist1_4(j->in-1, j->in_size+1, F, j->T);
+	F[0][j->in[-1]]--;
+	j->T[0]--;
+    }
+
+    return NULL;
+}
+
+// Returns the number of threads to use for an in_size histogram.
+static int hist_mt_threads(unsigned int in_size) {
+    if (in_size < HIST_MT_MIN)
+	return 1;
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > HIST_MT_MAX)
+	n = HIST_MT_MAX;
+    if (n > in_size / (HIST_MT_MIN/2))
+	n = in_size / (HIST_MT_MIN/2);
+    return n > 1 ? n : 1;
+}
+
+// Returns 0 on success, -1 if the threaded version couldn't be used, in
+// which case nothing has been counted.
+static int hist_mt(unsigned char *in, unsigned int in_size, int order,
+		   int *F0, int *T0, int nthreads) {
+    pthread_t tid[HIST_MT_MAX];
+    hist_job job[HIST_MT_MAX];
+    size_t fsz = order ? 256*256 : 256+MAGIC;
+    unsigned int chunk = in_size / nthreads, i;
+    int n, nstarted = 0, err = 0;
+
+    for (n = 1; n < nthreads; n++) {
+	job[n].in      = in + n*chunk;
+	job[n].in_size = n+1 < nthreads ? chunk : in_size - n*chunk;
+	job[n].order   = order;
+	job[n].F       = calloc(fsz, sizeof(int));
+	job[n].T       = calloc(256+MAGIC, sizeof(int));
+	if (!job[n].F || !job[n].T ||
+	    pthread_create(&tid[n], NULL, hist_worker, &job[n]) != 0) {
+	    free(job[n].F);
+	    free(job[n].T);
+	    err = 1;
+	    break;
+	}
+	nstarted = n;
+    }
+
+    // Our own share, unless we're bailing out
+    if (!err) {
+	if (order == 0)
+	    hist8(in, chunk, F0);
+	else
+	    hist1_4(in, chunk, (int (*)[256])F0, T0);
+    }
+
+    for (n = 1; n <= nstarted; n++) {
+	pthread_join(tid[n], NULL);
+	if (!err) {
+	    if (order == 0) {
+		for (i = 0; i < 256; i++)
+		    F0[i] += job[n].F[i];
+	    } else {
+		// Only rows for contexts seen are non-zero
+		for (i = 0; i < 256; i++) {
+		    int j, *f = &job[n].F[i*256], *F = &F0[i*256];
+		    if (!job[n].T[i])
+			continue;
+		    T0[i] += job[n].T[i];
+		    for (j = 0; j < 256; j++)
+			F[j] += f[j];
+		}
+	    }
+	}
+	free(job[n].F);
+	free(job[n].T);
+    }
+
+    return err ? -1 : 0;
+}
+#endif /* NO_THREADS */
+
+// Order-0 and order-1 histograms, using multiple threads for very large
+// blocks.  F0 (and for order-1 T0) must be zero on entry.
+static void hist_o0(unsigned char *in, unsigned int in_size, int F0[256]) {
+#ifndef NO_THREADS
+    int n = hist_mt_threads(in_size);
+    if (n > 1 && hist_mt(in, in_size, 0, F0, NULL, n) == 0)
+	return;
+#endif
+    hist8(in, in_size, F0);
+}
+
+static void hist_o1(unsigned char *in, unsigned int in_size,
+		    int F0[256][256], int *T0) {
+#ifndef NO_THREADS
+    int n = hist_mt_threads(in_size);
+    if (n > 1 && hist_mt(in, in_size, 1, &F0[0][0], T0, n) == 0)
+	return;
+#endif
+    hist1_4(in, in_size, F0, T0);
+}
+
+void rans_hist_4x16(unsigned char *in, unsigned int in_size,
+		    int *F0, int (*F1)[256], int *T1) {
+    unsigned int i;
+    unsigned char last = 0;
+
+    memset(F0, 0, 256*sizeof(*F0));
+    memset(T1, 0, 256*sizeof(*T1));
+    hist_o0(in, in_size, F0);
+    for (i = 0; i < 256; i++)
+	if (F0[i] || i == 0)
+	    memset(F1[i], 0, sizeof(F1[i]));
+
+    // hist1_4 needs at least one symbol per stream
+    if (in_size >= 16) {
+	hist_o1(in, in_size, F1, T1);
+	return;
+    }
+    for (i = 0; i < in_size; i++) {
+	F1[last][in[i]]++;
+	T1[last]++;
+	last = in[i];
+    }
+}
+
+// Histograms already computed by the caller; see rans_ctx_set_hist.
+typedef struct {
+    int *F0;          // [256] order-0 counts
+    int (*F1)[256];   // [256][256] order-1 counts, rows 0 and F0 only
+    int *T1;          // [256] order-1 row totals
+} rans_hist;
+
 static void normalise_freq(int *F, int size, int tot) {
     int m = 0, M = 0, fsum = 0, j;
     uint64_t tr = ((uint64_t)tot<<31)/size + (1<<30)/size;
@@ -538,6 +829,18 @@ static void normalise_freq(int *F, int size, int tot) {
     assert(F[M]>0);
 }
 
+// log2(x) in 1/256ths of a bit, for x >= 1.  Accurate to ~0.01 bits.
+static inline unsigned int ilog2_q8(uint32_t x) {
+    static const uint16_t lg[17] = {
+	0, 22, 44, 63, 82, 100, 118, 134, 150, 165, 179, 193, 207, 220, 232,
+	244, 256
+    };
+    int l = 31 - __builtin_clz(x);
+    uint32_t m = l > 15 ? x >> (l-15) : x << (15-l); // 1.15 fixed point
+    int k = (m>>11) & 15;
+    return (l<<8) + lg[k] + (((lg[k+1]-lg[k]) * (m & 2047)) >> 11);
+}
+
 static int encode_freq(uint8_t *cp, int *F) {
     uint8_t *op = cp;
     int rle, j;
@@ -720,70 +1023,61 @@ static int decode_freq_d(uint8_t *cp, int *F0, int *F, RansDecSymbol *syms, unsi
     return cp - op;
 }
 
+// Order-0 frequency tables.  Small blocks store the raw symbol counts
+// rather than normalised frequencies, as most are under 128 and fit in
+// one byte.  The decoder spots this by their total being below TOTFREQ
+// (normalised tables always sum to exactly TOTFREQ) and normalises them
+// itself with the same function, so both ends agree on the table.
+static int encode_freq0_small(uint8_t *cp, int *F, unsigned int in_size) {
+    int n;
+    if (in_size < TOTFREQ) {
+	n = encode_freq(cp, F);
+	normalise_freq(F, in_size, TOTFREQ);
+    } else {
+	normalise_freq(F, in_size, TOTFREQ);
+	n = encode_freq(cp, F);
+    }
+    return n;
+}
+
+static int decode_freq0_small(uint8_t *cp, int *F) {
+    int n = decode_freq(cp, F), j, T;
+    for (T = j = 0; j < 256; j++)
+	T += F[j];
+    if (T > 0 && T < TOTFREQ)
+	normalise_freq(F, T, TOTFREQ);
+    return n;
+}
+
 unsigned int rans_compress_bound_4x16(unsigned int size, int order) {
     return (order == 0
 	? 1.05*size + 257*3 + 4
 	: 1.05*size + 257*257*3 + 4) +
-	((order & X_PACK) ? 1 : 0) + 
-	((order & X_RLE) ? 1 : 0) + 5;
+	((order & 2) ? O2_TAB_MAX : 0) +
+	((order & X_PACK) ? 4 + 256+16 : 0) +     // size, pack meta
+	((order & X_RLE) ? 4 + 15 + 257*3+4 : 0) + // size, rle meta hdr+table
+	((order & X_32) ? 4*32 : 0) + 5;
 }
 
-unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
-				     unsigned char *out, unsigned int *out_size) {
-    unsigned char *cp, *out_end;
-    RansEncSymbol syms[256];
+/*
+ * The encoders write backwards from the end of out[0..*out_size-1] and
+ * then move the frequency table (written at the start of out) to sit
+ * immediately before the rANS data.  The table is small, so this is far
+ * cheaper than moving the data down to the start of the buffer.
+ *
+ * Returns a pointer to the start of the encoded block, with its length
+ * in *out_size, or NULL if out is too small.
+ */
+// Codes in[] with syms backwards from ptr, returning the new start.
+static inline uint8_t *rans_enc_O0_4x16_syms(unsigned char *in,
+					     unsigned int in_size,
+					     const RansEncSymbol *syms,
+					     uint8_t *ptr) {
     RansState rans0;
     RansState rans2;
     RansState rans1;
     RansState rans3;
-    uint8_t* ptr;
-    int F[256+MAGIC] = {0}, i, j, tab_size = 0, rle, x, fsum = 0;
-    int m = 0, M = 0;
-    int bound = rans_compress_bound_4x16(in_size,0)-5; // -5 for order/size
-
-    if (!out) {
-	*out_size = bound;
-	out = malloc(*out_size);
-    }
-    if (!out || bound > *out_size)
-	return NULL;
-
-    ptr = out_end = out + bound;
-
-    if (in_size == 0)
-	goto empty;
-
-    // Compute statistics
-    hist8(in, in_size, F);
-
-    // Normalise so T[i] == TOTFREQ
-    normalise_freq(F, in_size, TOTFREQ);
-
-    // Encode input size
-    cp = out;
-//    if (0 && in_size < 32768) {
-//	*cp++ = (in_size>>8)|0x80;
-//	*cp++ = (in_size>>0) & 0xff;
-//    } else {
-//	*cp++ = (in_size>>24) & 0xff;
-//	*cp++ = (in_size>>16) & 0xff;
-//	*cp++ = (in_size>> 8) & 0xff;
-//	*cp++ = (in_size>> 0) & 0xff;
-//    }
-
-    // Encode statistics.
-    //cp = out+4;
-
-    for (x = rle = j = 0; j < 256; j++) {
-	if (F[j]) {
-	    RansEncSymbolInit(&syms[j], x, F[j], TF_SHIFT);
-	    x += F[j];
-	}
-    }
-
-    cp += encode_freq(cp, F);
-    tab_size = cp-out;
-    //write(2, out+4, cp-(out+4));
+    int i;
 
     RansEncInit(&rans0);
     RansEncInit(&rans1);
@@ -798,10 +1092,10 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
 	break;
     }
     for (i=(in_size &~3); i>0; i-=4) {
-	RansEncSymbol *s3 = &syms[in[i-1]];
-	RansEncSymbol *s2 = &syms[in[i-2]];
-	RansEncSymbol *s1 = &syms[in[i-3]];
-	RansEncSymbol *s0 = &syms[in[i-4]];
+	const RansEncSymbol *s3 = &syms[in[i-1]];
+	const RansEncSymbol *s2 = &syms[in[i-2]];
+	const RansEncSymbol *s1 = &syms[in[i-3]];
+	const RansEncSymbol *s0 = &syms[in[i-4]];
 
 #if 1
 	RansEncPutSymbol(&rans3, &ptr, s3);
@@ -835,6 +1129,55 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
     RansEncFlush(&rans1, &ptr);
     RansEncFlush(&rans0, &ptr);
 
+    return ptr;
+}
+
+// As rans_enc_O0_4x16 below, but with the histogram F already computed.
+// F is normalised in-place.
+static unsigned char *rans_enc_O0_4x16_F(unsigned char *in, unsigned int in_size,
+					 unsigned char *out, unsigned int *out_size,
+					 int *F) {
+    unsigned char *cp, *out_end;
+    RansEncSymbol syms[256];
+    uint8_t* ptr;
+    int j, tab_size = 0, x;
+    int bound = rans_compress_bound_4x16(in_size,0)-5; // -5 for order/size
+
+    if (bound > *out_size)
+	return NULL;
+
+    ptr = out_end = out + *out_size;
+
+    if (in_size == 0)
+	goto empty;
+
+    // Encode input size
+    cp = out;
+//    if (0 && in_size < 32768) {
+//	*cp++ = (in_size>>8)|0x80;
+//	*cp++ = (in_size>>0) & 0xff;
+//    } else {
+//	*cp++ = (in_size>>24) & 0xff;
+//	*cp++ = (in_size>>16) & 0xff;
+//	*cp++ = (in_size>> 8) & 0xff;
+//	*cp++ = (in_size>> 0) & 0xff;
+//    }
+
+    // Encode statistics.
+    //cp = out+4;
+    cp += encode_freq0_small(cp, F, in_size);
+    tab_size = cp-out;
+
+    for (x = j = 0; j < 256; j++) {
+	if (F[j]) {
+	    RansEncSymbolInit(&syms[j], x, F[j], TF_SHIFT);
+	    x += F[j];
+	}
+    }
+    //write(2, out+4, cp-(out+4));
+
+    ptr = rans_enc_O0_4x16_syms(in, in_size, syms, ptr);
+
  empty:
     // Finalise block size and return it
     *out_size = (out_end - ptr) + tab_size;
@@ -845,56 +1188,45 @@ unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
 //    *cp++ = (in_size>>16) & 0xff;
 //    *cp++ = (in_size>>24) & 0xff;
 
-    memmove(out + tab_size, ptr, out_end-ptr);
+    memmove(ptr - tab_size, out, tab_size);
 
-    return out;
+    return ptr - tab_size;
 }
 
-typedef struct {
-    unsigned char R[TOTFREQ];
-} ari_decoder;
-
-unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
+static unsigned char *rans_enc_O0_4x16(unsigned char *in, unsigned int in_size,
 				       unsigned char *out, unsigned int *out_size) {
-    /* Load in the static tables */
-    unsigned char *cp = in;
-    int i, j, x, y, out_sz, rle;
-    uint16_t sfreq[TOTFREQ+32];
-    uint16_t sbase[TOTFREQ+32]; // faster to use 32-bit on clang
-    uint8_t  ssym [TOTFREQ+64]; // faster to use 16-bit on clang
+    int F[256+MAGIC] = {0};
 
-    //out_sz = ((in[0])<<0) | ((in[1])<<8) | ((in[2])<<16) | ((in[3])<<24); 
-//    out_sz = in[0] & 0x80
-//	? ((in[0]&0x7f)<<8) | in[1]
-//	: ((in[0])<<24) | ((in[1])<<16) | ((in[2])<<8) | ((in[3])<<0);
-//    assert(out_sz == *out_size);
-//    cp += in[0] & 0x80 ? 2 : 4;
-    out_sz = *out_size;
-    if (!out) {
-	out = malloc(out_sz);
-	*out_size = out_sz;
-    }
-    if (!out || out_sz > *out_size)
-	return NULL;
+    // Compute statistics
+    if (in_size)
+	hist_o0(in, in_size, F);
 
-    // Precompute reverse lookup of frequency.
-    int F[256] = {0};
-    cp += decode_freq(cp, F);
+    return rans_enc_O0_4x16_F(in, in_size, out, out_size, F);
+}
 
-    // Build symbols; fixme, do as part of decode, see the _d variant
-    for (j = x = 0; j < 256; j++) {
-	if (F[j]) {
-	    for (y = 0; y < F[j]; y++) {
-		ssym [y + x] = j;
-		sfreq[y + x] = F[j];
-		sbase[y + x] = y;
-	    }
-	    x += F[j];
-	}
+unsigned char *rans_compress_O0_4x16(unsigned char *in, unsigned int in_size,
+				     unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp;
+
+    if (!out) {
+	*out_size = rans_compress_bound_4x16(in_size,0)-5;
+	out = malloc(*out_size);
     }
+    if (!out || !(cp = rans_enc_O0_4x16(in, in_size, out, out_size)))
+	return NULL;
 
-    assert(x <= TOTFREQ);
+    memmove(out, cp, *out_size);
+    return out;
+}
 
+// Decodes out_sz symbols from cp using the sfreq, sbase and ssym lookup
+// tables, indexed by the bottom TF_SHIFT bits of the state.
+static inline void rans_dec_O0_4x16_syms(unsigned char *cp,
+					 unsigned char *out, int out_sz,
+					 const uint16_t *sfreq,
+					 const uint16_t *sbase,
+					 const uint8_t  *ssym) {
+    int i;
     RansState R[4];
     RansDecInit(&R[0], &cp);
     RansDecInit(&R[1], &cp);
@@ -938,78 +1270,764 @@ unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
     default:
         break;
     }
-
-    *out_size = out_sz;
-    return out;
 }
 
-#ifdef UNUSED
-static void hist1_1(unsigned char *in, unsigned int in_size,
-		    int F0[256][256], int T0[256]) {
-    unsigned int last_i, i;
-    unsigned char c;
-
-    for (last_i=i=0; i<in_size; i++) {
-	F0[last_i][c = in[i]]++;
-	T0[last_i]++;
-	last_i = c;
-    }
-}
-#endif
+typedef struct {
+    unsigned char R[TOTFREQ];
+} ari_decoder;
 
-static void hist1_4(unsigned char *in, unsigned int in_size,
-		    int F0[256][256], int *T0) {
-    int T1[256+MAGIC] = {0}, T2[256+MAGIC] = {0}, T3[256+MAGIC] = {0};
-    unsigned int idiv4 = in_size/4;
-    int i;
-    unsigned char c0, c1, c2, c3;
+unsigned char *rans_uncompress_O0_4x16(unsigned char *in, unsigned int in_size,
+				       unsigned char *out, unsigned int *out_size) {
+    /* Load in the static tables */
+    unsigned char *cp = in;
+    int j, x, y, out_sz, rle;
+    uint16_t sfreq[TOTFREQ+32];
+    uint16_t sbase[TOTFREQ+32]; // faster to use 32-bit on clang
+    uint8_t  ssym [TOTFREQ+64]; // faster to use 16-bit on clang
 
-    unsigned char *in0 = in + 0;
-    unsigned char *in1 = in + idiv4;
-    unsigned char *in2 = in + idiv4*2;
-    unsigned char *in3 = in + idiv4*3;
+    //out_sz = ((in[0])<<0) | ((in[1])<<8) | ((in[2])<<16) | ((in[3])<<24); 
+//    out_sz = in[0] & 0x80
+//	? ((in[0]&0x7f)<<8) | in[1]
+//	: ((in[0])<<24) | ((in[1])<<16) | ((in[2])<<8) | ((in[3])<<0);
+//    assert(out_sz == *out_size);
+//    cp += in[0] & 0x80 ? 2 : 4;
+    unsigned char *out_free = NULL;
+    out_sz = *out_size;
+    if (!out) {
+	out = out_free = malloc(out_sz);
+	*out_size = out_sz;
+    }
+    if (!out || out_sz > *out_size)
+	return NULL;
 
-    unsigned char last_0 = 0, last_1 = in1[-1], last_2 = in2[-1], last_3 = in3[-1];
-    //unsigned char last_0 = 0, last_1 = 0, last_2 = 0, last_3 = 0;
+    // Precompute reverse lookup of frequency.
+    int F[256] = {0};
+    cp += decode_freq0_small(cp, F);
 
-    unsigned char *in0_end = in1;
+    // Build symbols; fixme, do as part of decode, see the _d variant
+    for (j = x = 0; j < 256; j++) {
+	if (F[j]) {
+	    // Corrupt tables may claim more than TOTFREQ
+	    if (F[j] < 0 || x + F[j] > TOTFREQ) {
+		free(out_free);
+		return NULL;
+	    }
+	    for (y = 0; y < F[j]; y++) {
+		ssym [y + x] = j;
+		sfreq[y + x] = F[j];
+		sbase[y + x] = y;
+	    }
+	    x += F[j];
+	}
+    }
 
-    while (in0 < in0_end) {
-	F0[last_0][c0 = *in0++]++;
-	T0[last_0]++;
-	last_0 = c0;
+    rans_dec_O0_4x16_syms(cp, out, out_sz, sfreq, sbase, ssym);
+
+    *out_size = out_sz;
+    return out;
+}
 
-	F0[last_1][c1 = *in1++]++;
-	T1[last_1]++;
-	last_1 = c1;
 
-	F0[last_2][c2 = *in2++]++;
-	T2[last_2]++;
-	last_2 = c2;
+/*-----------------------------------------------------------------------------
+ * Built-in order-0 models.
+ *
+ * Small blocks spend a large fraction of their size on the frequency
+ * table, and the time on building the lookup tables from it.  Order-0
+ * blocks compressed with X_TAB may instead use one of the compiled-in
+ * frequency tables below, recorded as a single model id byte after the
+ * order.  The encoder only picks a model if the estimated size, including
+ * the cost of the table it replaces, is smaller.
+ *
+ * Ids form part of the format: a model's table must never change once
+ * published.  New or retrained models get a new id.
+ *
+ * Tables are normalised to TOTFREQ.  Each gives every plausible symbol a
+ * non-zero frequency so small deviations from the training data can
+ * still use it.
+ */
 
-	F0[last_3][c3 = *in3++]++;
-	T3[last_3]++;
-	last_3 = c3;
+// Token types in the tokenise_name3 TYPE descriptors, trained on the
+// Illumina and PacBio test names.
+static const uint16_t model_tok3_type[256] = {
+    [1] = 1, [2] = 1, [3] = 1, [4] = 3, [5] = 1, [6] = 248, [7] = 327,
+    [8] = 1, [9] = 1, [10] = 1, [11] = 239, [12] = 1, [13] = 3023,
+    [14] = 248,
+};
+
+// tokenise_name3 CHAR descriptors; mostly separators.
+static const uint16_t model_tok3_char[256] = {
+    [' '] = 216, ['!'] = 1, ['"'] = 1, ['#'] = 431, ['$'] = 1, ['%'] = 1,
+    ['&'] = 1, ['\''] = 1, ['('] = 1, [')'] = 1, ['*'] = 1, ['+'] = 54,
+    [','] = 54, ['-'] = 324, ['.'] = 324, ['/'] = 431, ['0'] = 1, ['1'] = 1,
+    ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1,
+    ['8'] = 1, ['9'] = 1, [':'] = 1261, [';'] = 1, ['<'] = 1, ['='] = 54,
+    ['>'] = 1, ['?'] = 1, ['@'] = 1, ['A'] = 1, ['B'] = 1, ['C'] = 1,
+    ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1,
+    ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+    ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1, ['['] = 1,
+    ['\\'] = 1, [']'] = 1, ['^'] = 1, ['_'] = 755, ['`'] = 1, ['a'] = 1,
+    ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+    ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1,
+    ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1,
+    ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1,
+    ['z'] = 1, ['{'] = 1, ['|'] = 108, ['}'] = 1, ['~'] = 1,
+};
+
+// NovaSeq 4-level binned qualities (2, 12, 23 and 37).
+static const uint16_t model_qual_illumina4[256] = {
+    ['!'] = 1, ['"'] = 1, ['#'] = 122, ['$'] = 1, ['%'] = 1, ['&'] = 1,
+    ['\''] = 1, ['('] = 1, [')'] = 1, ['*'] = 1, ['+'] = 1, [','] = 1,
+    ['-'] = 122, ['.'] = 1, ['/'] = 1, ['0'] = 1, ['1'] = 1, ['2'] = 1,
+    ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 245,
+    ['9'] = 1, [':'] = 1, [';'] = 1, ['<'] = 1, ['='] = 1, ['>'] = 1,
+    ['?'] = 1, ['@'] = 1, ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1,
+    ['E'] = 1, ['F'] = 3569, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1,
+};
+
+// HiSeq 8-level binned qualities (2, 6, 15, 22, 27, 33, 37 and 40).
+static const uint16_t model_qual_illumina8[256] = {
+    ['!'] = 1, ['"'] = 1, ['#'] = 122, ['$'] = 1, ['%'] = 1, ['&'] = 1,
+    ['\''] = 20, ['('] = 1, [')'] = 1, ['*'] = 1, ['+'] = 1, [','] = 1,
+    ['-'] = 1, ['.'] = 1, ['/'] = 1, ['0'] = 61, ['1'] = 1, ['2'] = 1,
+    ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 122, ['8'] = 1,
+    ['9'] = 1, [':'] = 1, [';'] = 1, ['<'] = 204, ['='] = 1, ['>'] = 1,
+    ['?'] = 1, ['@'] = 1, ['A'] = 1, ['B'] = 409, ['C'] = 1, ['D'] = 1,
+    ['E'] = 1, ['F'] = 1433, ['G'] = 1, ['H'] = 1, ['I'] = 1691, ['J'] = 1,
+};
+
+// Unbinned Illumina qualities, peaking in the high 30s.
+static const uint16_t model_qual_illumina40[256] = {
+    ['!'] = 1, ['"'] = 1, ['#'] = 10, ['$'] = 1, ['%'] = 1, ['&'] = 1,
+    ['\''] = 1, ['('] = 1, [')'] = 1, ['*'] = 1, ['+'] = 1, [','] = 1,
+    ['-'] = 1, ['.'] = 1, ['/'] = 1, ['0'] = 1, ['1'] = 1, ['2'] = 1,
+    ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 2, ['7'] = 4, ['8'] = 8,
+    ['9'] = 13, [':'] = 21, [';'] = 34, ['<'] = 52, ['='] = 77, ['>'] = 108,
+    ['?'] = 147, ['@'] = 192, ['A'] = 240, ['B'] = 288, ['C'] = 332,
+    ['D'] = 368, ['E'] = 391, ['F'] = 410, ['G'] = 391, ['H'] = 368,
+    ['I'] = 332, ['J'] = 288,
+};
+
+
+static const uint16_t *rans_model_F[] = {
+    NULL,                  // 0 is no model
+    model_tok3_type,       // 1
+    model_tok3_char,       // 2
+    model_qual_illumina4,  // 3
+    model_qual_illumina8,  // 4
+    model_qual_illumina40, // 5
+};
+#define RANS_NMODELS (sizeof(rans_model_F)/sizeof(*rans_model_F))
+
+// Encoder and decoder tables, built once on first use.
+typedef struct {
+    RansEncSymbol syms[256];
+    uint16_t cost[256]; // bits * 256 per symbol, 0 if absent
+    uint16_t sfreq[TOTFREQ];
+    uint16_t sbase[TOTFREQ];
+    uint8_t  ssym[TOTFREQ];
+} rans_model;
+
+static rans_model rans_models[RANS_NMODELS];
+
+static void rans_models_build(void) {
+    int m, j, x, y;
+    for (m = 1; m < RANS_NMODELS; m++) {
+	const uint16_t *F = rans_model_F[m];
+	rans_model *r = &rans_models[m];
+	for (x = j = 0; j < 256; j++) {
+	    if (!F[j])
+		continue;
+	    RansEncSymbolInit(&r->syms[j], x, F[j], TF_SHIFT);
+	    r->cost[j] = (TF_SHIFT<<8) - ilog2_q8(F[j]) + 1; // never 0
+	    for (y = 0; y < F[j]; y++) {
+		r->ssym [x+y] = j;
+		r->sfreq[x+y] = F[j];
+		r->sbase[x+y] = y;
+	    }
+	    x += F[j];
+	}
+	assert(x == TOTFREQ);
     }
+}
 
-    while (in3 < in + in_size) {
-	F0[last_3][c3 = *in3++]++;
-	T3[last_3]++;
-	last_3 = c3;
+static const rans_model *rans_model_get(int id) {
+#ifndef NO_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, rans_models_build);
+#else
+    static int done = 0;
+    if (!done) {
+	rans_models_build();
+	done = 1;
     }
+#endif
+    return id > 0 && id < RANS_NMODELS ? &rans_models[id] : NULL;
+}
 
-    for (i = 0; i < 256; i++) {
-	T0[i]+=T1[i]+T2[i]+T3[i];
+/*
+ * Order-0 encode, using a built-in model if that's smaller than storing
+ * a frequency table.  *model is set to the model id used, or 0 if none
+ * in which case the output is identical to rans_enc_O0_4x16.  h, if
+ * non-NULL, holds the histogram of in.
+ */
+static unsigned char *rans_enc_O0_4x16_model(unsigned char *in,
+					     unsigned int in_size,
+					     unsigned char *out,
+					     unsigned int *out_size,
+					     const rans_hist *h, int *model) {
+    int F[256+MAGIC] = {0}, N[256], j, m, nsym = 0;
+    uint8_t tab[257*3+4], sym[256];
+    int64_t best_cost;
+    int best = 0;
+
+    *model = 0;
+    if (in_size == 0 || rans_compress_bound_4x16(in_size,0)-5 > *out_size)
+	return rans_enc_O0_4x16(in, in_size, out, out_size);
+
+    if (h)
+	memcpy(F, h->F0, 256*sizeof(*F));
+    else
+	hist_o0(in, in_size, F);
+
+    // Cost of our own table plus the data coded with it
+    memcpy(N, F, sizeof(N));
+    best_cost = (int64_t)encode_freq0_small(tab, N, in_size) * 8*256;
+    for (j = 0; j < 256; j++) {
+	if (F[j]) {
+	    best_cost += (int64_t)F[j] * ((TF_SHIFT<<8) - ilog2_q8(N[j]));
+	    sym[nsym++] = j;
+	}
+    }
+
+    const rans_model *r = rans_model_get(1);
+    for (m = 1; m < RANS_NMODELS; m++, r++) {
+	int64_t cost = 8*256; // model id
+	for (j = 0; j < nsym; j++) {
+	    int c = r->cost[sym[j]];
+	    if (!c)
+		break;
+	    cost += (int64_t)F[sym[j]] * c;
+	}
+	if (j == nsym && best_cost > cost) {
+	    best_cost = cost;
+	    best = m;
+	}
+    }
+
+    if (!best)
+	return rans_enc_O0_4x16_F(in, in_size, out, out_size, F);
+
+    uint8_t *ptr = rans_enc_O0_4x16_syms(in, in_size, rans_models[best].syms,
+					 out + *out_size);
+    *--ptr = best;
+    *out_size = out + *out_size - ptr;
+    *model = best;
+    return ptr;
+}
+
+// Order-0 decode of a block using a built-in model.
+static unsigned char *rans_uncompress_O0_4x16_model(unsigned char *in,
+						    unsigned int in_size,
+						    unsigned char *out,
+						    unsigned int *out_size) {
+    const rans_model *r;
+    if (in_size < 1 || !(r = rans_model_get(in[0])))
+	return NULL;
+
+    rans_dec_O0_4x16_syms(in+1, out, *out_size, r->sfreq, r->sbase, r->ssym);
+    return out;
+}
+
+/*-----------------------------------------------------------------------------
+ * 32-way interleaved order-0 codec.
+ *
+ * Identical frequency table to the 4-way version, but with 32 rANS states
+ * so the decoder has enough independent work to be vectorised.  Symbol i
+ * belongs to state i%32.  Per 32 symbols the decoder updates all 32 states
+ * and then renormalises states 0 to 31 in order, so the encoder emits them
+ * in reverse.  The last (in_size%32) symbols are held in states 0 onwards
+ * and need no renormalisation.
+ */
+#define NX 32
+
+static unsigned char *rans_enc_O0_32x16(unsigned char *in, unsigned int in_size,
+					unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp, *out_end;
+    RansEncSymbol syms[256];
+    RansState ransN[NX];
+    uint8_t* ptr;
+    int F[256+MAGIC] = {0}, i, j, tab_size = 0, x, z;
+    int bound = rans_compress_bound_4x16(in_size,X_32)-5; // -5 for order/size
+
+    if (bound > *out_size)
+	return NULL;
+
+    ptr = out_end = out + *out_size;
+
+    if (in_size == 0)
+	goto empty;
+
+    // Compute statistics
+    hist_o0(in, in_size, F);
+
+    cp = out;
+    cp += encode_freq0_small(cp, F, in_size);
+    tab_size = cp-out;
+
+    for (x = j = 0; j < 256; j++) {
+	if (F[j]) {
+	    RansEncSymbolInit(&syms[j], x, F[j], TF_SHIFT);
+	    x += F[j];
+	}
+    }
+
+    for (z = 0; z < NX; z++)
+	RansEncInit(&ransN[z]);
+
+    // Remainder first as the decoder handles it last.
+    int i_end = in_size & ~(NX-1);
+    for (z = in_size - i_end - 1; z >= 0; z--)
+	RansEncPutSymbol(&ransN[z], &ptr, &syms[in[i_end+z]]);
+
+    for (i = i_end; i > 0; i -= NX) {
+	for (z = NX-1; z >= 0; z--)
+	    RansEncPutSymbol(&ransN[z], &ptr, &syms[in[i-NX+z]]);
+    }
+
+    for (z = NX-1; z >= 0; z--)
+	RansEncFlush(&ransN[z], &ptr);
+
+ empty:
+    // Finalise block size and return it
+    *out_size = (out_end - ptr) + tab_size;
+
+    memmove(ptr - tab_size, out, tab_size);
+
+    return ptr - tab_size;
+}
+
+unsigned char *rans_compress_O0_32x16(unsigned char *in, unsigned int in_size,
+				      unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp;
+
+    if (!out) {
+	*out_size = rans_compress_bound_4x16(in_size,X_32)-5;
+	out = malloc(*out_size);
+    }
+    if (!out || !(cp = rans_enc_O0_32x16(in, in_size, out, out_size)))
+	return NULL;
+
+    memmove(out, cp, *out_size);
+    return out;
+}
+
+/*-----------------------------------------------------------------------------
+ * Run time CPU dispatch.
+ *
+ * The vector kernels are compiled with per-function target attributes so a
+ * single binary carries all of them, and the best one supported by the
+ * host is picked on first use.  RANS_CPU=scalar|sse4|avx2|avx512 in the
+ * environment forces a lower level (eg for benchmarking or to work around
+ * a misbehaving CPU); requests above what the CPU supports are clamped.
+ *
+ * Only the X_32 order-0 decoder and the bit packing have vector kernels.
+ * The default 4-way order-0 and order-1 coders are scalar, and building
+ * them for haswell instead of baseline x86_64 made no measurable
+ * difference, so they are compiled once and are not dispatched.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#  define RANS_X86_KERNELS
+#  include <immintrin.h>
+#  define TARGET(x) __attribute__((target(x)))
+#endif
+
+static int rans_cpu = RANS_CPU_SCALAR;
+
+static void rans_cpu_init(void) {
+    int level = RANS_CPU_SCALAR;
+#ifdef RANS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+	level = RANS_CPU_SSE4;
+    if (__builtin_cpu_supports("avx2"))
+	level = RANS_CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+	level = RANS_CPU_AVX512;
+#endif
+
+    char *env = getenv("RANS_CPU");
+    if (env) {
+	int want = level;
+	if      (strcmp(env, "scalar") == 0) want = RANS_CPU_SCALAR;
+	else if (strcmp(env, "sse4")   == 0) want = RANS_CPU_SSE4;
+	else if (strcmp(env, "avx2")   == 0) want = RANS_CPU_AVX2;
+	else if (strcmp(env, "avx512") == 0) want = RANS_CPU_AVX512;
+	if (want < level)
+	    level = want;
+    }
+
+    rans_cpu = level;
+}
+
+// The CPU level, found once on first use.
+int rans_cpu_level(void) {
+#ifndef NO_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, rans_cpu_init);
+#else
+    static int done = 0;
+    if (!done) {
+	rans_cpu_init();
+	done = 1;
+    }
+#endif
+    return rans_cpu;
+}
+
+// Decodes NX symbols at a time, returning the number of symbols decoded.
+// The caller finishes any remainder using the scalar code.
+typedef int (*rans_dec32_fn)(RansState *R, uint8_t **pptr, uint8_t *ptr_end,
+			     uint32_t *s3, unsigned char *out, int out_end);
+
+#ifdef RANS_X86_KERNELS
+// rans_permute[m] holds 8 byte indices such that the k-th set bit of 'm'
+// selects the k-th 16-bit word loaded for renormalisation.
+static const uint64_t rans_permute[256] = {
+    0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0x0000000000000100,
+    0x0000000000000000, 0x0000000000010000, 0x0000000000010000, 0x0000000000020100,
+    0x0000000000000000, 0x0000000001000000, 0x0000000001000000, 0x0000000002000100,
+    0x0000000001000000, 0x0000000002010000, 0x0000000002010000, 0x0000000003020100,
+    0x0000000000000000, 0x0000000100000000, 0x0000000100000000, 0x0000000200000100,
+    0x0000000100000000, 0x0000000200010000, 0x0000000200010000, 0x0000000300020100,
+    0x0000000100000000, 0x0000000201000000, 0x0000000201000000, 0x0000000302000100,
+    0x0000000201000000, 0x0000000302010000, 0x0000000302010000, 0x0000000403020100,
+    0x0000000000000000, 0x0000010000000000, 0x0000010000000000, 0x0000020000000100,
+    0x0000010000000000, 0x0000020000010000, 0x0000020000010000, 0x0000030000020100,
+    0x0000010000000000, 0x0000020001000000, 0x0000020001000000, 0x0000030002000100,
+    0x0000020001000000, 0x0000030002010000, 0x0000030002010000, 0x0000040003020100,
+    0x0000010000000000, 0x0000020100000000, 0x0000020100000000, 0x0000030200000100,
+    0x0000020100000000, 0x0000030200010000, 0x0000030200010000, 0x0000040300020100,
+    0x0000020100000000, 0x0000030201000000, 0x0000030201000000, 0x0000040302000100,
+    0x0000030201000000, 0x0000040302010000, 0x0000040302010000, 0x0000050403020100,
+    0x0000000000000000, 0x0001000000000000, 0x0001000000000000, 0x0002000000000100,
+    0x0001000000000000, 0x0002000000010000, 0x0002000000010000, 0x0003000000020100,
+    0x0001000000000000, 0x0002000001000000, 0x0002000001000000, 0x0003000002000100,
+    0x0002000001000000, 0x0003000002010000, 0x0003000002010000, 0x0004000003020100,
+    0x0001000000000000, 0x0002000100000000, 0x0002000100000000, 0x0003000200000100,
+    0x0002000100000000, 0x0003000200010000, 0x0003000200010000, 0x0004000300020100,
+    0x0002000100000000, 0x0003000201000000, 0x0003000201000000, 0x0004000302000100,
+    0x0003000201000000, 0x0004000302010000, 0x0004000302010000, 0x0005000403020100,
+    0x0001000000000000, 0x0002010000000000, 0x0002010000000000, 0x0003020000000100,
+    0x0002010000000000, 0x0003020000010000, 0x0003020000010000, 0x0004030000020100,
+    0x0002010000000000, 0x0003020001000000, 0x0003020001000000, 0x0004030002000100,
+    0x0003020001000000, 0x0004030002010000, 0x0004030002010000, 0x0005040003020100,
+    0x0002010000000000, 0x0003020100000000, 0x0003020100000000, 0x0004030200000100,
+    0x0003020100000000, 0x0004030200010000, 0x0004030200010000, 0x0005040300020100,
+    0x0003020100000000, 0x0004030201000000, 0x0004030201000000, 0x0005040302000100,
+    0x0004030201000000, 0x0005040302010000, 0x0005040302010000, 0x0006050403020100,
+    0x0000000000000000, 0x0100000000000000, 0x0100000000000000, 0x0200000000000100,
+    0x0100000000000000, 0x0200000000010000, 0x0200000000010000, 0x0300000000020100,
+    0x0100000000000000, 0x0200000001000000, 0x0200000001000000, 0x0300000002000100,
+    0x0200000001000000, 0x0300000002010000, 0x0300000002010000, 0x0400000003020100,
+    0x0100000000000000, 0x0200000100000000, 0x0200000100000000, 0x0300000200000100,
+    0x0200000100000000, 0x0300000200010000, 0x0300000200010000, 0x0400000300020100,
+    0x0200000100000000, 0x0300000201000000, 0x0300000201000000, 0x0400000302000100,
+    0x0300000201000000, 0x0400000302010000, 0x0400000302010000, 0x0500000403020100,
+    0x0100000000000000, 0x0200010000000000, 0x0200010000000000, 0x0300020000000100,
+    0x0200010000000000, 0x0300020000010000, 0x0300020000010000, 0x0400030000020100,
+    0x0200010000000000, 0x0300020001000000, 0x0300020001000000, 0x0400030002000100,
+    0x0300020001000000, 0x0400030002010000, 0x0400030002010000, 0x0500040003020100,
+    0x0200010000000000, 0x0300020100000000, 0x0300020100000000, 0x0400030200000100,
+    0x0300020100000000, 0x0400030200010000, 0x0400030200010000, 0x0500040300020100,
+    0x0300020100000000, 0x0400030201000000, 0x0400030201000000, 0x0500040302000100,
+    0x0400030201000000, 0x0500040302010000, 0x0500040302010000, 0x0600050403020100,
+    0x0100000000000000, 0x0201000000000000, 0x0201000000000000, 0x0302000000000100,
+    0x0201000000000000, 0x0302000000010000, 0x0302000000010000, 0x0403000000020100,
+    0x0201000000000000, 0x0302000001000000, 0x0302000001000000, 0x0403000002000100,
+    0x0302000001000000, 0x0403000002010000, 0x0403000002010000, 0x0504000003020100,
+    0x0201000000000000, 0x0302000100000000, 0x0302000100000000, 0x0403000200000100,
+    0x0302000100000000, 0x0403000200010000, 0x0403000200010000, 0x0504000300020100,
+    0x0302000100000000, 0x0403000201000000, 0x0403000201000000, 0x0504000302000100,
+    0x0403000201000000, 0x0504000302010000, 0x0504000302010000, 0x0605000403020100,
+    0x0201000000000000, 0x0302010000000000, 0x0302010000000000, 0x0403020000000100,
+    0x0302010000000000, 0x0403020000010000, 0x0403020000010000, 0x0504030000020100,
+    0x0302010000000000, 0x0403020001000000, 0x0403020001000000, 0x0504030002000100,
+    0x0403020001000000, 0x0504030002010000, 0x0504030002010000, 0x0605040003020100,
+    0x0302010000000000, 0x0403020100000000, 0x0403020100000000, 0x0504030200000100,
+    0x0403020100000000, 0x0504030200010000, 0x0504030200010000, 0x0605040300020100,
+    0x0403020100000000, 0x0504030201000000, 0x0504030201000000, 0x0605040302000100,
+    0x0504030201000000, 0x0605040302010000, 0x0605040302010000, 0x0706050403020100,
+};
+
+// As rans_permute, but as a pshufb mask mapping the k-th 16-bit word to the
+// k-th set lane of a 4x32-bit vector.
+#define Z 0x80
+static const uint8_t rans_permute4[16][16] = {
+    {Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z},
+    {0,1,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z},
+    {Z,Z,Z,Z,0,1,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z},
+    {0,1,Z,Z,2,3,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z},
+    {Z,Z,Z,Z,Z,Z,Z,Z,0,1,Z,Z,Z,Z,Z,Z},
+    {0,1,Z,Z,Z,Z,Z,Z,2,3,Z,Z,Z,Z,Z,Z},
+    {Z,Z,Z,Z,0,1,Z,Z,2,3,Z,Z,Z,Z,Z,Z},
+    {0,1,Z,Z,2,3,Z,Z,4,5,Z,Z,Z,Z,Z,Z},
+    {Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,0,1,Z,Z},
+    {0,1,Z,Z,Z,Z,Z,Z,Z,Z,Z,Z,2,3,Z,Z},
+    {Z,Z,Z,Z,0,1,Z,Z,Z,Z,Z,Z,2,3,Z,Z},
+    {0,1,Z,Z,2,3,Z,Z,Z,Z,Z,Z,4,5,Z,Z},
+    {Z,Z,Z,Z,Z,Z,Z,Z,0,1,Z,Z,2,3,Z,Z},
+    {0,1,Z,Z,Z,Z,Z,Z,2,3,Z,Z,4,5,Z,Z},
+    {Z,Z,Z,Z,0,1,Z,Z,2,3,Z,Z,4,5,Z,Z},
+    {0,1,Z,Z,2,3,Z,Z,4,5,Z,Z,6,7,Z,Z},
+};
+#undef Z
+
+// Decodes NX symbols per iteration using 8 vectors of 4 states.
+//
+// The symbol table is packed as (freq-1)<<20 | bias<<8 | symbol so a single
+// lookup fetches everything needed for one state.  SSE has no gather so
+// the lookups themselves are scalar.
+TARGET("sse4.1")
+static int rans_dec_O0_32x16_sse4(RansState *R, uint8_t **pptr, uint8_t *ptr_end,
+				  uint32_t *s3, unsigned char *out, int out_end) {
+    const __m128i maskv  = _mm_set1_epi32(TOTFREQ-1);
+    const __m128i bmaskv = _mm_set1_epi32(0xfff);
+    const __m128i smaskv = _mm_set1_epi32(0xff);
+    const __m128i onev   = _mm_set1_epi32(1);
+    const __m128i Lv     = _mm_set1_epi32(RANS_BYTE_L);
+    uint16_t *ptr = (uint16_t *)*pptr;
+    __m128i Rv[8], Sv[8];
+    int i, v;
+
+    for (v = 0; v < 8; v++)
+	Rv[v] = _mm_loadu_si128((__m128i *)&R[v*4]);
+
+    // Each renorm loads 8 bytes, so stop 8 loads short of the input end.
+    for (i = 0; i < out_end && (uint8_t *)ptr + 64 <= ptr_end; i += NX) {
+	for (v = 0; v < 8; v++) {
+	    __m128i m = _mm_and_si128(Rv[v], maskv);
+	    __m128i s = _mm_setr_epi32(s3[_mm_extract_epi32(m, 0)],
+				       s3[_mm_extract_epi32(m, 1)],
+				       s3[_mm_extract_epi32(m, 2)],
+				       s3[_mm_extract_epi32(m, 3)]);
+	    __m128i f = _mm_add_epi32(_mm_srli_epi32(s, 20), onev);
+	    __m128i b = _mm_and_si128(_mm_srli_epi32(s, 8), bmaskv);
+	    Rv[v] = _mm_add_epi32(_mm_mullo_epi32(f, _mm_srli_epi32(Rv[v], TF_SHIFT)), b);
+	    Sv[v] = _mm_and_si128(s, smaskv);
+	}
+
+	// 32x 32-bit symbols to 32x 8-bit
+	__m128i s01 = _mm_packus_epi32(Sv[0], Sv[1]);
+	__m128i s23 = _mm_packus_epi32(Sv[2], Sv[3]);
+	__m128i s45 = _mm_packus_epi32(Sv[4], Sv[5]);
+	__m128i s67 = _mm_packus_epi32(Sv[6], Sv[7]);
+	_mm_storeu_si128((__m128i *)&out[i],    _mm_packus_epi16(s01, s23));
+	_mm_storeu_si128((__m128i *)&out[i+16], _mm_packus_epi16(s45, s67));
+
+	// Renormalise in state order
+	for (v = 0; v < 8; v++) {
+	    __m128i renorm = _mm_cmpgt_epi32(Lv, Rv[v]);
+	    unsigned int imask = _mm_movemask_ps(_mm_castsi128_ps(renorm));
+	    __m128i w = _mm_loadl_epi64((__m128i *)ptr);
+	    w = _mm_shuffle_epi8(w, _mm_loadu_si128((__m128i *)rans_permute4[imask]));
+	    __m128i Rn = _mm_or_si128(_mm_slli_epi32(Rv[v], 16), w);
+	    Rv[v] = _mm_blendv_epi8(Rv[v], Rn, renorm);
+	    ptr += __builtin_popcount(imask);
+	}
+    }
+
+    for (v = 0; v < 8; v++)
+	_mm_storeu_si128((__m128i *)&R[v*4], Rv[v]);
+
+    *pptr = (uint8_t *)ptr;
+    return i;
+}
+
+// As above but 4 vectors of 8 states, using gathers.
+TARGET("avx2")
+static int rans_dec_O0_32x16_avx2(RansState *R, uint8_t **pptr, uint8_t *ptr_end,
+				  uint32_t *s3, unsigned char *out, int out_end) {
+    const __m256i maskv  = _mm256_set1_epi32(TOTFREQ-1);
+    const __m256i bmaskv = _mm256_set1_epi32(0xfff);
+    const __m256i onev   = _mm256_set1_epi32(1);
+    const __m256i Lv     = _mm256_set1_epi32(RANS_BYTE_L);
+    const __m256i ordv   = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+    uint16_t *ptr = (uint16_t *)*pptr;
+    __m256i Rv[4], Sv[4];
+    int i, v;
+
+    for (v = 0; v < 4; v++)
+	Rv[v] = _mm256_loadu_si256((__m256i *)&R[v*8]);
+
+    // Each renorm loads 16 bytes, so stop 4 loads short of the input end.
+    for (i = 0; i < out_end && (uint8_t *)ptr + 64 <= ptr_end; i += NX) {
+	for (v = 0; v < 4; v++) {
+	    __m256i m = _mm256_and_si256(Rv[v], maskv);
+	    __m256i s = _mm256_i32gather_epi32((int *)s3, m, 4);
+	    __m256i f = _mm256_add_epi32(_mm256_srli_epi32(s, 20), onev);
+	    __m256i b = _mm256_and_si256(_mm256_srli_epi32(s, 8), bmaskv);
+	    Rv[v] = _mm256_add_epi32(_mm256_mullo_epi32(f, _mm256_srli_epi32(Rv[v], TF_SHIFT)), b);
+	    Sv[v] = _mm256_and_si256(s, _mm256_set1_epi32(0xff));
+	}
+
+	// 32x 32-bit symbols to 32x 8-bit
+	__m256i s01 = _mm256_packus_epi32(Sv[0], Sv[1]);
+	__m256i s23 = _mm256_packus_epi32(Sv[2], Sv[3]);
+	__m256i s03 = _mm256_packus_epi16(s01, s23);
+	_mm256_storeu_si256((__m256i *)&out[i], _mm256_permutevar8x32_epi32(s03, ordv));
+
+	// Renormalise in state order
+	for (v = 0; v < 4; v++) {
+	    __m256i renorm = _mm256_cmpgt_epi32(Lv, Rv[v]);
+	    unsigned int imask = _mm256_movemask_ps(_mm256_castsi256_ps(renorm));
+	    __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&rans_permute[imask]));
+	    __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)ptr));
+	    w = _mm256_permutevar8x32_epi32(w, idx);
+	    __m256i Rn = _mm256_or_si256(_mm256_slli_epi32(Rv[v], 16), w);
+	    Rv[v] = _mm256_blendv_epi8(Rv[v], Rn, renorm);
+	    ptr += __builtin_popcount(imask);
+	}
+    }
+
+    for (v = 0; v < 4; v++)
+	_mm256_storeu_si256((__m256i *)&R[v*8], Rv[v]);
+
+    *pptr = (uint8_t *)ptr;
+    return i;
+}
+
+// As above but 2 vectors of 16 states.  Renormalisation is a masked
+// expand, so needs no permutation table.
+TARGET("avx512f")
+static int rans_dec_O0_32x16_avx512(RansState *R, uint8_t **pptr, uint8_t *ptr_end,
+				    uint32_t *s3, unsigned char *out, int out_end) {
+    const __m512i maskv  = _mm512_set1_epi32(TOTFREQ-1);
+    const __m512i bmaskv = _mm512_set1_epi32(0xfff);
+    const __m512i onev   = _mm512_set1_epi32(1);
+    const __m512i Lv     = _mm512_set1_epi32(RANS_BYTE_L);
+    uint16_t *ptr = (uint16_t *)*pptr;
+    __m512i Rv[2];
+    int i, v;
+
+    for (v = 0; v < 2; v++)
+	Rv[v] = _mm512_loadu_si512((void *)&R[v*16]);
+
+    // Each renorm loads 32 bytes, so stop 2 loads short of the input end.
+    for (i = 0; i < out_end && (uint8_t *)ptr + 64 <= ptr_end; i += NX) {
+	for (v = 0; v < 2; v++) {
+	    __m512i m = _mm512_and_si512(Rv[v], maskv);
+	    __m512i s = _mm512_i32gather_epi32(m, (void *)s3, 4);
+	    __m512i f = _mm512_add_epi32(_mm512_srli_epi32(s, 20), onev);
+	    __m512i b = _mm512_and_si512(_mm512_srli_epi32(s, 8), bmaskv);
+	    Rv[v] = _mm512_add_epi32(_mm512_mullo_epi32(f, _mm512_srli_epi32(Rv[v], TF_SHIFT)), b);
+	    _mm_storeu_si128((__m128i *)&out[i+v*16], _mm512_cvtepi32_epi8(s));
+	}
+
+	// Renormalise in state order
+	for (v = 0; v < 2; v++) {
+	    __mmask16 renorm = _mm512_cmplt_epu32_mask(Rv[v], Lv);
+	    __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)ptr));
+	    w = _mm512_maskz_expand_epi32(renorm, w);
+	    __m512i Rn = _mm512_or_si512(_mm512_slli_epi32(Rv[v], 16), w);
+	    Rv[v] = _mm512_mask_blend_epi32(renorm, Rv[v], Rn);
+	    ptr += __builtin_popcount(renorm);
+	}
+    }
+
+    for (v = 0; v < 2; v++)
+	_mm512_storeu_si512((void *)&R[v*16], Rv[v]);
+
+    *pptr = (uint8_t *)ptr;
+    return i;
+}
+#endif /* RANS_X86_KERNELS */
+
+static rans_dec32_fn rans_dec_O0_32x16_kernel(void) {
+    switch (rans_cpu_level()) {
+#ifdef RANS_X86_KERNELS
+    case RANS_CPU_AVX512: return rans_dec_O0_32x16_avx512;
+    case RANS_CPU_AVX2:   return rans_dec_O0_32x16_avx2;
+    case RANS_CPU_SSE4:   return rans_dec_O0_32x16_sse4;
+#endif
+    default:              return NULL;
+    }
+}
+
+unsigned char *rans_uncompress_O0_32x16(unsigned char *in, unsigned int in_size,
+					unsigned char *out, unsigned int *out_size) {
+    /* Load in the static tables */
+    unsigned char *cp = in, *cp_end = in + in_size;
+    int i, j, x, y, out_sz, z;
+    uint16_t sfreq[TOTFREQ+32];
+    uint16_t sbase[TOTFREQ+32];
+    uint8_t  ssym [TOTFREQ+64];
+    uint32_t s3[TOTFREQ];
+    rans_dec32_fn vec_dec = rans_dec_O0_32x16_kernel();
+    unsigned char *out_free = NULL;
+
+    out_sz = *out_size;
+    if (!out) {
+	out = out_free = malloc(out_sz);
+	*out_size = out_sz;
+    }
+    if (!out || out_sz > *out_size)
+	return NULL;
+
+    int F[256] = {0};
+    cp += decode_freq0_small(cp, F);
+
+    for (j = x = 0; j < 256; j++) {
+	if (F[j]) {
+	    // Corrupt tables may claim more than TOTFREQ
+	    if (F[j] < 0 || x + F[j] > TOTFREQ) {
+		free(out_free);
+		return NULL;
+	    }
+	    for (y = 0; y < F[j]; y++) {
+		ssym [y + x] = j;
+		sfreq[y + x] = F[j];
+		sbase[y + x] = y;
+		s3   [y + x] = (uint32_t)(F[j]-1) << 20 | (y<<8) | j;
+	    }
+	    x += F[j];
+	}
+    }
+
+    RansState R[NX];
+    for (z = 0; z < NX; z++)
+	RansDecInit(&R[z], &cp);
+
+    int out_end = (out_sz&~(NX-1));
+    const uint32_t mask = (1u << TF_SHIFT)-1;
+
+    i = vec_dec ? vec_dec(R, &cp, cp_end, s3, out, out_end) : 0;
+
+    for (; i < out_end; i+=NX) {
+	for (z = 0; z < NX; z++) {
+	    uint32_t m = R[z] & mask;
+	    out[i+z] = ssym[m];
+	    R[z] = sfreq[m] * (R[z] >> TF_SHIFT) + sbase[m];
+	}
+	for (z = 0; z < NX; z++)
+	    RansDecRenorm(&R[z], &cp);
     }
+
+    for (z = 0; z < (out_sz & (NX-1)); z++)
+	out[out_end + z] = ssym[R[z] & mask];
+
+    *out_size = out_sz;
+    return out;
 }
 
 //-----------------------------------------------------------------------------
 #if 1
-static uint8_t *rle_encode(uint8_t *data, int64_t len,
+// Run-length encodes data into out (literals, at most len+257 bytes) and
+// out_meta (run lengths, at most len bytes).
+static uint8_t *rle_encode(uint8_t *data, int64_t len, uint8_t *out,
 			   uint8_t *out_meta, int *out_meta_len, int64_t *out_len) {
     uint64_t i, j, k = 0;
     int last = -1;
-    unsigned char *out = malloc(len*2);
 
     int run_len = 0;
     
@@ -1071,11 +2089,18 @@ static unsigned char *grow(unsigned char *b, uint64_t *alloc, uint64_t used, uin
     return b;
 }
 
-static uint8_t *rle_decode(uint8_t *in, int64_t in_len, uint8_t *meta, unsigned char *out, int64_t *out_len) {
-    uint64_t o_len = in_len;
+// Decodes RLE literals in and run-lengths meta into out.  *out_len is the
+// size of out on input and the decoded size on output.  Returns NULL if
+// the data is malformed.
+static uint8_t *rle_decode(uint8_t *in, int64_t in_len,
+			   uint8_t *meta, int64_t meta_len,
+			   unsigned char *out, int64_t *out_len) {
+    uint64_t o_len = *out_len;
     uint64_t i, j, m;
 
     int saved[256] = {0};
+    if (in_len < 1 || in[0] >= in_len)
+	return NULL;
     for (i = 0, j = in[i++]; j; j--)
 	saved[in[i++]]=1;
 
@@ -1087,15 +2112,21 @@ static uint8_t *rle_decode(uint8_t *in, int64_t in_len, uint8_t *meta, unsigned
 	    unsigned char c, s = 0;
 	    do {
 		//c = in[i++];
+		if (m >= meta_len || s > 28)
+		    return NULL;
 		c = meta[m++];
 		run_len |= (c & 0x7f) << s;
 		s += 7;
 	    } while (c & 0x80);
 	    run_len++;
 	    //fprintf(stderr, "run_len=%d %x\n", run_len, run_len);
+	    if (run_len > o_len - j)
+		return NULL;
 	    memset(&out[j], b, run_len);
 	    j += run_len;
 	} else {
+	    if (j >= o_len)
+		return NULL;
 	    out[j++] = b;
 	}
     }
@@ -1196,18 +2227,177 @@ static uint8_t *rle_decode(uint8_t *in, int64_t in_len, uint8_t *meta, unsigned
 #endif
 
 //-----------------------------------------------------------------------------
-static uint8_t *pack(uint8_t *data, int64_t len,
+// Vectorised bit-packing kernels.
+//
+// These process whole 16 byte vectors of unpacked data, returning the
+// number of unpacked symbols handled.  The scalar code in pack() and
+// unpack() does the remainder and remains the reference implementation.
+// Packing maps symbols to codes by comparing against each of the nsym
+// symbols in turn, and unpacking maps codes back to symbols with a pshufb
+// lookup.  Codes are combined 2 and 4 per byte with multiply-add, and 8
+// per byte with pmovmskb.
+
+// Packs len symbols into out as nsym codes per byte.  sym[0..n-1] are
+// the symbols present, with code c representing sym[c].
+typedef int64_t (*rans_pack_fn)(uint8_t *data, int64_t len, uint8_t *out,
+				int nsym, uint8_t *sym, int n);
+
+// Unpacks out_len symbols from nsym codes per byte in data, via map p.
+typedef int64_t (*rans_unpack_fn)(uint8_t *data, uint8_t *out,
+				  int64_t out_len, int nsym, uint8_t *p);
+
+#ifdef RANS_X86_KERNELS
+TARGET("sse4.1")
+static int64_t pack_sse4(uint8_t *data, int64_t len, uint8_t *out,
+			 int nsym, uint8_t *sym, int n) {
+    __m128i symv[16];
+    int64_t i, j = 0;
+    int k;
+
+    for (k = 0; k < n; k++)
+	symv[k] = _mm_set1_epi8(sym[k]);
+
+    // Byte reversal within each 8 so pmovmskb puts the first symbol in
+    // the top bit.
+    const __m128i rev8 = _mm_setr_epi8(7,6,5,4,3,2,1,0,
+				       15,14,13,12,11,10,9,8);
+    const __m128i m2 = _mm_set1_epi16(0x0110); // c0*16 + c1
+    const __m128i m4a = _mm_set1_epi16(0x0104); // c0*4 + c1
+    const __m128i m4b = _mm_set1_epi32(0x00010010); // w0*16 + w1
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i d = _mm_loadu_si128((__m128i *)&data[i]);
+	__m128i c = _mm_setzero_si128();
+	for (k = 1; k < n; k++)
+	    c = _mm_or_si128(c, _mm_and_si128(_mm_cmpeq_epi8(d, symv[k]),
+					      _mm_set1_epi8(k)));
+
+	switch (nsym) {
+	case 2: {
+	    __m128i w = _mm_maddubs_epi16(c, m2);
+	    _mm_storel_epi64((__m128i *)&out[j],
+			     _mm_packus_epi16(w, w));
+	    j += 8;
+	    break;
+	}
+	case 4: {
+	    __m128i w = _mm_madd_epi16(_mm_maddubs_epi16(c, m4a), m4b);
+	    w = _mm_packus_epi32(w, w);
+	    w = _mm_packus_epi16(w, w);
+	    *(uint32_t *)&out[j] = _mm_cvtsi128_si32(w);
+	    j += 4;
+	    break;
+	}
+	case 8: {
+	    c = _mm_slli_epi16(_mm_shuffle_epi8(c, rev8), 7);
+	    uint16_t m = _mm_movemask_epi8(c);
+	    out[j++] = m & 0xff;
+	    out[j++] = m >> 8;
+	    break;
+	}
+	}
+    }
+
+    return i;
+}
+
+TARGET("sse4.1")
+static int64_t unpack_sse4(uint8_t *data, uint8_t *out, int64_t out_len,
+			   int nsym, uint8_t *p) {
+    const __m128i lo4 = _mm_set1_epi8(0x0f);
+    int64_t i, j = 0;
+
+    switch (nsym) {
+    case 2: {
+	__m128i map = _mm_loadu_si128((__m128i *)p);
+	for (i = 0; i + 16 <= out_len; i += 16, j += 8) {
+	    __m128i b  = _mm_loadl_epi64((__m128i *)&data[j]);
+	    __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), lo4);
+	    __m128i lo = _mm_and_si128(b, lo4);
+	    __m128i c  = _mm_unpacklo_epi8(hi, lo);
+	    _mm_storeu_si128((__m128i *)&out[i], _mm_shuffle_epi8(map, c));
+	}
+	return i;
+    }
+
+    case 4: {
+	// Each byte is split into its two nibbles, each of which holds
+	// two codes.  Even outputs come from the top 2 bits of a nibble
+	// and odd ones from the bottom 2.
+	uint8_t ta[16], tb[16];
+	int k;
+	for (k = 0; k < 16; k++) {
+	    ta[k] = p[k>>2];
+	    tb[k] = p[k&3];
+	}
+	__m128i mapa = _mm_loadu_si128((__m128i *)ta);
+	__m128i mapb = _mm_loadu_si128((__m128i *)tb);
+	const __m128i rep = _mm_setr_epi8(0,0,0,0, 1,1,1,1,
+					  2,2,2,2, 3,3,3,3);
+	const __m128i hsel = _mm_setr_epi8(-1,-1,0,0, -1,-1,0,0,
+					   -1,-1,0,0, -1,-1,0,0);
+	const __m128i osel = _mm_set1_epi16((short)0xff00);
+	for (i = 0; i + 16 <= out_len; i += 16, j += 4) {
+	    __m128i b  = _mm_shuffle_epi8(
+		_mm_cvtsi32_si128(*(int32_t *)&data[j]), rep);
+	    __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), lo4);
+	    __m128i lo = _mm_and_si128(b, lo4);
+	    __m128i nb = _mm_blendv_epi8(lo, hi, hsel);
+	    __m128i o  = _mm_blendv_epi8(_mm_shuffle_epi8(mapa, nb),
+					 _mm_shuffle_epi8(mapb, nb), osel);
+	    _mm_storeu_si128((__m128i *)&out[i], o);
+	}
+	return i;
+    }
+
+    case 8: {
+	const __m128i rep  = _mm_setr_epi8(0,0,0,0,0,0,0,0,
+					   1,1,1,1,1,1,1,1);
+	const __m128i bits = _mm_setr_epi8(-128,64,32,16,8,4,2,1,
+					   -128,64,32,16,8,4,2,1);
+	__m128i p0 = _mm_set1_epi8(p[0]);
+	__m128i p1 = _mm_set1_epi8(p[1]);
+	for (i = 0; i + 16 <= out_len; i += 16, j += 2) {
+	    __m128i b = _mm_shuffle_epi8(
+		_mm_cvtsi32_si128(*(uint16_t *)&data[j]), rep);
+	    __m128i m = _mm_cmpeq_epi8(_mm_and_si128(b, bits), bits);
+	    _mm_storeu_si128((__m128i *)&out[i], _mm_blendv_epi8(p0, p1, m));
+	}
+	return i;
+    }
+    }
+
+    return 0;
+}
+#endif /* RANS_X86_KERNELS */
+
+static rans_pack_fn rans_pack_kernel(void) {
+#ifdef RANS_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	return pack_sse4;
+#endif
+    return NULL;
+}
+
+static rans_unpack_fn rans_unpack_kernel(void) {
+#ifdef RANS_X86_KERNELS
+    if (rans_cpu_level() >= RANS_CPU_SSE4)
+	return unpack_sse4;
+#endif
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Packs data into out, which must be at least len bytes long.  If packing
+// isn't possible, out_meta[0] is 1 and data is returned unmodified.
+static uint8_t *pack(uint8_t *data, int64_t len, uint8_t *out,
 		     uint8_t *out_meta, int *out_meta_len, int64_t *out_len) {
     int p[256] = {0}, n;
     int64_t i, j;
-    uint8_t *out = malloc(len+1);
-    if (!out)
-	return NULL;
 
     // count syms
-    for (i = 0; i < len; i++)
-	p[data[i]]=1;
-    
+    present8(data, len, p);
+
     for (i = n = 0; i < 256; i++) {
 	if (p[i]) {
 	    p[i] = n++; // p[i] is now the code number
@@ -1222,10 +2412,8 @@ static uint8_t *pack(uint8_t *data, int64_t len,
     if (n > 16 || len < j + len/2) {
 	out_meta[0] = 1;
 	*out_meta_len = 1;
-	// FIXME shortcut this by returning data and checking later.
-	memcpy(out, data, len);
 	*out_len = len;
-	return out;
+	return data;
     }
 
     // Encode original length
@@ -1238,10 +2426,17 @@ static uint8_t *pack(uint8_t *data, int64_t len,
     *out_meta_len = j;
     j = 0;
 
+    // Bulk of the data via SIMD, if available, leaving the remainder.
+    rans_pack_fn pack_vec = rans_pack_kernel();
+    int nsym = n > 4 ? 2 : n > 2 ? 4 : n > 1 ? 8 : 0;
+    int64_t i0 = nsym && pack_vec
+	? pack_vec(data, len, out, nsym, out_meta+1, n)
+	: 0;
+
     // 2 values per byte
     if (n > 4) {
 	out_meta[0] = 2;
-	for (i = 0; i < (len & ~1); i+=2)
+	for (i = i0, j = i0/2; i < (len & ~1); i+=2)
 	    out[j++] = (p[data[i]]<<4) | (p[data[i+1]]<<0);
 	switch (len-i) {
 	case 1: out[j++] = p[data[i]]<<4;
@@ -1253,7 +2448,7 @@ static uint8_t *pack(uint8_t *data, int64_t len,
     // 4 values per byte
     if (n > 2) {
 	out_meta[0] = 4;
-	for (i = 0; i < (len & ~3); i+=4)
+	for (i = i0, j = i0/4; i < (len & ~3); i+=4)
 	    out[j++] = (p[data[i]]<<6) | (p[data[i+1]]<<4) | (p[data[i+2]]<<2) | (p[data[i+3]]<<0);
 	out[j] = 0;
 	int s = len-i;
@@ -1270,7 +2465,7 @@ static uint8_t *pack(uint8_t *data, int64_t len,
     // 8 values per byte
     if (n > 1) {
 	out_meta[0] = 8;
-	for (i = 0; i < (len & ~7); i+=8)
+	for (i = i0, j = i0/8; i < (len & ~7); i+=8)
 	    out[j++] = (p[data[i+0]]<<7) | (p[data[i+1]]<<6) | (p[data[i+2]]<<5) | (p[data[i+3]]<<4)
 		     | (p[data[i+4]]<<3) | (p[data[i+5]]<<2) | (p[data[i+6]]<<1) | (p[data[i+7]]<<0);
 	out[j] = 0;
@@ -1336,10 +2531,18 @@ static uint8_t *unpack(uint8_t *data, int64_t len, uint8_t *out, uint64_t out_le
 	return out;
     }
 
+    // Bulk of the data via SIMD, if available, leaving the remainder.
+    rans_unpack_fn unpack_vec = rans_unpack_kernel();
+    int64_t i0 = nsym > 1 && unpack_vec
+	? unpack_vec(data, out, out_len, nsym, p)
+	: 0;
+    if (nsym > 1)
+	j = i0 / nsym;
+
     switch(nsym) {
     case 8:
 	olen = out_len & ~7;
-	for (i = 0; i < olen; i+=8) {
+	for (i = i0; i < olen; i+=8) {
 	    c = data[j++];
 	    out[i+0] = p[(c>>7)&1];
 	    out[i+1] = p[(c>>6)&1];
@@ -1383,7 +2586,7 @@ static uint8_t *unpack(uint8_t *data, int64_t len, uint8_t *out, uint64_t out_le
 	}
 #else
 	olen = out_len & ~3;
-	for (i = 0; i < olen; i+=4) {
+	for (i = i0; i < olen; i+=4) {
 	    c = data[j++];
 	    out[i+0] = p[(c>>6)&3];
 	    out[i+1] = p[(c>>4)&3];
@@ -1404,7 +2607,7 @@ static uint8_t *unpack(uint8_t *data, int64_t len, uint8_t *out, uint64_t out_le
 
     case 2:
 	olen = out_len & ~1;
-	for (i = 0; i < olen; i+=2) {
+	for (i = i0; i < olen; i+=2) {
 	    c = data[j++];
 	    out[i+0] = p[(c>>4)&15];
 	    out[i+1] = p[(c>>0)&15];
@@ -1420,171 +2623,165 @@ static uint8_t *unpack(uint8_t *data, int64_t len, uint8_t *out, uint64_t out_le
 	break;
 
     default:
-	free(out);
 	return NULL;
     }
 
     return out;
 }
 
-#if 0
-// Marginally faster, but not worth extra complexity currently until we
-// optimise further
-static uint8_t *rle_decode_unpack(uint8_t *in, int64_t in_len, uint8_t *meta, int nsym, uint8_t *p,
-				  unsigned char *out, int64_t out_len) {
-    uint64_t o_len = in_len;
-    uint64_t i, j, m;
+/*
+ * Combined RLE decode and bit unpacking, for data that was packed and then
+ * run-length encoded.  in/meta are as per rle_decode and the decoded
+ * bytes are expanded to nsym (1, 2, 4 or 8) symbols each via the pack
+ * map p, writing exactly out_len bytes to out.  This avoids writing the
+ * RLE output to a temporary buffer only to read it straight back.
+ *
+ * Returns out on success, or NULL if the data is malformed.
+ */
+static uint8_t *rle_decode_unpack(uint8_t *in, int64_t in_len,
+				  uint8_t *meta, int64_t meta_len,
+				  int nsym, uint8_t *p,
+				  uint8_t *out, int64_t out_len) {
+    int64_t i, j, m, nfull = out_len / nsym;
+    int tail = out_len % nsym, n, b, k;
+
+    // Expansion of each packed byte, as per unpack()
+    uint8_t x[256][8];
+    int bits = nsym == 2 ? 4 : nsym == 4 ? 2 : nsym == 8 ? 1 : 8;
+    if (nsym != 1 && nsym != 2 && nsym != 4 && nsym != 8)
+	return NULL;
+    for (b = 0; b < 256; b++)
+	for (k = 0; k < nsym; k++)
+	    x[b][k] = nsym == 1
+		? b
+		: p[(b >> (8 - bits*(k+1))) & ((1<<bits)-1)];
 
     int saved[256] = {0};
-    for (i = 0, j = in[i++]; j; j--)
-	saved[in[i++]]=1;
+    if (in_len < 1 || in[0] >= in_len)
+	return NULL;
+    for (i = 1, n = in[0]; n; n--)
+	saved[in[i++]] = 1;
 
+    // j counts packed bytes; only the last may be partial
     j = m = 0;
-    switch (nsym) {
-    case 0:
-	return NULL; // shouldn't happen.
-
-    case 1:
-	while (i < in_len) {
-	    uint8_t b = in[i++];
-	    if (saved[b]) {
-		uint32_t run_len = 0;
-		unsigned char c, s = 0;
-		do {
-		    //c = in[i++];
-		    c = meta[m++];
-		    run_len |= (c & 0x7f) << s;
-		    s += 7;
-		} while (c & 0x80);
-		run_len++;
-		//fprintf(stderr, "run_len=%d %x\n", run_len, run_len);
-		memset(&out[j], b, run_len);
-		j += run_len;
-	    } else {
-		out[j++] = b;
-	    }
-	}
-	break;
-
-    case 2:
-	while (i < in_len) {
-	    uint8_t b = in[i++];
-	    if (saved[b]) {
-		uint32_t run_len = 0;
-		unsigned char c, s = 0;
-		do {
-		    //c = in[i++];
-		    c = meta[m++];
-		    run_len |= (c & 0x7f) << s;
-		    s += 7;
-		} while (c & 0x80);
-		run_len++;
-		//fprintf(stderr, "run_len=%d %x\n", run_len, run_len);
-		int z;
-		for (z = 0; z < run_len; z++, j+=2) {
-		    out[j+0] = p[(b>>4)&15];
-		    out[j+1] = p[(b>>0)&15];
-		}
-	    } else {
-		out[j+0] = p[(b>>4)&15];
-		out[j+1] = p[(b>>0)&15];
-		j += 2;
-	    }
+    while (i < in_len) {
+	uint8_t c = in[i++];
+	uint32_t run_len = 1;
+	if (saved[c]) {
+	    uint32_t v = 0, s = 0;
+	    uint8_t r;
+	    do {
+		if (m >= meta_len || s > 28)
+		    return NULL;
+		r = meta[m++];
+		v |= (uint32_t)(r & 0x7f) << s;
+		s += 7;
+	    } while (r & 0x80);
+	    run_len += v;
 	}
-	break;
+	if (run_len > nfull + (tail != 0) - j)
+	    return NULL;
 
-    case 4:
-	while (i < in_len) {
-	    uint8_t b = in[i++];
-	    if (saved[b]) {
-		uint32_t run_len = 0;
-		unsigned char c, s = 0;
-		do {
-		    //c = in[i++];
-		    c = meta[m++];
-		    run_len |= (c & 0x7f) << s;
-		    s += 7;
-		} while (c & 0x80);
-		run_len++;
-		//fprintf(stderr, "run_len=%d %x\n", run_len, run_len);
-		int z;
-		for (z = 0; z < run_len; z++, j+=4) {
-		    out[j+0] = p[(b>>6)&3];
-		    out[j+1] = p[(b>>4)&3];
-		    out[j+2] = p[(b>>2)&3];
-		    out[j+3] = p[(b>>0)&3];
-		}
-	    } else {
-		out[j+0] = p[(b>>6)&3];
-		out[j+1] = p[(b>>4)&3];
-		out[j+2] = p[(b>>2)&3];
-		out[j+3] = p[(b>>0)&3];
-		j += 4;
-	    }
+#define RLE_UNPACK(N)					\
+	do {						\
+	    uint8_t *o = out + j*N;			\
+	    for (; run_len && j < nfull; run_len--, j++, o += N) \
+		memcpy(o, x[c], N);			\
+	} while (0)
+
+	switch (nsym) {
+	case 1: RLE_UNPACK(1); break;
+	case 2: RLE_UNPACK(2); break;
+	case 4: RLE_UNPACK(4); break;
+	case 8: RLE_UNPACK(8); break;
 	}
-	break;
-
-    case 8:
-	while (i < in_len) {
-	    uint8_t b = in[i++];
-	    if (saved[b]) {
-		uint32_t run_len = 0;
-		unsigned char c, s = 0;
-		do {
-		    //c = in[i++];
-		    c = meta[m++];
-		    run_len |= (c & 0x7f) << s;
-		    s += 7;
-		} while (c & 0x80);
-		run_len++;
-		//fprintf(stderr, "run_len=%d %x\n", run_len, run_len);
-		int z;
-		for (z = 0; z < run_len; z++, j+=8) {
-		    out[j+0] = p[(b>>7)&1];
-		    out[j+1] = p[(b>>6)&1];
-		    out[j+2] = p[(b>>5)&1];
-		    out[j+3] = p[(b>>4)&1];
-		    out[j+4] = p[(b>>3)&1];
-		    out[j+5] = p[(b>>2)&1];
-		    out[j+6] = p[(b>>1)&1];
-		    out[j+7] = p[(b>>0)&1];
-		}
-	    } else {
-		out[j+0] = p[(b>>7)&1];
-		out[j+1] = p[(b>>6)&1];
-		out[j+2] = p[(b>>5)&1];
-		out[j+3] = p[(b>>4)&1];
-		out[j+4] = p[(b>>3)&1];
-		out[j+5] = p[(b>>2)&1];
-		out[j+6] = p[(b>>1)&1];
-		out[j+7] = p[(b>>0)&1];
-		j += 8;
-	    }
+#undef RLE_UNPACK
+	if (run_len) { // final partial byte
+	    memcpy(out + j*nsym, x[c], tail);
+	    j++;
 	}
-	break;
     }
 
+    if (j != nfull + (tail != 0))
+	return NULL;
+
     return out;
 }
-#endif
 
 //-----------------------------------------------------------------------------
 
-unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
-				     unsigned char *out, unsigned int *out_size) {
-    unsigned char *cp, *out_end, *op;
+/*
+ * Picks the frequency precision for an order-1 or order-2 block of
+ * in_size bytes over nctx contexts and an alphabet of D symbols.
+ *
+ * Precision beyond the typical number of symbols per context buys little,
+ * but costs in the frequency table (more contexts exceed the total so get
+ * stored normalised rather than as raw counts) and in the decoder table
+ * build and cache footprint.  So use roughly log2 of the symbols per
+ * context, but enough for a context holding the whole alphabet to still
+ * code its common symbols well, and never more than the default.
+ *
+ * The choice is stored in the top nibble of the first byte of the
+ * order-1/2 data (the compressed table flag), with 0 meaning the default.
+ */
+static int rans_tf_shift(unsigned int in_size, int nctx, int D, int def) {
+    unsigned int avg = in_size / (nctx ? nctx : 1);
+    int shift = 0, dbits = 0;
+    while (shift < def && (2u<<shift) <= avg)
+	shift++;
+    while ((1<<dbits) < D)
+	dbits++;
+    if (shift < dbits+1)
+	shift = dbits+1;
+    if (shift < TF_SHIFT_MIN)
+	shift = TF_SHIFT_MIN;
+    return shift < def ? shift : def;
+}
+
+/*
+ * Order-1 frequency table inheritance (X_TAB).
+ *
+ * Consecutive blocks of a stream, such as quality values cut into 1Mb
+ * chunks, often have near identical statistics.  Rather than storing and
+ * rebuilding the same table each time, a block may instead declare it is
+ * using the table from the previous order-1 block decoded with the same
+ * context.  It then has no frequency table at all, not even the leading
+ * flag byte, and the decoder keeps its existing symbol lookup tables.
+ *
+ * The encoder keeps a copy of the last normalised table emitted and
+ * reuses it if every symbol in the new block has a non-zero frequency in
+ * it and coding with it costs fewer bits than the new table plus its
+ * storage.  Blocks must be decoded in the same order they were encoded.
+ */
+typedef struct {
+    uint16_t F[256][256]; // normalised frequencies, rows valid if ctx[i]
+    uint8_t  ctx[256];    // contexts present
+    int      shift;       // frequency precision
+    int      valid;
+} rans_o1_enc_tab;
+
+/*
+ * As per rans_enc_O0_4x16, writing to the end of out.
+ *
+ * If prev is non-NULL and valid, the block may be coded with that table
+ * instead, in which case *reused is set and no table is written.  If next
+ * is non-NULL and a new table is written, it's recorded there for use by
+ * the following block.  Both may be NULL, as may h, the histograms of in
+ * if already known.
+ */
+static unsigned char *rans_enc_O1_4x16(unsigned char *in, unsigned int in_size,
+				       unsigned char *out, unsigned int *out_size,
+				       const rans_hist *h, rans_o1_enc_tab *prev,
+				       rans_o1_enc_tab *next, int *reused) {
+    unsigned char *cp, *out_end;
     unsigned int tab_size, rle_i, rle_j;
     RansEncSymbol syms[256][256];
     int bound = rans_compress_bound_4x16(in_size,1)-5; // -5 for order/size
 
-    if (!out) {
-	*out_size = bound;
-	out = malloc(*out_size);
-    }
-    if (!out || bound > *out_size)
+    if (bound > *out_size)
 	return NULL;
 
-    out_end = out + bound;
+    out_end = out + *out_size;
 
     // Encode input size
     cp = out;
@@ -1598,31 +2795,63 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 //	*cp++ = (in_size>> 0) & 0xff;
 //    }
 
-    int F[256][256] = {{0}}, T[256+MAGIC] = {0}, i, j;
+    int F[256][256], T[256+MAGIC] = {0}, i, j;
 
-    //memset(F, 0, 256*256*sizeof(int));
-    //memset(T, 0, 256*sizeof(int));
+    // Only contexts for symbols present (plus 0, the initial context)
+    // are ever read, so there's no need to clear all 256Kb of F.  This
+    // matters for the many small blocks from the name tokeniser.
+    int F0[256+MAGIC] = {0};
+    if (h) {
+	memcpy(F0, h->F0, 256*sizeof(*F0));
+	for (i = 0; i < 256; i++) {
+	    if (F0[i] || i == 0) {
+		memcpy(F[i], h->F1[i], sizeof(F[i]));
+		T[i] = h->T1[i];
+	    }
+	}
+    } else {
+	present8(in, in_size, F0);
+	memset(F[0], 0, sizeof(F[0]));
+	for (i = 1; i < 256; i++)
+	    if (F0[i])
+		memset(F[i], 0, sizeof(F[i]));
 
-    hist1_4(in, in_size, F, T);
+	hist_o1(in, in_size, F, T);
+    }
 
-    op = cp;
-    *cp++ = 0; // uncompressed header marker
+    F[0][in[1*(in_size>>2)]]++;
+    F[0][in[2*(in_size>>2)]]++;
+    F[0][in[3*(in_size>>2)]]++;
+    T[0]+=3;
+
+    int nctx = 0;
+    for (i = 0; i < 256; i++)
+	nctx += T[i] != 0;
+    int shift = rans_tf_shift(in_size, nctx, nctx, TF_SHIFT_O1);
+    int tot = 1<<shift, tf_bits = shift == TF_SHIFT_O1 ? 0 : shift<<4;
+
+    // Estimated cost in 1/256ths of a bit of coding with the previous
+    // table and with the new one.  Reuse is only possible if every
+    // symbol in every context has a frequency in the old table.
+    int try_reuse = prev && prev->valid;
+    int64_t reuse_cost = 0, new_cost = 0;
+    if (reused)
+	*reused = 0;
+    if (next) {
+	memset(next->ctx, 0, sizeof(next->ctx));
+	next->shift = shift;
+	next->valid = 0;
+    }
+
+    *cp++ = tf_bits; // uncompressed header marker, plus precision
 
     // Encode the order-0 symbols for use in the order-1 frequency tables
-    int F0[256+MAGIC] = {0};
-    present8(in, in_size, F0);
 
     int n = encode_freq0(cp, F0);
     //fprintf(stderr, "tab0part=%d\n", (int)n);
     cp += n;
 
-    F[0][in[1*(in_size>>2)]]++;
-    F[0][in[2*(in_size>>2)]]++;
-    F[0][in[3*(in_size>>2)]]++;
-    T[0]+=3;
-
-    
-    // Normalise so T[i] == TOTFREQ_O1
+    // Normalise so T[i] == tot
     for (rle_i = i = 0; i < 256; i++) {
 	int t2, m, M;
 	unsigned int x;
@@ -1630,6 +2859,29 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 	if (T[i] == 0)
 	    continue;
 
+	// Counts prior to normalisation, for the cost estimates
+	int C[256];
+	if (try_reuse || next)
+	    memcpy(C, F[i], sizeof(C));
+
+	if (try_reuse) {
+	    uint16_t *P = prev->F[i];
+	    unsigned int lt = prev->shift<<8;
+	    if (!prev->ctx[i]) {
+		try_reuse = 0;
+	    } else {
+		for (j = 0; j < 256; j++) {
+		    if (!C[j])
+			continue;
+		    if (!P[j]) {
+			try_reuse = 0;
+			break;
+		    }
+		    reuse_cost += (int64_t)C[j] * (lt - ilog2_q8(P[j]));
+		}
+	    }
+	}
+
 	// Store frequency table; outer level.
 	// i
 	if (rle_i) {
@@ -1645,52 +2897,70 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 	}
 
 #ifdef FAST
-	normalise_freq(F[i], T[i], TOTFREQ_O1);
+	normalise_freq(F[i], T[i], tot);
 	cp += encode_freq_d(cp, F0, F[i]);
 #else
 	// Order-1 frequencies often end up totalling under TOTFREQ.
 	// In this case it's smaller to output the real frequencies
 	// prior to normalisation and normalise after (with an extra
 	// normalisation step needed in the decoder too).
-	if (T[i] > TOTFREQ_O1)
-	    normalise_freq(F[i], T[i], TOTFREQ_O1);
+	if (T[i] > tot)
+	    normalise_freq(F[i], T[i], tot);
 
 	cp += encode_freq_d(cp, F0, F[i]);
 
-	if (T[i] < TOTFREQ_O1)
-	    normalise_freq(F[i], T[i], TOTFREQ_O1);
+	if (T[i] < tot)
+	    normalise_freq(F[i], T[i], tot);
 #endif
 
 	int *F_i_ = F[i];
 	for (x = j = 0; j < 256; j++) {
-	    RansEncSymbolInit(&syms[i][j], x, F_i_[j], TF_SHIFT_O1);
+	    if (!F_i_[j])
+		continue;
+	    RansEncSymbolInit(&syms[i][j], x, F_i_[j], shift);
 	    x += F_i_[j];
 	}
 
-    }
-    *cp++ = 0;
-
-    if (cp - op > 1000 && cp - op < 100000) {
-	// try rans0 compression of header
-	unsigned int c_freq_sz, u_freq_sz = cp-(op+1);
-	unsigned char *c_freq = rans_compress_O0_4x16(op+1, u_freq_sz, NULL, &c_freq_sz);
-	if (c_freq && c_freq_sz < 65536 && c_freq_sz + 3 < cp-op) {
-	    *op++ = 1+(u_freq_sz > 65535); // compressed
-	    *op++ = c_freq_sz & 0xff;
-	    *op++ = c_freq_sz>>8;
-	    *op++ = u_freq_sz & 0xff;
-	    *op++ = (u_freq_sz>>8) & 0xff;
-	    if (u_freq_sz > 65535)
-		*op++ = (u_freq_sz>>16) & 0xff;
-	    memcpy(op, c_freq, c_freq_sz);
-	    cp = op+c_freq_sz;
+	if (try_reuse || next) {
+	    unsigned int lt = shift<<8;
+	    for (j = 0; j < 256; j++)
+		if (C[j])
+		    new_cost += (int64_t)C[j] * (lt - ilog2_q8(F_i_[j]));
+	}
+	if (next) {
+	    next->ctx[i] = 1;
+	    for (j = 0; j < 256; j++)
+		next->F[i][j] = F_i_[j];
 	}
-	free(c_freq);
     }
+    *cp++ = 0;
 
     //write(2, out+4, cp-(out+4));
     tab_size = cp - out;
     assert(tab_size < 257*257*3);
+
+    if (try_reuse && reuse_cost <= new_cost + (int64_t)tab_size*8*256) {
+	// Previous table is cheaper; rebuild the symbols from it instead.
+	// Contexts are those present in this block, all of which exist in
+	// prev.
+	for (i = 0; i < 256; i++) {
+	    if (!T[i])
+		continue;
+	    uint16_t *P = prev->F[i];
+	    unsigned int x;
+	    for (x = j = 0; j < 256; j++) {
+		if (!P[j])
+		    continue;
+		RansEncSymbolInit(&syms[i][j], x, P[j], prev->shift);
+		x += P[j];
+	    }
+	}
+	tab_size = 0;
+	if (reused)
+	    *reused = 1;
+    } else if (next) {
+	next->valid = 1;
+    }
     
     RansState rans0, rans1, rans2, rans3;
     RansEncInit(&rans0);
@@ -1747,6 +3017,28 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
     RansEncFlush(&rans1, &ptr);
     RansEncFlush(&rans0, &ptr);
 
+    if (tab_size > 1000 && tab_size < 100000) {
+	// try rans0 compression of header, into the gap between the
+	// table and the rANS data.
+	unsigned int c_freq_sz = ptr - (out + tab_size);
+	unsigned int u_freq_sz = tab_size-1;
+	unsigned char *c_freq = rans_enc_O0_4x16(out+1, u_freq_sz, out+tab_size, &c_freq_sz);
+	if (c_freq && c_freq_sz < 65536 && c_freq_sz + 3 < tab_size) {
+	    // c_freq ends at ptr; prepend its header
+	    cp = c_freq;
+	    if (u_freq_sz > 65535)
+		*--cp = (u_freq_sz>>16) & 0xff;
+	    *--cp = (u_freq_sz>>8) & 0xff;
+	    *--cp = u_freq_sz & 0xff;
+	    *--cp = c_freq_sz>>8;
+	    *--cp = c_freq_sz & 0xff;
+	    *--cp = 1+(u_freq_sz > 65535); // compressed
+	    *cp |= tf_bits;
+	    *out_size = out_end - cp;
+	    return cp;
+	}
+    }
+
     *out_size = (out_end - ptr) + tab_size;
 
 //    cp = out;
@@ -1755,8 +3047,24 @@ unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
 //    *cp++ = (in_size>>24) & 0xff;
 //    *cp++ = (in_size>>16) & 0xff;
 
-    memmove(out + tab_size, ptr, out_end-ptr);
+    memmove(ptr - tab_size, out, tab_size);
+
+    return ptr - tab_size;
+}
+
+unsigned char *rans_compress_O1_4x16(unsigned char *in, unsigned int in_size,
+				     unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp;
+
+    if (!out) {
+	*out_size = rans_compress_bound_4x16(in_size,1)-5;
+	out = malloc(*out_size);
+    }
+    if (!out || !(cp = rans_enc_O1_4x16(in, in_size, out, out_size,
+					 NULL, NULL, NULL, NULL)))
+	return NULL;
 
+    memmove(out, cp, *out_size);
     return out;
 }
 
@@ -1765,36 +3073,92 @@ typedef struct {
     uint16_t b;
 } sb_t;
 
-unsigned char *rans_uncompress_O1sfb_4x16(unsigned char *in, unsigned int in_size,
-					  unsigned char *out, unsigned int *out_size) {
+/*
+ * Order-1 decoder tables.
+ *
+ * Symbols present (the order-0 list at the start of the table) are
+ * remapped to a dense alphabet of D symbols, with dense id 0 always being
+ * byte 0 as that is the starting context.  Tables are only built for
+ * those D contexts.  Each entry packs (freq-1)<<20 | bias<<8 | dense id
+ * into 32-bits, so one load per symbol gives everything needed, and the
+ * dense id is also the next context.
+ *
+ * For typical quality data D is ~40 so this is ~320Kb instead of the 3Mb
+ * needed for sfb[256][TOTFREQ_O1] + ssym[256][TOTFREQ_O1].  It's on the
+ * heap and kept between calls where the caller supplies a workspace.
+ */
+typedef struct {
+    uint32_t *s3;    // [D][1<<shift]
+    size_t    s3_a;
+    uint8_t  *hdr;   // uncompressed frequency table, if rANS-0 encoded
+    size_t    hdr_a;
+    uint8_t   sym[256]; // dense id to symbol, kept for X_TAB reuse
+    int       shift;
+    int       valid;    // s3, sym and shift hold the last table decoded
+} rans_o1_tables;
+
+static void rans_o1_tables_free(rans_o1_tables *t) {
+    free(t->s3);
+    free(t->hdr);
+    memset(t, 0, sizeof(*t));
+}
+
+// Ensures room for D contexts.  Returns 0 on success, -1 on failure.
+static int rans_o1_tables_grow(rans_o1_tables *t, int D, int shift) {
+    size_t s3_a = (size_t)D << shift;
+
+    if (s3_a > t->s3_a) {
+	uint32_t *s3 = realloc(t->s3, s3_a * sizeof(*s3));
+	if (!s3)
+	    return -1;
+	t->s3 = s3;
+	t->s3_a = s3_a;
+    }
+
+    return 0;
+}
+
+/*
+ * If reuse is set the block has no frequency table and is decoded using
+ * the tables left in tab by the previous call (X_TAB).
+ */
+static unsigned char *rans_uncompress_O1_4x16_ws(rans_o1_tables *tab,
+						 unsigned char *in, unsigned int in_size,
+						 unsigned char *out, unsigned int *out_size,
+						 int reuse) {
     /* Load in the static tables */
-    //unsigned char *cp = in + 4, *out_orig = NULL;
-    unsigned char *cp = in, *out_orig = NULL;
-    int i, j = -999, x, y, out_sz, rle_i, rle_j;
-    sb_t sfb[256][TOTFREQ_O1+32];
-    // uint16_t for ssym sometimes works faster, but considter 8-bit if cache is tight
-    uint16_t ssym [256][TOTFREQ_O1+32];
-    
-    //memset(D, 0, 256*sizeof(*D));
+    unsigned char *cp = in;
+    unsigned char *out_free = NULL;
+    int i, j, x, out_sz, rle_i;
 
-    //out_sz = ((in[0])<<0) | ((in[1])<<8) | ((in[2])<<16) | ((in[3])<<24);
-//    out_sz = in[0] & 0x80
-//	? ((in[0]&0x7f)<<8) | in[1]
-//	: ((in[0])<<24) | ((in[1])<<16) | ((in[2])<<8) | ((in[3])<<0);
     out_sz = *out_size;
     if (!out) {
-	out = malloc(out_sz);
+	out = out_free = malloc(out_sz);
 	*out_size = out_sz;
     }
     if (!out || out_sz > *out_size)
 	return NULL;
 
-    //fprintf(stderr, "out_sz=%d\n", out_sz);
+    uint8_t *sym = tab->sym;
+    int shift, tot;
+    if (reuse) {
+	if (!tab->valid)
+	    goto err;
+	shift = tab->shift;
+	tot = 1<<shift;
+	goto decode;
+    }
+    tab->valid = 0;
 
     // compressed header? If so uncompress it
     unsigned char *tab_end = NULL;
     unsigned char *c_freq = NULL;
     int c_tab = *cp++;
+    shift = c_tab>>4 ? c_tab>>4 : TF_SHIFT_O1;
+    tot = 1<<shift;
+    if (shift < TF_SHIFT_MIN || shift > TF_SHIFT_MAX)
+	goto err;
+    c_tab &= 0xf;
     if (c_tab) {
 	unsigned int c_freq_sz = cp[0] | (cp[1]<<8);
 	cp += 2;
@@ -1803,7 +3167,16 @@ unsigned char *rans_uncompress_O1sfb_4x16(unsigned char *in, unsigned int in_siz
 	if (c_tab > 1)
 	    u_freq_sz |= (*cp++)<<16;
 	tab_end = cp + c_freq_sz;
-	c_freq = rans_uncompress_O0_4x16(cp, c_freq_sz, NULL, &u_freq_sz);
+	if (u_freq_sz > tab->hdr_a) {
+	    uint8_t *hdr = realloc(tab->hdr, u_freq_sz);
+	    if (!hdr)
+		goto err;
+	    tab->hdr = hdr;
+	    tab->hdr_a = u_freq_sz;
+	}
+	c_freq = rans_uncompress_O0_4x16(cp, c_freq_sz, tab->hdr, &u_freq_sz);
+	if (!c_freq)
+	    goto err;
 	cp = c_freq;
     }
 
@@ -1811,219 +3184,815 @@ unsigned char *rans_uncompress_O1sfb_4x16(unsigned char *in, unsigned int in_siz
     int F0[256] = {0};
     cp += decode_freq0(cp, F0);
 
-    //i = *cp++;
+    // Dense alphabet.  Byte 0 is always dense id 0 as the initial context.
+    uint8_t dense[256];
+    int D = 1;
+    sym[0] = dense[0] = 0;
+    for (j = 1; j < 256; j++) {
+	if (F0[j]) {
+	    dense[j] = D;
+	    sym[D++] = j;
+	}
+    }
+
+    if (rans_o1_tables_grow(tab, D, shift) < 0)
+	goto err;
+
+    // Rows built, so the rest can be filled in below
+    uint8_t built[256] = {0};
+    int d, y;
+
     rle_i = 0;
     i = *cp++;
     do {
 	int F[256] = {0}, T;
 	cp += decode_freq_d(cp, F0, F, NULL, NULL, &T);
+	if (T < 1 || T > tot)
+	    goto err;
+	if (T < tot)
+	    normalise_freq(F, T, tot);
+
+	// Contexts absent from the order-0 list have no dense id.
+	if (i > 255 || (i && !F0[i]))
+	    goto err;
+
+	built[dense[i]] = 1;
+	uint32_t *s3 = tab->s3 + (dense[i]<<shift);
+	for (d = x = 0; d < D; d++) {
+	    uint32_t f = F[sym[d]];
+	    if (x + f > tot)
+		goto err;
+	    for (y = 0; y < f; y++)
+		s3[x+y] = ((f-1)<<20) | (y<<8) | d;
+	    x += f;
+	}
+	if (x != tot)
+	    goto err; // the row must be fully initialised
+
+	if (!rle_i && i+1 == *cp) {
+	    i = *cp++;
+	    rle_i = *cp++;
+	} else if (rle_i) {
+	    rle_i--;
+	    i++;
+	} else {
+	    i = *cp++;
+	}
+    } while (i);
+
+    // Valid data never reaches a context without a row, but corrupt data
+    // may.  Those rows decode as dense id 0, so every next context is a
+    // row of the table.
+    for (d = 0; d < D; d++) {
+	if (built[d])
+	    continue;
+	uint32_t *s3 = tab->s3 + (d<<shift);
+	for (y = 0; y < tot; y++)
+	    s3[y] = ((uint32_t)(tot-1)<<20) | (y<<8);
+    }
+
+    if (tab_end)
+	cp = tab_end;
+
+    tab->shift = shift;
+    tab->valid = 1;
+
+ decode:;
+    RansState rans0, rans1, rans2, rans3;
+    uint8_t *ptr = cp;
+    RansDecInit(&rans0, &ptr);
+    RansDecInit(&rans1, &ptr);
+    RansDecInit(&rans2, &ptr);
+    RansDecInit(&rans3, &ptr);
+
+    int isz4 = out_sz>>2;
+    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
+    int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
+
+    RansState R[4];
+    R[0] = rans0;
+    R[1] = rans1;
+    R[2] = rans2;
+    R[3] = rans3;
+
+    uint32_t *s3 = tab->s3;
+    const uint32_t mask = tot-1;
+    for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
+	uint32_t s[4];
+
+	s[0] = s3[(l0<<shift) + (R[0] & mask)];
+	R[0] = ((s[0]>>20)+1) * (R[0]>>shift) + ((s[0]>>8) & 0xfff);
+
+	s[1] = s3[(l1<<shift) + (R[1] & mask)];
+	R[1] = ((s[1]>>20)+1) * (R[1]>>shift) + ((s[1]>>8) & 0xfff);
+
+	s[2] = s3[(l2<<shift) + (R[2] & mask)];
+	R[2] = ((s[2]>>20)+1) * (R[2]>>shift) + ((s[2]>>8) & 0xfff);
+
+	s[3] = s3[(l3<<shift) + (R[3] & mask)];
+	R[3] = ((s[3]>>20)+1) * (R[3]>>shift) + ((s[3]>>8) & 0xfff);
+
+	l0 = s[0] & 0xff;
+	l1 = s[1] & 0xff;
+	l2 = s[2] & 0xff;
+	l3 = s[3] & 0xff;
+
+	out[i4[0]] = sym[l0];
+	out[i4[1]] = sym[l1];
+	out[i4[2]] = sym[l2];
+	out[i4[3]] = sym[l3];
+
+	RansDecRenorm(&R[0], &ptr);
+	RansDecRenorm(&R[1], &ptr);
+	RansDecRenorm(&R[2], &ptr);
+	RansDecRenorm(&R[3], &ptr);
+    }
+
+    // Remainder
+    for (; i4[3] < out_sz; i4[3]++) {
+	uint32_t s = s3[(l3<<shift) + (R[3] & mask)];
+	R[3] = ((s>>20)+1) * (R[3]>>shift) + ((s>>8) & 0xfff);
+	RansDecRenorm(&R[3], &ptr);
+	l3 = s & 0xff;
+	out[i4[3]] = sym[l3];
+    }
+    
+    *out_size = out_sz;
+
+    return out;
+
+ err:
+    free(out_free);
+    return NULL;
+}
+
+unsigned char *rans_uncompress_O1sfb_4x16(unsigned char *in, unsigned int in_size,
+					  unsigned char *out, unsigned int *out_size) {
+    rans_o1_tables tab = {0};
+    out = rans_uncompress_O1_4x16_ws(&tab, in, in_size, out, out_size, 0);
+    rans_o1_tables_free(&tab);
+    return out;
+}
+
+// 7-bit variable sized integers, as used in the pack meta-data.
+static int var_put_u32(uint8_t *cp, uint32_t val) {
+    uint8_t *op = cp;
+    do {
+	*cp++ = (val & 0x7f) | ((val >= 0x80) << 7);
+	val >>= 7;
+    } while (val);
+    return cp - op;
+}
+
+static int var_get_u32(uint8_t *cp, uint8_t *cp_end, uint32_t *val) {
+    uint8_t *op = cp;
+    uint32_t v = 0;
+    int s = 0;
+    uint8_t c;
+    do {
+	if (cp >= cp_end || s > 28)
+	    return -1;
+	c = *cp++;
+	v |= (uint32_t)(c & 0x7f) << s;
+	s += 7;
+    } while (c & 0x80);
+    *val = v;
+    return cp - op;
+}
+
+/*-----------------------------------------------------------------------------
+ * Order-2 codec.
+ *
+ * Symbols are remapped to a dense alphabet of D symbols (byte 0 always
+ * being dense id 0, the initial context) and the context is the previous
+ * symbol plus a reduced form of the one before it:
+ *
+ *     ctx = d1 * K + d2 % K,   K <= MIN(D, O2_MAX_ENT / D^2)
+ *
+ * For small alphabets such as quality values K == D and this is a true
+ * order-2 model; larger alphabets (and small blocks) hash the second
+ * symbol down so there are never more than O2_MAX_ENT context x symbol
+ * entries.  K is stored after the order-0 symbol list.  Only contexts
+ * seen are stored, with frequencies relative to the order-0 symbol list
+ * as per order-1.  Like order-1, the data is split into 4 quarters each
+ * starting in context 0.
+ *
+ * Frequencies are out of TOTFREQ_O2 at most, lower than O1 as the counts
+ * per context are small, which keeps the decoder tables compact: one byte
+ * per slot for the dense symbol, plus freq/cumulative freq per
+ * context/symbol.  As with order-1 the top nibble of the first byte
+ * holds the precision if it differs from the default.
+ */
+static int o2_K(int D) {
+    int K = O2_MAX_ENT / (D*D);
+    return K < D ? K : D;
+}
+
+// The K the encoder picks.  Fewer contexts for small blocks, so the
+// tables don't outweigh the data; roughly O2_KDIV symbols per table entry.
+int rans_o2_K_4x16(int D, unsigned int in_size) {
+    int K = o2_K(D);
+    if (K > in_size / (O2_KDIV*D*D) + 1)
+	K = in_size / (O2_KDIV*D*D) + 1;
+    return K;
+}
+
+typedef struct {
+    uint32_t *cnt;  size_t cnt_a;    // encoder: counts [D*K][D]
+    RansEncSymbol *syms; size_t syms_a; // encoder: [rows][D]
+    uint8_t  *ssym; size_t ssym_a;   // decoder: [rows][1<<shift] dense sym
+    uint32_t *fc;   size_t fc_a;     // decoder: [rows][D] freq<<16 | cfreq
+    uint8_t  *hdr;  size_t hdr_a;    // uncompressed frequency table
+} rans_o2_tables;
+
+static void rans_o2_tables_free(rans_o2_tables *t) {
+    free(t->cnt);
+    free(t->syms);
+    free(t->ssym);
+    free(t->fc);
+    free(t->hdr);
+    memset(t, 0, sizeof(*t));
+}
+
+// Ensures *buf holds at least n elements of size sz.  Returns 0 on success,
+// -1 on failure.
+static int o2_grow(void **buf, size_t *alloc, size_t n, size_t sz) {
+    if (n <= *alloc)
+	return 0;
+
+    void *b = realloc(*buf, n * sz);
+    if (!b)
+	return -1;
+    *buf = b;
+    *alloc = n;
+    return 0;
+}
+#define O2_GROW(t, f, n) o2_grow((void **)&(t)->f, &(t)->f##_a, (n), sizeof(*(t)->f))
+
+// As per rans_enc_O0_4x16, writing to the end of out.  h, if non-NULL,
+// holds the histograms of in.
+static unsigned char *rans_enc_O2_4x16(rans_o2_tables *tab,
+				       unsigned char *in, unsigned int in_size,
+				       unsigned char *out, unsigned int *out_size,
+				       const rans_hist *h) {
+    unsigned char *cp, *out_end;
+    unsigned int tab_size, bound = rans_compress_bound_4x16(in_size,2)-5;
+    int i, j, q, D, K, NC, nrows;
+
+    if (bound > *out_size)
+	return NULL;
+    out_end = out + *out_size;
+
+    // Dense alphabet
+    int F0[256+MAGIC] = {0};
+    uint8_t dense[256];
+    if (h)
+	memcpy(F0, h->F0, 256*sizeof(*F0));
+    else
+	present8(in, in_size, F0);
+    dense[0] = 0;
+    for (D = 1, j = 1; j < 256; j++)
+	if (F0[j])
+	    dense[j] = D++;
+    K = rans_o2_K_4x16(D, in_size);
+    NC = D*K;
+
+    uint16_t cls[256];
+    for (j = 0; j < D; j++)
+	cls[j] = j % K;
+
+    if (O2_GROW(tab, cnt, (size_t)NC*D) < 0)
+	return NULL;
+    uint32_t *cnt = tab->cnt;
+    memset(cnt, 0, (size_t)NC*D*sizeof(*cnt));
+
+    // Histogram, exactly as encoded: 4 quarters each starting in context 0
+    int isz4 = in_size>>2;
+    for (q = 0; q < 4; q++) {
+	int i_end = q < 3 ? (q+1)*isz4 : in_size;
+	int l1 = 0, l2 = 0;
+	for (i = q*isz4; i < i_end; i++) {
+	    int c = dense[in[i]];
+	    cnt[(l1*K + cls[l2])*D + c]++;
+	    l2 = l1;
+	    l1 = c;
+	}
+    }
+
+    // Frequency table: symbol list, number of contexts, and per context
+    // the delta to the previous context id and its frequencies.
+    int32_t row[O2_MAX_CTX];
+    for (nrows = i = 0; i < NC; i++) {
+	uint32_t *c = &cnt[i*D], t = 0;
+	for (j = 0; j < D; j++)
+	    t |= c[j];
+	row[i] = t ? nrows++ : -1;
+    }
+
+    int shift = rans_tf_shift(in_size, nrows, D, TF_SHIFT_O2);
+    int tot = 1<<shift, tf_bits = shift == TF_SHIFT_O2 ? 0 : shift<<4;
+
+    cp = out;
+    *cp++ = tf_bits; // uncompressed header marker, plus precision
+    cp += encode_freq0(cp, F0);
+    *cp++ = K;
+    cp += var_put_u32(cp, nrows);
+
+    if (O2_GROW(tab, syms, (size_t)nrows*D) < 0)
+	return NULL;
+
+    int last = 0;
+    for (i = 0; i < NC; i++) {
+	if (row[i] < 0)
+	    continue;
+
+	cp += var_put_u32(cp, i - last);
+	last = i;
+
+	// Byte indexed for encode_freq_d
+	int F[256+MAGIC] = {0}, T = 0, x;
+	for (j = 0; j < 256; j++) {
+	    if (j && !F0[j])
+		continue;
+	    T += F[j] = cnt[i*D + dense[j]];
+	}
+
+	// As per O1: small totals are stored raw and normalised after
+	if (T > tot)
+	    normalise_freq(F, T, tot);
+	cp += encode_freq_d(cp, F0, F);
+	if (T < tot)
+	    normalise_freq(F, T, tot);
+
+	RansEncSymbol *s = &tab->syms[row[i]*D];
+	for (x = j = 0; j < 256; j++) {
+	    if (!F[j])
+		continue;
+	    RansEncSymbolInit(&s[dense[j]], x, F[j], shift);
+	    x += F[j];
+	}
+    }
+    tab_size = cp - out;
+
+    // Encode, last symbol first
+    RansState R[4];
+    uint8_t *ptr = out_end;
+    RansEncSymbol *syms = tab->syms;
+    for (q = 0; q < 4; q++)
+	RansEncInit(&R[q]);
+
+    // Context of position p in a quarter starting at st.  O2_SYM0 is for
+    // p >= st+2, the vast majority.
+#define O2_SYM(p, st) &syms[row[((p)-1 >= (st) ? dense[in[(p)-1]] : 0)*K + \
+				cls[(p)-2 >= (st) ? dense[in[(p)-2]] : 0]]*D + \
+			    dense[in[p]]]
+#define O2_SYM0(p) &syms[row[dense[in[(p)-1]]*K + cls[dense[in[(p)-2]]]]*D + \
+			 dense[in[p]]]
+
+    // Remainder of the last quarter, then lock-step for all 4 quarters.
+    for (i = in_size-1; i >= 4*isz4; i--)
+	RansEncPutSymbol(&R[3], &ptr, O2_SYM(i, 3*isz4));
+
+    for (j = isz4-1; j >= 2; j--) {
+	RansEncPutSymbol(&R[3], &ptr, O2_SYM0(3*isz4+j));
+	RansEncPutSymbol(&R[2], &ptr, O2_SYM0(2*isz4+j));
+	RansEncPutSymbol(&R[1], &ptr, O2_SYM0(1*isz4+j));
+	RansEncPutSymbol(&R[0], &ptr, O2_SYM0(0*isz4+j));
+    }
+    for (; j >= 0; j--) {
+	RansEncPutSymbol(&R[3], &ptr, O2_SYM(3*isz4+j, 3*isz4));
+	RansEncPutSymbol(&R[2], &ptr, O2_SYM(2*isz4+j, 2*isz4));
+	RansEncPutSymbol(&R[1], &ptr, O2_SYM(1*isz4+j, 1*isz4));
+	RansEncPutSymbol(&R[0], &ptr, O2_SYM(0*isz4+j, 0*isz4));
+    }
+#undef O2_SYM
+#undef O2_SYM0
+
+    for (q = 3; q >= 0; q--)
+	RansEncFlush(&R[q], &ptr);
+
+    if (tab_size > 1000) {
+	// try rans0 compression of header, into the gap between the
+	// table and the rANS data.  Unlike O1, sizes are 7-bit integers.
+	unsigned int c_freq_sz = ptr - (out + tab_size);
+	unsigned int u_freq_sz = tab_size-1;
+	unsigned char *c_freq = rans_enc_O0_4x16(out+1, u_freq_sz, out+tab_size, &c_freq_sz);
+	if (c_freq && c_freq_sz + 11 < tab_size) {
+	    uint8_t hdr[11];
+	    int n = 0;
+	    hdr[n++] = 1 | tf_bits; // compressed
+	    n += var_put_u32(hdr+n, c_freq_sz);
+	    n += var_put_u32(hdr+n, u_freq_sz);
+	    cp = c_freq - n;
+	    memcpy(cp, hdr, n);
+	    *out_size = out_end - cp;
+	    return cp;
+	}
+    }
+
+    *out_size = (out_end - ptr) + tab_size;
+    memmove(ptr - tab_size, out, tab_size);
+
+    return ptr - tab_size;
+}
+
+static unsigned char *rans_uncompress_O2_4x16_ws(rans_o2_tables *tab,
+						 unsigned char *in, unsigned int in_size,
+						 unsigned char *out, unsigned int *out_size) {
+    unsigned char *cp = in, *cp_end = in + in_size, *tab_end = NULL;
+    int i, j, q, n, out_sz = *out_size;
+
+    if (!out || in_size < 1)
+	return NULL;
+
+    // compressed header? If so uncompress it
+    int c_tab = *cp++;
+    int shift = c_tab>>4 ? c_tab>>4 : TF_SHIFT_O2, tot = 1<<shift;
+    if (shift < TF_SHIFT_MIN || shift > TF_SHIFT_MAX)
+	return NULL;
+    if (c_tab & 0xf) {
+	uint32_t c_freq_sz, u_freq_sz;
+	if ((n = var_get_u32(cp, cp_end, &c_freq_sz)) < 0)
+	    return NULL;
+	cp += n;
+	if ((n = var_get_u32(cp, cp_end, &u_freq_sz)) < 0)
+	    return NULL;
+	cp += n;
+	if (c_freq_sz > cp_end - cp)
+	    return NULL;
+	tab_end = cp + c_freq_sz;
+	if (O2_GROW(tab, hdr, u_freq_sz+1) < 0 ||
+	    !rans_uncompress_O0_4x16(cp, c_freq_sz, tab->hdr, &u_freq_sz))
+	    return NULL;
+	cp = tab->hdr;
+	cp_end = cp + u_freq_sz;
+    }
+
+    int F0[256] = {0};
+    cp += decode_freq0(cp, F0);
+
+    uint8_t sym[256], dense[256];
+    int D = 1;
+    sym[0] = dense[0] = 0;
+    for (j = 1; j < 256; j++) {
+	if (F0[j]) {
+	    dense[j] = D;
+	    sym[D++] = j;
+	}
+    }
+    if (cp >= cp_end)
+	return NULL;
+    int K = *cp++, NC = D*K;
+    if (K < 1 || K > o2_K(D))
+	return NULL;
+
+    uint16_t cls[256];
+    for (j = 0; j < D; j++)
+	cls[j] = j % K;
+
+    uint32_t nrows, delta;
+    if ((n = var_get_u32(cp, cp_end, &nrows)) < 0 || nrows < 1 || nrows > NC)
+	return NULL;
+    cp += n;
 
-	if (T < TOTFREQ_O1)
-	    normalise_freq(F, T, TOTFREQ_O1);
+    if (O2_GROW(tab, ssym, (size_t)nrows<<shift) < 0 ||
+	O2_GROW(tab, fc,   (size_t)nrows*D) < 0)
+	return NULL;
 
-	// Build symbols; fixme, do as part of decode, see the _d variant
-	for (j = x = 0; j < 256; j++) {
-	    if (F[j]) {
-		for (y = 0; y < F[j]; y++) {
-		    ssym[i][y + x]   = j;
-		    sfb [i][y + x].f = F[j];
-		    sfb [i][y + x].b = y;
-		}
-		x += F[j];
-	    }
-	}
+    // Unseen contexts can't occur in valid data; map them to row 0.
+    uint32_t row[O2_MAX_CTX] = {0};
+    int ctx = 0;
+    for (i = 0; i < nrows; i++) {
+	if ((n = var_get_u32(cp, cp_end, &delta)) < 0)
+	    return NULL;
+	cp += n;
+	ctx += delta;
+	if (ctx >= NC)
+	    return NULL;
+	row[ctx] = i;
 
-	if (!rle_i && i+1 == *cp) {
-	    i = *cp++;
-	    rle_i = *cp++;
-	} else if (rle_i) {
-	    rle_i--;
-	    i++;
-	} else {
-	    i = *cp++;
+	int F[256] = {0}, T, x, d;
+	cp += decode_freq_d(cp, F0, F, NULL, NULL, &T);
+	if (T < 1 || T > tot)
+	    return NULL;
+	if (T < tot)
+	    normalise_freq(F, T, tot);
+
+	uint8_t  *s  = &tab->ssym[(size_t)i<<shift];
+	uint32_t *fc = &tab->fc[(size_t)i*D];
+	for (x = d = 0; d < D; d++) {
+	    int f = F[sym[d]];
+	    fc[d] = (f<<16) | x;
+	    memset(s+x, d, f);
+	    x += f;
 	}
-    } while (i);
+    }
 
     if (tab_end)
 	cp = tab_end;
-    if (c_freq)
-	free(c_freq);
 
-    RansState rans0, rans1, rans2, rans3;
+    RansState R[4];
     uint8_t *ptr = cp;
-    RansDecInit(&rans0, &ptr);
-    RansDecInit(&rans1, &ptr);
-    RansDecInit(&rans2, &ptr);
-    RansDecInit(&rans3, &ptr);
+    for (q = 0; q < 4; q++)
+	RansDecInit(&R[q], &ptr);
 
+    uint8_t  *ssym = tab->ssym;
+    uint32_t *fc   = tab->fc;
+    const uint32_t mask = tot-1;
     int isz4 = out_sz>>2;
-    int l0 = 0, l1 = 0, l2 = 0, l3 = 0;
-    int i4[] = {0*isz4, 1*isz4, 2*isz4, 3*isz4};
-
-    RansState R[4];
-    R[0] = rans0;
-    R[1] = rans1;
-    R[2] = rans2;
-    R[3] = rans3;
-
-    const uint32_t mask = ((1u << TF_SHIFT_O1)-1);
-    for (; i4[0] < isz4; i4[0]++, i4[1]++, i4[2]++, i4[3]++) {
-	uint32_t m[4];
-	uint32_t c[4];
-
-	m[0] = R[0] & mask;
-	R[0] = sfb[l0][m[0]].f * (R[0]>>TF_SHIFT_O1) + sfb[l0][m[0]].b;
-	c[0] = ssym[l0][m[0]];
-
-	m[1] = R[1] & mask;
-	R[1] = sfb[l1][m[1]].f * (R[1]>>TF_SHIFT_O1) + sfb[l1][m[1]].b;
-	c[1] = ssym[l1][m[1]];
-
-	m[2] = R[2] & mask;
-	R[2] = sfb[l2][m[2]].f * (R[2]>>TF_SHIFT_O1) + sfb[l2][m[2]].b;
-	c[2] = ssym[l2][m[2]];
+    int l1[4] = {0}, l2[4] = {0};
+
+#define O2_DEC(q, i) do {						\
+	uint32_t r = row[l1[q]*K + cls[l2[q]]];				\
+	uint32_t m = R[q] & mask;					\
+	uint32_t d = ssym[(r<<shift) + m];				\
+	uint32_t f = fc[r*D + d];					\
+	R[q] = (f>>16) * (R[q]>>shift) + m - (f & 0xffff);		\
+	RansDecRenorm(&R[q], &ptr);					\
+	out[i] = sym[d];						\
+	l2[q] = l1[q];							\
+	l1[q] = d;							\
+    } while (0)
+
+    for (i = 0; i < isz4; i++) {
+	O2_DEC(0, i);
+	O2_DEC(1, i+isz4);
+	O2_DEC(2, i+2*isz4);
+	O2_DEC(3, i+3*isz4);
+    }
+    for (i = 4*isz4; i < out_sz; i++)
+	O2_DEC(3, i);
+#undef O2_DEC
 
-	m[3] = R[3] & mask;
-	R[3] = sfb[l3][m[3]].f * (R[3]>>TF_SHIFT_O1) + sfb[l3][m[3]].b;
-	c[3] = ssym[l3][m[3]];
+    *out_size = out_sz;
+    return out;
+}
 
-	// TODO: inline expansion of 4-way packing here is about 4% faster.
-	out[i4[0]] = c[0];
-	out[i4[1]] = c[1];
-	out[i4[2]] = c[2];
-	out[i4[3]] = c[3];
+/*-----------------------------------------------------------------------------
+ * Reusable workspace.
+ *
+ * Holds the scratch buffers needed by the RLE and bit-packing transforms
+ * and the order-1 decoder tables.  These are grown on demand and kept, so
+ * once warmed up the _ctx functions below do no heap allocation at all.
+ * A context may be used by one thread at a time.
+ *
+ * Order-1 blocks compressed with X_TAB may reuse the frequency table of
+ * the previous order-1 block compressed with the same context.  Such
+ * streams must be decoded in order using a single context.
+ */
+struct rans_ctx {
+    uint8_t *packed;  size_t packed_a; // pack() output; decoder tmp buffer
+    uint8_t *rle;     size_t rle_a;    // rle_encode literals
+    uint8_t *meta;    size_t meta_a;   // rle_encode run lengths
+    rans_o1_tables o1;                 // order-1 decoder tables
+    rans_o2_tables o2;                 // order-2 encoder and decoder tables
+    rans_o1_enc_tab *o1_prev, *o1_next; // X_TAB encoder tables
+    rans_hist hist;                    // next input's histograms, if set
+};
+
+rans_ctx *rans_ctx_create(void) {
+    return calloc(1, sizeof(rans_ctx));
+}
 
-	RansDecRenorm(&R[0], &ptr);
-	RansDecRenorm(&R[1], &ptr);
-	RansDecRenorm(&R[2], &ptr);
-	RansDecRenorm(&R[3], &ptr);
+void rans_ctx_destroy(rans_ctx *ctx) {
+    if (!ctx)
+	return;
+    free(ctx->packed);
+    free(ctx->rle);
+    free(ctx->meta);
+    rans_o1_tables_free(&ctx->o1);
+    rans_o2_tables_free(&ctx->o2);
+    free(ctx->o1_prev);
+    free(ctx->o1_next);
+    free(ctx);
+}
 
-	l0 = c[0];
-	l1 = c[1];
-	l2 = c[2];
-	l3 = c[3];
-    }
+void rans_ctx_set_hist(rans_ctx *ctx, int *F0, int (*F1)[256], int *T1) {
+    ctx->hist.F0 = F0;
+    ctx->hist.F1 = F1;
+    ctx->hist.T1 = T1;
+}
 
-    // Remainder
-    for (; i4[3] < out_sz; i4[3]++) {
-	uint32_t m3 = R[3] & ((1u<<TF_SHIFT_O1)-1);
-	unsigned char c3 = ssym[l3][m3];
-	out[i4[3]] = c3;
-	R[3] = sfb[l3][m3].f * (R[3]>>TF_SHIFT_O1) + sfb[l3][m3].b;
-	RansDecRenorm(&R[3], &ptr);
-	l3 = c3;
-    }
-    
-    *out_size = out_sz;
+// Ensures *buf is at least sz bytes.  Returns 0 on success, -1 on failure.
+static int rans_ctx_grow(uint8_t **buf, size_t *alloc, size_t sz) {
+    if (sz <= *alloc)
+	return 0;
 
-    return out;
+    uint8_t *b = realloc(*buf, sz);
+    if (!b)
+	return -1;
+    *buf = b;
+    *alloc = sz;
+    return 0;
 }
 
 /*-----------------------------------------------------------------------------
  * Simple interface to the order-0 vs order-1 encoders and decoders.
+ *
+ * Format is the order byte, then if packing or RLE is used the 4 byte
+ * uncompressed size, the pack meta-data and the RLE meta-data (in that
+ * order), followed by the rANS compressed data.
+ *
+ * RLE meta-data is 7-bit variable sized integers holding the run-length
+ * array size, the literal array size and the compressed run-length size,
+ * followed by the order-0 compressed run-lengths.
  */
-unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
-				     unsigned char *out, unsigned int *out_size,
-				     int order) {
-    unsigned int c_meta_len;
-    uint8_t *meta = NULL, *rle = NULL, *packed = NULL;
+
+/*
+ * Compresses in to out using the scratch buffers in ctx.  *out_size is
+ * the size of out on input, which should be rans_compress_bound_4x16()
+ * bytes, and the compressed size on output.  Out must not be NULL.
+ *
+ * The encoded block is assembled backwards from the end of out, so the
+ * returned pointer is the start of the compressed data and is not
+ * necessarily out itself.  Returns NULL on failure.
+ */
+unsigned char *rans_compress_to_4x16_ctx(rans_ctx *ctx,
+					 unsigned char *in,  unsigned int in_size,
+					 unsigned char *out, unsigned int *out_size,
+					 int order) {
+    uint8_t *in_orig = in, *cp;
+    unsigned int in_size_orig = in_size, out_cap, sz;
+    uint8_t pmeta[256+16], rmeta_hdr[16];
+    int pmeta_len = 0, rmeta_hdr_len = 0, rmeta_len = 0;
+    int64_t packed_len = 0, rle_len = 0;
 
     int do_pack = order & X_PACK;
     int do_rle  = order & X_RLE;
+    int do_32   = order & X_32;
+    int do_tab  = order & X_TAB, reused = 0;
 
-    if (!out) {
-	*out_size = rans_compress_bound_4x16(in_size, order); //fixme, +pack, +rle
-	out = malloc(*out_size);
-    }
+    // Histograms are only for this call, and only for untransformed data
+    rans_hist hist = ctx->hist, *h = NULL;
+    memset(&ctx->hist, 0, sizeof(ctx->hist));
 
-    out[0] = order;
-    c_meta_len = 1;
+    if (!out)
+	return NULL;
+    out_cap = *out_size;
+
+    if (in_size < RANS_MIN_SIZE)
+	goto cat;
+
+    order &= 0x3;
+    if (order == 3)
+	order = 2;
 
-    if (do_pack || do_rle) {
-	*(uint32_t *)(&out[1]) = in_size;
-	c_meta_len += 4;
-//	if (in_size < 32768) {
-//	    out[1] = in_size>>8;
-//	    out[2] = in_size;
-//	    c_meta_len += 2;
-//	} else {
-//	    out[1] = (in_size>>24) | 0x80;
-//	    out[2] = in_size>>16;
-//	    out[3] = in_size>>8;
-//	    out[4] = in_size;
-//	    c_meta_len += 4;
-//	}
-    }
-
-    order &= 0xf;
-
-    // Format is compressed meta-data, compressed data.
-    // Meta-data can be empty, pack, rle lengths, or pack + rle lengths.
     // Data is either the original data, bit-packed packed, rle literals or
     // packed + rle literals.
 
     if (do_pack) {
 	// PACK 2, 4 or 8 symbols into one byte.
-	int pmeta_len;
-	uint64_t packed_len;
-	packed = pack(in, in_size, out+c_meta_len, &pmeta_len, &packed_len);
-	if (pmeta_len == 1 && out[c_meta_len] == 1) {
-	    out[0] &= ~X_PACK;
+	if (rans_ctx_grow(&ctx->packed, &ctx->packed_a, in_size) < 0)
+	    return NULL;
+	uint8_t *packed = pack(in, in_size, ctx->packed, pmeta, &pmeta_len,
+			       &packed_len);
+	if (pmeta_len == 1 && pmeta[0] == 1) {
 	    do_pack = 0;
-	    if (!do_rle)
-		c_meta_len -= 4;
-	    free(packed);
-	    packed = NULL;
 	} else {
 	    in = packed;
 	    in_size = packed_len;
-	    c_meta_len += pmeta_len;
 	}
     }
 
     if (do_rle) {
 	// RLE 'in' -> rle_length + rle_literals arrays
-	unsigned int rmeta_len, c_rmeta_len;
-	uint64_t rle_len;
-	c_rmeta_len = in_size;
-	if (!(meta = malloc(c_rmeta_len)))
+	if (rans_ctx_grow(&ctx->rle,  &ctx->rle_a,  in_size+257) < 0 ||
+	    rans_ctx_grow(&ctx->meta, &ctx->meta_a, in_size) < 0)
 	    return NULL;
 
-	rle = rle_encode(in, in_size, meta, &rmeta_len, &rle_len);
+	rle_encode(in, in_size, ctx->rle, ctx->meta, &rmeta_len, &rle_len);
 	if (rle_len + rmeta_len >= .99*in_size) {
 	    // Not worth the speed hit.
-	    out[0] &= ~X_RLE;
 	    do_rle = 0;
-	    if (!do_pack)
-		c_meta_len -= 4;
-	    free(rle);
-	    rle = NULL;
 	} else {
-	    // Compress lengths with O0 and literals with O0/O1 ("order" param)
-	    rans_compress_O0_4x16(meta, rmeta_len, out+c_meta_len+4, &c_rmeta_len);
-	    *(uint32_t *)(out+c_meta_len) = c_rmeta_len;
-	    c_meta_len += 4 + c_rmeta_len;
-
-	    in = rle;
+	    in = ctx->rle;
 	    in_size = rle_len;
 	}
+    }
+
+    if (order == 2 && in_size < RANS_O2_MIN_SIZE)
+	order = 1;
+    if (order == 1 && in_size < RANS_O1_MIN_SIZE)
+	order = 0;
+    if (order)
+	do_32 = 0;
+    if (in == in_orig && hist.F0 && (order == 0 || (hist.F1 && hist.T1)))
+	h = &hist;
 
-	free(meta);
+    // Entropy encode the data (literals) to the end of out
+    sz = out_cap;
+    if (in_size == 0)
+	cp = out + out_cap, sz = 0;
+    else if (order == 2)
+	cp = rans_enc_O2_4x16(&ctx->o2, in, in_size, out, &sz, h);
+    else if (order && do_tab) {
+	if (!ctx->o1_prev)
+	    ctx->o1_prev = calloc(1, sizeof(*ctx->o1_prev));
+	if (!ctx->o1_next)
+	    ctx->o1_next = malloc(sizeof(*ctx->o1_next));
+	if (!ctx->o1_prev || !ctx->o1_next)
+	    return NULL;
+	cp = rans_enc_O1_4x16(in, in_size, out, &sz, h,
+			      ctx->o1_prev, ctx->o1_next, &reused);
+    } else if (order)
+	cp = rans_enc_O1_4x16(in, in_size, out, &sz, h, NULL, NULL, NULL);
+    else if (do_32)
+	cp = rans_enc_O0_32x16(in, in_size, out, &sz);
+    else if (do_tab)
+	cp = rans_enc_O0_4x16_model(in, in_size, out, &sz, h, &reused);
+    else if (h) {
+	int F[256+MAGIC] = {0};
+	memcpy(F, h->F0, 256*sizeof(*F));
+	cp = rans_enc_O0_4x16_F(in, in_size, out, &sz, F);
+    } else
+	cp = rans_enc_O0_4x16(in, in_size, out, &sz);
+    if (!cp)
+	goto cat;
+
+    // Prepend the meta-data, last first.
+    if (do_rle) {
+	// Compress run lengths with O0 into the space before the literals
+	unsigned int c_rmeta_len = cp - out;
+	uint8_t *c_rmeta = rmeta_len
+	    ? rans_enc_O0_4x16(ctx->meta, rmeta_len, out, &c_rmeta_len)
+	    : (c_rmeta_len = 0, cp);
+	if (!c_rmeta)
+	    goto cat;
+	cp = c_rmeta;
+
+	rmeta_hdr_len += var_put_u32(rmeta_hdr+rmeta_hdr_len, rmeta_len);
+	rmeta_hdr_len += var_put_u32(rmeta_hdr+rmeta_hdr_len, rle_len);
+	rmeta_hdr_len += var_put_u32(rmeta_hdr+rmeta_hdr_len, c_rmeta_len);
     }
 
-    *out_size -= c_meta_len;
-    if (order && in_size < 8) {
-	out[0] &= ~1;
-	order  &= ~1;
+    if (cp - out < 1 + 4 + pmeta_len + rmeta_hdr_len)
+	goto cat;
+
+    cp -= rmeta_hdr_len;
+    memcpy(cp, rmeta_hdr, rmeta_hdr_len);
+
+    if (do_pack) {
+	cp -= pmeta_len;
+	memcpy(cp, pmeta, pmeta_len);
+    }
+
+    if (do_pack || do_rle) {
+	cp -= 4;
+	*(uint32_t *)cp = in_size_orig;
+    }
+
+    *--cp = order | (do_pack ? X_PACK : 0) | (do_rle ? X_RLE : 0)
+	| (do_32 ? X_32 : 0) | (reused ? X_TAB : 0);
+
+    *out_size = out + out_cap - cp;
+    if (*out_size <= in_size_orig) {
+	// The decoder now holds this block's order-1 table, so track it.
+	if (order == 1 && in_size && !reused && ctx->o1_prev) {
+	    if (do_tab) {
+		rans_o1_enc_tab *t = ctx->o1_prev;
+		ctx->o1_prev = ctx->o1_next;
+		ctx->o1_next = t;
+	    } else {
+		ctx->o1_prev->valid = 0;
+	    }
+	}
+	return cp;
+    }
+
+ cat:
+    // Incompressible or too small; store it raw.
+    if (out_cap < in_size_orig+1)
+	return NULL;
+    out[0] = X_CAT;
+    memcpy(out+1, in_orig, in_size_orig);
+    *out_size = in_size_orig+1;
+    return out;
+}
+
+unsigned char *rans_compress_to_4x16(unsigned char *in,  unsigned int in_size,
+				     unsigned char *out, unsigned int *out_size,
+				     int order) {
+    rans_ctx *ctx = rans_ctx_create();
+    unsigned char *cp, *out_free = NULL;
+
+    if (!ctx)
+	return NULL;
+
+    if (!out) {
+	*out_size = rans_compress_bound_4x16(in_size, order);
+	out = out_free = malloc(*out_size);
     }
-    if (order)
-	rans_compress_O1_4x16(in, in_size, out+c_meta_len, out_size);
-    else
-	rans_compress_O0_4x16(in, in_size, out+c_meta_len, out_size);
-    free(rle);
-    free(packed);
 
-    *out_size += c_meta_len;
+    cp = out ? rans_compress_to_4x16_ctx(ctx, in, in_size, out, out_size, order)
+	     : NULL;
+    rans_ctx_destroy(ctx);
+    if (!cp) {
+	free(out_free);
+	return NULL;
+    }
+
+    if (cp != out)
+	memmove(out, cp, *out_size);
     return out;
 }
 
@@ -2032,146 +4001,202 @@ unsigned char *rans_compress_4x16(unsigned char *in, unsigned int in_size,
     return rans_compress_to_4x16(in, in_size, NULL, out_size, order);
 }
 
-unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
-				       unsigned char *out, unsigned int *out_size) {
+/*
+ * Uncompresses in to out using the scratch buffers in ctx.  in_size must
+ * be the exact compressed size.  *out_size is the size of out on input
+ * and the uncompressed size on output.
+ *
+ * Blocks using neither packing nor RLE do not store their uncompressed
+ * size, so for these *out_size must be the exact size on input.  If out
+ * is NULL it is allocated, which needs this size too.
+ */
+unsigned char *rans_uncompress_to_4x16_ctx(rans_ctx *ctx,
+					   unsigned char *in,  unsigned int in_size,
+					   unsigned char *out, unsigned int *out_size) {
+    uint8_t *in_end = in + in_size;
+    int n;
+
+    if (in_size < 1)
+	return NULL;
+
     int order = *in++;  in_size--;
 
+    if (order & X_CAT) {
+	if (!out) {
+	    *out_size = in_size;
+	    out = malloc(in_size);
+	}
+	if (!out || *out_size < in_size)
+	    return NULL;
+	memcpy(out, in, in_size);
+	*out_size = in_size;
+	return out;
+    }
+
     int do_pack = order & X_PACK;
     int do_rle  = order & X_RLE;
-    order &= 0xf;
+    int do_32   = order & X_32;
+    int do_tab  = order & X_TAB;
+    order &= 0x3;
+    if (do_tab && (order > 1 || do_32))
+	return NULL;
 
-//    if (in[0] && 0x80) {
-//	*out_size = ((in[0]&0x7f)<<24) | ((in[1])<<16) | ((in[2])<<8) | ((in[3])<<0);
-//    } else {
-//	*out_size = (in[0]<<8) | in[1];
-//    }
+    unsigned int u_size = *out_size;
+    if (do_pack || do_rle) {
+	if (in_size < 4)
+	    return NULL;
+	u_size = *(uint32_t *)in;
+	in += 4; // size field not needed when pure rANS
+	if (out && u_size > *out_size)
+	    return NULL;
+    }
 
-    if (!out) {
-	// FIXME: check
-	*out_size = ((in[0])<<0) | ((in[1])<<8) | ((in[2])<<16) | ((in[3])<<24);
-	out = malloc(*out_size);
+    // Decode the bit-packing map.
+    uint8_t map[16] = {0};
+    int npacked_sym = 0;
+    uint64_t unpacked_sz, packed_sz = u_size;
+    if (do_pack) {
+	in += unpack_meta(in, u_size, map, &npacked_sym, &unpacked_sz);
+	if (unpacked_sz != u_size)
+	    return NULL;
+	switch (npacked_sym) {
+	case 0:  packed_sz = 0; break;
+	case 1:  packed_sz = u_size; break;
+	case 2:  packed_sz = (u_size+1)/2; break;
+	case 4:  packed_sz = (u_size+3)/4; break;
+	case 8:  packed_sz = (u_size+7)/8; break;
+	default: return NULL;
+	}
     }
 
-    if (do_pack || do_rle)
-	in += 4; // size field not needed when pure rANS
+    // Decode the run-lengths.
+    uint32_t rmeta_len = 0, rle_len = 0, c_rmeta_len = 0;
+    if (do_rle) {
+	if ((n = var_get_u32(in, in_end, &rmeta_len)) < 0) return NULL;
+	in += n;
+	if ((n = var_get_u32(in, in_end, &rle_len)) < 0) return NULL;
+	in += n;
+	if ((n = var_get_u32(in, in_end, &c_rmeta_len)) < 0) return NULL;
+	in += n;
+	if (c_rmeta_len > in_end - in ||
+	    rans_ctx_grow(&ctx->meta, &ctx->meta_a, rmeta_len+1) < 0)
+	    return NULL;
+	unsigned int sz = rmeta_len;
+	if (rmeta_len &&
+	    !rans_uncompress_O0_4x16(in, c_rmeta_len, ctx->meta, &sz))
+	    return NULL;
+	in += c_rmeta_len;
+    }
+    in_size = in_end - in;
 
-    uint32_t c_meta_size = 0;
-    unsigned int tmp1_size = *out_size;
-    unsigned int tmp2_size = *out_size;
-    unsigned int tmp3_size = *out_size;
-    unsigned char *tmp1, *tmp2, *tmp3, *tmp = NULL;
+    if (!out) {
+	*out_size = u_size;
+	if (!(out = malloc(u_size)))
+	    return NULL;
+    }
 
     // Need In, Out and Tmp buffers with temporary buffer of the same size
     // as output.  All use rANS, but with optional transforms (none, RLE,
-    // Pack, or both).
+    // Pack, or both).  RLE and unpacking are a single combined pass.
     //
     //                    rans   unrle  unpack
     // If none:     in -> out
     // If RLE:      in -> tmp -> out
     // If Pack:     in -> tmp        -> out
-    // If RLE+Pack: in -> out -> tmp -> out
+    // If RLE+Pack: in -> tmp -------------> out
     //                    tmp1   tmp2   tmp3
     //
     // So rans is in   -> tmp1
     // RLE     is tmp1 -> tmp2
     // Unpack  is tmp2 -> tmp3
-
-    // Format is meta data (Pack and RLE in that order if present),
-    // followed by rANS compressed data.
+    unsigned char *tmp1, *tmp2, *tmp3, *tmp = NULL;
+    unsigned int tmp1_size = do_rle ? rle_len : packed_sz;
 
     if (do_pack || do_rle) {
-	tmp = malloc(*out_size); // FIXME: check
-
-	if (do_pack && do_rle) {
-	    tmp1 = out;
-	    tmp2 = tmp;
-	    tmp3 = out;
-	    // If we use rle_decode_unpack as a single step
-	    //tmp1 = tmp2 = tmp;
-	    //tmp3 = out;
-	} else if (do_pack) {
-	    tmp1 = tmp;
-	    tmp2 = tmp1;
-	    tmp3 = out;
-	} else if (do_rle) {
-	    tmp1 = tmp;
-	    tmp2 = out;
-	    tmp3 = out;
-	}
+	if (tmp1_size > u_size ||
+	    rans_ctx_grow(&ctx->packed, &ctx->packed_a, tmp1_size) < 0)
+	    return NULL;
+	tmp = ctx->packed;
+    }
+
+    if (do_pack && do_rle) {
+	tmp1 = tmp;
+	tmp2 = NULL;
+	tmp3 = out;
+    } else if (do_pack) {
+	tmp1 = tmp;
+	tmp2 = tmp1;
+	tmp3 = out;
+    } else if (do_rle) {
+	tmp1 = tmp;
+	tmp2 = out;
+	tmp3 = out;
     } else {
-	// neither
-	tmp  = NULL;
 	tmp1 = out;
 	tmp2 = out;
 	tmp3 = out;
     }
 
-    
-    // Decode the bit-packing map.
-    uint8_t map[16];
-    int npacked_sym;
-    uint64_t unpacked_sz;
-    if (do_pack) {
-	// FIXME: may need original size somewhere?
-	c_meta_size = unpack_meta(in, *out_size, map, &npacked_sym, &unpacked_sz);
-	in      += c_meta_size;
-	in_size -= c_meta_size;
+    // uncompress RLE data.  in -> tmp1
+    if (tmp1_size) {
+	unsigned int sz = tmp1_size;
+	uint8_t *r = order == 2
+	    ? rans_uncompress_O2_4x16_ws(&ctx->o2, in, in_size, tmp1, &sz)
+	    : order
+	    ? rans_uncompress_O1_4x16_ws(&ctx->o1, in, in_size, tmp1, &sz,
+					 do_tab)
+	    : do_tab
+	    ? rans_uncompress_O0_4x16_model(in, in_size, tmp1, &sz)
+	    : (do_32
+	       ? rans_uncompress_O0_32x16(in, in_size, tmp1, &sz)
+	       : rans_uncompress_O0_4x16(in, in_size, tmp1, &sz));
+	if (!r)
+	    return NULL;
     }
 
-    uint8_t *meta = NULL;
-    if (do_rle) {
-	// Uncompress meta data
-	c_meta_size = *(uint32_t *)in;
-	uint32_t meta_size;
-	meta = rans_uncompress_O0_4x16(in+4, in_size-4, NULL, &meta_size);
-	in      += c_meta_size+4;
-	in_size -= c_meta_size+4;
-    }
-   
-    // uncompress RLE data.  in -> tmp1
-    tmp1 = order
-	? rans_uncompress_O1sfb_4x16(in, in_size, tmp1, &tmp1_size)
-	: rans_uncompress_O0_4x16(in, in_size, tmp1, &tmp1_size);
-    tmp2_size = tmp3_size = tmp1_size;
-
-//    if (do_rle && do_pack) {
-//	// Unrle and unpack in one step
-//	if (!rle_decode_unpack(tmp1, tmp1_size, meta, npacked_sym, map, tmp3, unpacked_sz))
-//	    return NULL;
-//	tmp3_size = unpacked_sz;
-//    } else {
-    if (do_rle) {
+    if (do_rle && do_pack) {
+	// Unpack RLE and bits in one pass.  tmp1 -> tmp3
+	if (npacked_sym == 0) {
+	    // One symbol; no RLE data as nothing was packed
+	    memset(tmp3, map[0], u_size);
+	} else if (!rle_decode_unpack(tmp1, tmp1_size, ctx->meta, rmeta_len,
+				      npacked_sym, map, tmp3, u_size)) {
+	    return NULL;
+	}
+    } else if (do_rle) {
 	// Unpack RLE.  tmp1 -> tmp2.
-	uint64_t unrle_size;
-	if (!rle_decode(tmp1, tmp1_size, meta, tmp2, &unrle_size))
+	int64_t unrle_size = packed_sz;
+	if (!rle_decode(tmp1, tmp1_size, ctx->meta, rmeta_len,
+			tmp2, &unrle_size))
 	    return NULL;
-	tmp3_size = tmp2_size = unrle_size;
-	free(meta);
-    }
-    if (do_pack) {
+	if (unrle_size != packed_sz)
+	    return NULL;
+    } else if (do_pack) {
 	// Unpack bits via pack-map.  tmp2 -> tmp3
-	if (npacked_sym == 1)
-	    unpacked_sz = tmp2_size;
-	//uint8_t *porig = unpack(tmp2, tmp2_size, unpacked_sz, npacked_sym, map);
-	//memcpy(tmp3, porig, unpacked_sz);
-	if (!unpack(tmp2, tmp2_size, tmp3, unpacked_sz, npacked_sym, map))
+	if (!unpack(tmp2, packed_sz, tmp3, u_size, npacked_sym, map))
 	    return NULL;
-	tmp3_size = unpacked_sz;
     }
 
-    if (tmp)
-	free(tmp);
-
-    *out_size = tmp3_size;
+    *out_size = u_size;
     return tmp3;
 }
 
+unsigned char *rans_uncompress_to_4x16(unsigned char *in,  unsigned int in_size,
+				       unsigned char *out, unsigned int *out_size) {
+    rans_ctx *ctx = rans_ctx_create();
+    if (!ctx)
+	return NULL;
+
+    out = rans_uncompress_to_4x16_ctx(ctx, in, in_size, out, out_size);
+    rans_ctx_destroy(ctx);
+    return out;
+}
+
 unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
 				    unsigned int *out_size) {
     return rans_uncompress_to_4x16(in, in_size, NULL, out_size);
 }
 
-
 #ifdef TEST_MAIN
 
 #ifndef BLK_SIZE
@@ -2181,13 +4206,229 @@ unsigned char *rans_uncompress_4x16(unsigned char *in, unsigned int in_size,
 // Room to allow for expanded BLK_SIZE on worst case compression.
 #define BLK_SIZE2 ((105LL*BLK_SIZE)/100)
 
+#include <pthread.h>
+
+/*-----------------------------------------------------------------------------
+ * Block-parallel file compression.
+ *
+ * The container is a series of blocks, each being a 4-byte compressed
+ * size, a 4-byte uncompressed size and the compressed data.  (Pure rANS
+ * blocks don't record their own size, so the container has to.)
+ *
+ * The main thread reads blocks into a ring of NSLOTS(nthreads) slots and
+ * writes them back out in order once done; worker threads process the
+ * slots in sequence order, each with its own rans_ctx.  Reading stalls
+ * when the ring is full, so memory is bounded to a few blocks per thread
+ * no matter how large the file.
+ *
+ * Order-1 blocks coded with X_TAB reuse the previous block's table, so
+ * such a stream has to be decoded in order by a single context.  The
+ * encoder marks every block of it with BLK_SEQ in the uncompressed size,
+ * and the decoder runs one worker if the first block has it.
+ */
+#define NSLOTS(n) ((n)*2+1)
+#define BLK_SEQ (1u<<31)
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_DONE };
+
+typedef struct {
+    unsigned char *in, *out;
+    uint32_t in_sz, out_sz;
+    int state, err, seq;
+} blk_slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work, done;
+    blk_slot *slot;
+    int nslots;
+    uint64_t next_read;  // sequence number of next block read
+    uint64_t next_job;   // sequence number of next block to process
+    int shutdown;
+    int decode, order;
+} blk_pool;
+
+static void *blk_worker(void *arg) {
+    blk_pool *p = (blk_pool *)arg;
+    rans_ctx *ctx = rans_ctx_create();
+
+    for (;;) {
+	pthread_mutex_lock(&p->lock);
+	while (!p->shutdown && p->next_job == p->next_read)
+	    pthread_cond_wait(&p->work, &p->lock);
+	if (p->next_job == p->next_read) {
+	    pthread_mutex_unlock(&p->lock);
+	    break;
+	}
+	blk_slot *b = &p->slot[p->next_job++ % p->nslots];
+	pthread_mutex_unlock(&p->lock);
+
+	unsigned int sz = p->decode ? b->out_sz : rans_compress_bound_4x16(BLK_SIZE, p->order);
+	unsigned char *r = !ctx ? NULL : p->decode
+	    ? rans_uncompress_to_4x16_ctx(ctx, b->in, b->in_sz, b->out, &sz)
+	    : rans_compress_to_4x16_ctx(ctx, b->in, b->in_sz, b->out, &sz, p->order);
+	if (r && r != b->out)
+	    memmove(b->out, r, sz);
+
+	pthread_mutex_lock(&p->lock);
+	b->err = !r || (p->decode && sz != b->out_sz);
+	b->out_sz = sz;
+	b->state = SLOT_DONE;
+	pthread_cond_broadcast(&p->done);
+	pthread_mutex_unlock(&p->lock);
+    }
+
+    rans_ctx_destroy(ctx);
+    return NULL;
+}
+
+// Reads the next block into b.  Returns 1 on success, 0 on EOF and -1 on
+// error.
+static int blk_read(FILE *fp, blk_slot *b, int decode) {
+    if (!decode) {
+	b->in_sz = fread(b->in, 1, BLK_SIZE, fp);
+	return b->in_sz > 0;
+    }
+
+    uint32_t sz[2];
+    size_t n = fread(sz, 1, 8, fp);
+    if (n == 0)
+	return 0;
+    if (n != 8 || sz[0] > rans_compress_bound_4x16(BLK_SIZE, 0xff) ||
+	(sz[1] & ~BLK_SEQ) > BLK_SIZE || fread(b->in, 1, sz[0], fp) != sz[0]) {
+	fprintf(stderr, "Truncated or corrupt input\n");
+	return -1;
+    }
+    b->in_sz  = sz[0];
+    b->out_sz = sz[1] & ~BLK_SEQ;
+    b->seq    = (sz[1] & BLK_SEQ) != 0;
+    return 1;
+}
+
+// Returns number of uncompressed bytes processed, or -1 on error.
+static int64_t blk_process(FILE *infp, FILE *outfp, int decode, int order,
+			   int nthreads) {
+    blk_pool p;
+    pthread_t *tid = calloc(nthreads, sizeof(*tid));
+    unsigned int bound = rans_compress_bound_4x16(BLK_SIZE, 0xff);
+    uint64_t next_write = 0;
+    int64_t bytes = 0;
+    int i, nt = 0, eof = 0, err = 0;
+    int seq = (order & X_TAB) && (order & 3) == 1;
+
+    memset(&p, 0, sizeof(p));
+    p.decode = decode;
+    p.order  = order;
+    p.nslots = NSLOTS(nthreads);
+    p.slot   = calloc(p.nslots, sizeof(*p.slot));
+    if (!tid || !p.slot)
+	return -1;
+    for (i = 0; i < p.nslots; i++) {
+	p.slot[i].in  = malloc(decode ? bound : BLK_SIZE);
+	p.slot[i].out = malloc(decode ? BLK_SIZE : bound);
+	if (!p.slot[i].in || !p.slot[i].out)
+	    return -1;
+    }
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.work, NULL);
+    pthread_cond_init(&p.done, NULL);
+
+    while (!err) {
+	// Fill the ring.  The slots we read into are free, so no lock needed
+	// until we queue them.
+	while (!eof && p.next_read - next_write < p.nslots) {
+	    blk_slot *b = &p.slot[p.next_read % p.nslots];
+	    int r = blk_read(infp, b, decode);
+	    if (r <= 0) {
+		eof = 1;
+		err |= r < 0;
+		break;
+	    }
+	    if (decode && p.next_read == 0 && b->seq)
+		nthreads = 1;
+	    if (decode && nthreads > 1 && b->in_sz &&
+		(b->in[0] & X_TAB) && (b->in[0] & 3) == 1) {
+		fprintf(stderr, "Block %lld needs single threaded decoding\n",
+			(long long)p.next_read);
+		err = 1;
+		break;
+	    }
+	    pthread_mutex_lock(&p.lock);
+	    b->state = SLOT_QUEUED;
+	    p.next_read++;
+	    pthread_cond_signal(&p.work);
+	    pthread_mutex_unlock(&p.lock);
+	}
+
+	// Workers start once the first block is read, so the decoder knows
+	// whether it has to be single threaded.
+	if (!nt && !err) {
+	    for (; nt < nthreads; nt++)
+		if (pthread_create(&tid[nt], NULL, blk_worker, &p) != 0)
+		    break;
+	    if (nt == 0)
+		err = 1;
+	}
+
+	if (err || next_write == p.next_read)
+	    break;
+
+	// Write the oldest block once done
+	blk_slot *b = &p.slot[next_write % p.nslots];
+	pthread_mutex_lock(&p.lock);
+	while (b->state != SLOT_DONE)
+	    pthread_cond_wait(&p.done, &p.lock);
+	b->state = SLOT_FREE;
+	pthread_mutex_unlock(&p.lock);
+
+	if (b->err) {
+	    fprintf(stderr, "Failed to %s block %lld\n",
+		    decode ? "decode" : "encode", (long long)next_write);
+	    err = 1;
+	    break;
+	}
+
+	if (decode) {
+	    err |= fwrite(b->out, 1, b->out_sz, outfp) != b->out_sz;
+	    bytes += b->out_sz;
+	} else {
+	    uint32_t sz[2] = {b->out_sz, b->in_sz | (seq ? BLK_SEQ : 0)};
+	    err |= fwrite(sz, 1, 8, outfp) != 8;
+	    err |= fwrite(b->out, 1, b->out_sz, outfp) != b->out_sz;
+	    bytes += b->in_sz;
+	}
+	next_write++;
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.shutdown = 1;
+    p.next_read = p.next_job; // abandon any queued work on error
+    pthread_cond_broadcast(&p.work);
+    pthread_mutex_unlock(&p.lock);
+    for (i = 0; i < nt; i++)
+	pthread_join(tid[i], NULL);
+
+    for (i = 0; i < p.nslots; i++) {
+	free(p.slot[i].in);
+	free(p.slot[i].out);
+    }
+    free(p.slot);
+    free(tid);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.work);
+    pthread_cond_destroy(&p.done);
+
+    return err ? -1 : bytes;
+}
+
 /*-----------------------------------------------------------------------------
  * Main
  */
 static unsigned char in_buf[BLK_SIZE2+257*257*3];
 
 int main(int argc, char **argv) {
-    int opt, order = 0;
+    int opt, order = 0, nthreads = 1;
     int decode = 0, test = 0;
     FILE *infp = stdin, *outfp = stdout;
     struct timeval tv1, tv2, tv3, tv4;
@@ -2196,12 +4437,18 @@ int main(int argc, char **argv) {
     extern char *optarg;
     extern int optind;
 
-    while ((opt = getopt(argc, argv, "o:dt")) != -1) {
+    while ((opt = getopt(argc, argv, "o:dt@:")) != -1) {
 	switch (opt) {
 	case 'o':
 	    order = atoi(optarg);
 	    break;
 
+	case '@':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1)
+		nthreads = 1;
+	    break;
+
 	case 'd':
 	    decode = 1;
 	    break;
@@ -2214,6 +4461,11 @@ int main(int argc, char **argv) {
 
     //order = order ? 1 : 0; // Only support O(0) and O(1)
 
+    // Inherited tables need the blocks coded in sequence by one context.
+    // Such files are marked so the decoder does the same.
+    if (!decode && (order & X_TAB) && (order & 3) == 1)
+	nthreads = 1;
+
     if (optind < argc) {
 	if (!(infp = fopen(argv[optind], "rb"))) {
 	    perror(argv[optind]);
@@ -2235,7 +4487,7 @@ int main(int argc, char **argv) {
     if (test) {
 	size_t len, in_sz = 0, out_sz = 0;
 	typedef struct {
-	    unsigned char *blk;
+	    unsigned char *blk, *buf;
 	    uint32_t sz;
 	} blocks;
 	blocks *b = NULL, *bc = NULL, *bu = NULL;
@@ -2250,9 +4502,9 @@ int main(int argc, char **argv) {
 	    b[nb].sz = len;
 	    memcpy(b[nb].blk, in_buf, len);
 	    bc[nb].sz = rans_compress_bound_4x16(BLK_SIZE, order);
-	    bc[nb].blk = malloc(bc[nb].sz);
+	    bc[nb].blk = bc[nb].buf = malloc(bc[nb].sz);
 	    bu[nb].sz = BLK_SIZE;
-	    bu[nb].blk = malloc(BLK_SIZE);
+	    bu[nb].blk = bu[nb].buf = malloc(BLK_SIZE);
 	    nb++;
 	    in_sz += len;
 	}
@@ -2262,34 +4514,41 @@ int main(int argc, char **argv) {
 #define NTRIALS 10
 #endif
 	int trials = NTRIALS;
+	rans_ctx *ctx = rans_ctx_create();
+	unsigned int bound = rans_compress_bound_4x16(BLK_SIZE, order);
 	while (trials--) {
 	    // Warmup
-	    for (i = 0; i < nb; i++) memset(bc[i].blk, 0, bc[i].sz);
+	    for (i = 0; i < nb; i++) memset(bc[i].buf, 0, bound);
 
 	    gettimeofday(&tv1, NULL);
 
 	    out_sz = 0;
 	    for (i = 0; i < nb; i++) {
-		unsigned int csz = bc[i].sz;
-		bc[i].blk = rans_compress_to_4x16(b[i].blk, b[i].sz, bc[i].blk, &csz, order);
-		assert(csz <= bc[i].sz);
+		unsigned int csz = bound;
+		bc[i].blk = rans_compress_to_4x16_ctx(ctx, b[i].blk, b[i].sz,
+						      bc[i].buf, &csz, order);
+		assert(csz <= bound);
+		bc[i].sz = csz;
 		out_sz += 5 + csz;
 	    }
 
 	    gettimeofday(&tv2, NULL);
 	    
 	    // Warmup
-	    for (i = 0; i < nb; i++) memset(bu[i].blk, 0, BLK_SIZE);
+	    for (i = 0; i < nb; i++) memset(bu[i].buf, 0, BLK_SIZE);
 
 	    gettimeofday(&tv3, NULL);
 
-	    for (i = 0; i < nb; i++)
-		bu[i].blk = rans_uncompress_to_4x16(bc[i].blk, bc[i].sz, bu[i].blk, &bu[i].sz);
+	    for (i = 0; i < nb; i++) {
+		bu[i].sz = b[i].sz;
+		bu[i].blk = rans_uncompress_to_4x16_ctx(ctx, bc[i].blk, bc[i].sz,
+							bu[i].buf, &bu[i].sz);
+	    }
 
 	    gettimeofday(&tv4, NULL);
 
 	    for (i = 0; i < nb; i++) {
-		if (b[i].sz != bu[i].sz || memcmp(b[i].blk, bu[i].blk, b[i].sz))
+		if (!bu[i].blk || b[i].sz != bu[i].sz || memcmp(b[i].blk, bu[i].blk, b[i].sz))
 		    fprintf(stderr, "Mismatch in block %d, sz %d/%d\n", i, b[i].sz, bu[i].sz);
 		//free(bc[i].blk);
 		//free(bu[i].blk);
@@ -2303,54 +4562,19 @@ int main(int argc, char **argv) {
 		    (long long)in_sz, (long long)out_sz);
 	}
 
+	rans_ctx_destroy(ctx);
 	exit(0);
 	
     }
 
-    if (decode) {
-	// Only used in some test implementations of RC_GetFreq()
-	//RC_init();
-	//RC_init2();
-
-	for (;;) {
-	    uint32_t in_size, out_size;
-	    unsigned char *out;
-
-	    if (4 != fread(&in_size, 1, 4, infp))
-		break;
-	    if (in_size != fread(in_buf, 1, in_size, infp)) {
-		fprintf(stderr, "Truncated input\n");
-		exit(1);
-	    }
-	    out = rans_uncompress_4x16(in_buf, in_size, &out_size);
-	    if (!out)
-		abort();
-
-	    fwrite(out, 1, out_size, outfp);
-	    free(out);
-
-	    bytes += out_size;
-	}
-    } else {
-	for (;;) {
-	    uint32_t in_size, out_size;
-	    unsigned char *out;
-
-	    in_size = fread(in_buf, 1, BLK_SIZE, infp);
-	    if (in_size <= 0)
-		break;
+    int64_t nbytes = blk_process(infp, outfp, decode, order, nthreads);
+    if (nbytes < 0)
+	return 1;
+    bytes = nbytes;
 
-	    if (in_size < 4)
-		order &= ~1;
-
-	    out = rans_compress_4x16(in_buf, in_size, &out_size, order);
-
-	    fwrite(&out_size, 1, 4, outfp);
-	    fwrite(out, 1, out_size, outfp);
-	    free(out);
-
-	    bytes += in_size;
-	}
+    if (fflush(outfp) != 0) {
+	perror("write");
+	return 1;
     }
 
     gettimeofday(&tv2, NULL);
@@ -2399,4 +4623,18 @@ Q40 (40 qual illumina) gains from neither packing nor RLE.
 BWT doesn't save much, so qlfc alone is sufficient for good ratio.
 However both bsc and qlfc are an order of magnitude slower. 
 
+r32x16 (order 4, X_32) is order-0 with 32 interleaved states.  Sizes grow
+by ~250 bytes per block for the extra state flushes.  Decode speeds
+(MBps, same machine, 1MB blocks) by RANS_CPU kernel:
+
+                r4x16 O0   scalar   sse4   avx2   avx512
+      q40         ~370       290     620    985    1080
+
+Built-in order-0 models (order 16, X_TAB) on 3MB of 4-level binned
+qualities cut into small blocks.  Decode no longer builds any tables.
+
+      block     order 0      order 16     dec MBps
+      1000       334366        313104     298 ->  505
+       200       605242        481304      87 ->  493
+
  */
@@ -1,4 +1,6 @@
-// cc -I. -g -O3 tokenise_name3.c codec_orig.c rANS_static4x16pr.c pooled_alloc.c -lm
+// cc -I. -g -O3 tokenise_name3.c codec_orig.c rANS_static4x16pr.c -lm -lpthread
+//
+// Build with -DNO_MAIN to use it as a library; see tokenise_name3.h.
 
 // As per tokenise_name2 but has the entropy encoder built in already,
 // so we just have a single encode and decode binary.  (WIP; mainly TODO)
@@ -54,7 +56,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
-#include <pooled_alloc.h>
+#include "tokenise_name3.h"
+#include "rANS_static4x16.h"
+
+#ifndef NO_THREADS
+#include <pthread.h>
+#endif
 
 // FIXME
 #define MAX_TOKENS 128
@@ -80,51 +87,70 @@ typedef struct {
     //int last_token_delta[MAX_TOKENS];
 } last_context;
 
+typedef struct {
+    uint8_t *buf;
+    size_t buf_a, buf_l; // alloc and used length.
+    int tnum, ttype;
+    int dup_from;
+} descriptor;
+
 typedef struct {
     last_context *lc;
 
+    // Descriptors for this block
+    descriptor desc[MAX_DESCRIPTORS];
+
     // For finding entire line dups
     int counter;
 
     // Trie used in encoder only
-    trie_t *t_head;
-    pool_alloc_t *pool;
+    trie_t *trie;
+    uint64_t *t_kids;    // child table, 2*t_alloc entries
+    uint32_t t_nodes, t_alloc;
+    char *t_base;        // the block of names
 } name_context;
 
-name_context *create_context(int max_names) {
+static name_context *create_context(int max_names) {
     name_context *ctx = malloc(sizeof(*ctx) + max_names*sizeof(*ctx->lc));
     if (!ctx) return NULL;
 
     ctx->counter = 0;
-    ctx->t_head = NULL;
+    ctx->trie = NULL;
+    ctx->t_kids = NULL;
+    ctx->t_nodes = ctx->t_alloc = 0;
+    ctx->t_base = NULL;
 
     ctx->lc = (last_context *)(((char *)ctx) + sizeof(*ctx));
-    ctx->pool = NULL;
+    memset(ctx->desc, 0, sizeof(ctx->desc));
 
     return ctx;
 }
 
-void free_trie(trie_t *t);
-void free_context(name_context *ctx) {
-    if (!ctx)
-	return;
+// Empties ctx ready for the next block.
+static void reset_context(name_context *ctx) {
+    int i;
 
-//    if (ctx->t_head)
-//	free_trie(ctx->t_head);
-    if (ctx->pool)
-	pool_destroy(ctx->pool);
+    for (i = 0; i < MAX_DESCRIPTORS; i++)
+	free(ctx->desc[i].buf);
+    memset(ctx->desc, 0, sizeof(ctx->desc));
 
-    free(ctx);
+    // Keep the trie's memory for the next block
+    if (ctx->t_nodes)
+	memset(ctx->t_kids, 0, 2*ctx->t_alloc * sizeof(*ctx->t_kids));
+    ctx->t_nodes = 0;
+
+    ctx->counter = 0;
 }
 
-typedef struct {
-    uint8_t *buf;
-    size_t buf_a, buf_l; // alloc and used length.
-    int tnum, ttype;
-    int dup_from;
-} descriptor;
+static void free_context(name_context *ctx) {
+    if (!ctx)
+	return;
 
-static descriptor desc[MAX_DESCRIPTORS];
+    reset_context(ctx);
+    free(ctx->trie);
+    free(ctx->t_kids);
+    free(ctx);
+}
 
 //-----------------------------------------------------------------------------
 // Fast unsigned integer printing code.
@@ -212,9 +238,9 @@ static int encode_token_type(name_context *ctx, int ntok,
 			     enum name_type type) {
     int id = ntok<<4;
 
-    if (descriptor_grow(&desc[id], 1) < 0) return -1;
+    if (descriptor_grow(&ctx->desc[id], 1) < 0) return -1;
 
-    desc[id].buf[desc[id].buf_l++] = type;
+    ctx->desc[id].buf[ctx->desc[id].buf_l++] = type;
 
     return 0;
 }
@@ -229,8 +255,8 @@ static int encode_token_end(name_context *ctx, int ntok) {
 
 static enum name_type decode_token_type(name_context *ctx, int ntok) {
     int id = ntok<<4;
-    if (desc[id].buf_l >= desc[id].buf_a) return -1;
-    return desc[id].buf[desc[id].buf_l++];
+    if (ctx->desc[id].buf_l >= ctx->desc[id].buf_a) return -1;
+    return ctx->desc[id].buf[ctx->desc[id].buf_l++];
 }
 
 // int stored as 32-bit quantities
@@ -239,11 +265,11 @@ static int encode_token_int(name_context *ctx, int ntok,
     int id = (ntok<<4) | type;
 
     if (encode_token_type(ctx, ntok, type) < 0) return -1;
-    if (descriptor_grow(&desc[id], 4) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id], 4) < 0)	return -1;
 
     // Assumes little endian and unalign access OK.
-    *(uint32_t *)(desc[id].buf + desc[id].buf_l) = val;
-    desc[id].buf_l += 4;
+    *(uint32_t *)(ctx->desc[id].buf + ctx->desc[id].buf_l) = val;
+    ctx->desc[id].buf_l += 4;
 
     return 0;
 }
@@ -255,8 +281,8 @@ static int decode_token_int(name_context *ctx, int ntok,
     // FIXME: add checks
 
     // Assumes little endian and unalign access OK.
-    *val = *(uint32_t *)(desc[id].buf + desc[id].buf_l);
-    desc[id].buf_l += 4;
+    *val = *(uint32_t *)(ctx->desc[id].buf + ctx->desc[id].buf_l);
+    ctx->desc[id].buf_l += 4;
 
     return 0;
 }
@@ -267,9 +293,9 @@ static int encode_token_int1(name_context *ctx, int ntok,
     int id = (ntok<<4) | type;
 
     if (encode_token_type(ctx, ntok, type) < 0) return -1;
-    if (descriptor_grow(&desc[id], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id], 1) < 0)	return -1;
 
-    desc[id].buf[desc[id].buf_l++] = val;
+    ctx->desc[id].buf[ctx->desc[id].buf_l++] = val;
 
     return 0;
 }
@@ -278,9 +304,9 @@ static int encode_token_int1_(name_context *ctx, int ntok,
 			      enum name_type type, uint32_t val) {
     int id = (ntok<<4) | type;
 
-    if (descriptor_grow(&desc[id], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id], 1) < 0)	return -1;
 
-    desc[id].buf[desc[id].buf_l++] = val;
+    ctx->desc[id].buf[ctx->desc[id].buf_l++] = val;
 
     return 0;
 }
@@ -291,7 +317,7 @@ static int decode_token_int1(name_context *ctx, int ntok,
     int id = (ntok<<4) | type;
     // FIXME: add checks
 
-    *val = desc[id].buf[desc[id].buf_l++];
+    *val = ctx->desc[id].buf[ctx->desc[id].buf_l++];
 
     return 0;
 }
@@ -302,15 +328,15 @@ static int encode_token_int4(name_context *ctx, int ntok,
     int id = (ntok<<4) | type;
 
     if (encode_token_type(ctx, ntok, type) < 0) return -1;
-    if (descriptor_grow(&desc[id  ], 1) < 0)	return -1;
-    if (descriptor_grow(&desc[id+1], 1) < 0)	return -1;
-    if (descriptor_grow(&desc[id+2], 1) < 0)	return -1;
-    if (descriptor_grow(&desc[id+3], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id  ], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id+1], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id+2], 1) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id+3], 1) < 0)	return -1;
 
-    desc[id  ].buf[desc[id  ].buf_l++] = val>>0;
-    desc[id+1].buf[desc[id+1].buf_l++] = val>>8;
-    desc[id+2].buf[desc[id+2].buf_l++] = val>>16;
-    desc[id+3].buf[desc[id+3].buf_l++] = val>>24; 
+    ctx->desc[id  ].buf[ctx->desc[id  ].buf_l++] = val>>0;
+    ctx->desc[id+1].buf[ctx->desc[id+1].buf_l++] = val>>8;
+    ctx->desc[id+2].buf[ctx->desc[id+2].buf_l++] = val>>16;
+    ctx->desc[id+3].buf[ctx->desc[id+3].buf_l++] = val>>24; 
 
     return 0;
 }
@@ -322,10 +348,10 @@ static int decode_token_int4(name_context *ctx, int ntok,
     // FIXME: add checks
 
     *val = 
-	(desc[id  ].buf[desc[id  ].buf_l++] << 0 ) |
-	(desc[id+1].buf[desc[id+1].buf_l++] << 8 ) |
-	(desc[id+2].buf[desc[id+2].buf_l++] << 16) |
-	(desc[id+3].buf[desc[id+3].buf_l++] << 24);
+	(ctx->desc[id  ].buf[ctx->desc[id  ].buf_l++] << 0 ) |
+	(ctx->desc[id+1].buf[ctx->desc[id+1].buf_l++] << 8 ) |
+	(ctx->desc[id+2].buf[ctx->desc[id+2].buf_l++] << 16) |
+	(ctx->desc[id+3].buf[ctx->desc[id+3].buf_l++] << 24);
 
     return 0;
 }
@@ -336,10 +362,10 @@ static int encode_token_int7(name_context *ctx, int ntok,
     int id = (ntok<<4) | type;
 
     if (encode_token_type(ctx, ntok, type) < 0) return -1;
-    if (descriptor_grow(&desc[id], 5) < 0)	return -1;
+    if (descriptor_grow(&ctx->desc[id], 5) < 0)	return -1;
 
     do {
-	desc[id].buf[desc[id].buf_l++] = (val & 0x7f) | ((val >= 0x80)<<7);
+	ctx->desc[id].buf[ctx->desc[id].buf_l++] = (val & 0x7f) | ((val >= 0x80)<<7);
 	val >>= 7;
     } while (val);
 
@@ -355,7 +381,7 @@ static int decode_token_int7(name_context *ctx, int ntok,
 
     // FIXME: add checks
     do {
-	c = desc[id].buf[desc[id].buf_l++];
+	c = ctx->desc[id].buf[ctx->desc[id].buf_l++];
 	v |= (c & 0x7f) << s;
 	s += 7;
     } while (c & 0x80);
@@ -381,10 +407,10 @@ static int encode_token_alpha(name_context *ctx, int ntok,
     int id = (ntok<<4) | N_ALPHA;
 
     if (encode_token_type(ctx, ntok, N_ALPHA) < 0)  return -1;
-    if (descriptor_grow(&desc[id], len+1) < 0) return -1;
-    memcpy(&desc[id].buf[desc[id].buf_l], str, len);
-    desc[id].buf[desc[id].buf_l+len] = 0;
-    desc[id].buf_l += len+1;
+    if (descriptor_grow(&ctx->desc[id], len+1) < 0) return -1;
+    memcpy(&ctx->desc[id].buf[ctx->desc[id].buf_l], str, len);
+    ctx->desc[id].buf[ctx->desc[id].buf_l+len] = 0;
+    ctx->desc[id].buf_l += len+1;
 
     return 0;
 }
@@ -396,12 +422,12 @@ static int encode_token_alpha(name_context *ctx, int ntok,
 //    int id = (ntok<<4) | N_ALPHA;
 //
 //    if (encode_token_type(ctx, ntok, N_ALPHA) < 0)  return -1;
-//    if (descriptor_grow(&desc[id],   len) < 0) return -1;
-//    if (descriptor_grow(&desc[id+1], 1) < 0) return -1;
-//    memcpy(&desc[id].buf[desc[id].buf_l], str, len);
-//    desc[id].buf[desc[id].buf_l+len] = 0;
-//    desc[id].buf_l += len;
-//    desc[id+1].buf[desc[id+1].buf_l++] = len;
+//    if (descriptor_grow(&ctx->desc[id],   len) < 0) return -1;
+//    if (descriptor_grow(&ctx->desc[id+1], 1) < 0) return -1;
+//    memcpy(&ctx->desc[id].buf[ctx->desc[id].buf_l], str, len);
+//    ctx->desc[id].buf[ctx->desc[id].buf_l+len] = 0;
+//    ctx->desc[id].buf_l += len;
+//    ctx->desc[id+1].buf[ctx->desc[id+1].buf_l++] = len;
 //
 //    return 0;
 //}
@@ -415,7 +441,7 @@ static int decode_token_alpha(name_context *ctx, int ntok, char *str) {
     int len = 0;
     do {
 	// FIXME: add checks
-	c = desc[id].buf[desc[id].buf_l++];
+	c = ctx->desc[id].buf[ctx->desc[id].buf_l++];
 	str[len++] = c;
     } while(c);
 
@@ -426,8 +452,8 @@ static int encode_token_char(name_context *ctx, int ntok, char c) {
     int id = (ntok<<4) | N_CHAR;
 
     if (encode_token_type(ctx, ntok, N_CHAR) < 0) return -1;
-    if (descriptor_grow(&desc[id], 1) < 0)    return -1;
-    desc[id].buf[desc[id].buf_l++] = c;
+    if (descriptor_grow(&ctx->desc[id], 1) < 0)    return -1;
+    ctx->desc[id].buf[ctx->desc[id].buf_l++] = c;
 
     return 0;
 }
@@ -438,7 +464,7 @@ static int decode_token_char(name_context *ctx, int ntok, char *str) {
     int id = (ntok<<4) | N_CHAR;
 
     // FIXME: add checks
-    *str = desc[id].buf[desc[id].buf_l++];
+    *str = ctx->desc[id].buf[ctx->desc[id].buf_l++];
 
     return 1;
 }
@@ -456,139 +482,105 @@ static int encode_token_diff(name_context *ctx, uint32_t val) {
 
 
 //-----------------------------------------------------------------------------
-// Trie implementation for tracking common name prefixes.
+// Trie for finding earlier names that share a prefix.
+//
+// This is a path compressed (radix) trie.  Each node holds a run of
+// characters, stored as an offset into the block of names, so long shared
+// prefixes such as PacBio movie names are compared in a tight loop rather
+// than walked one node per character.  Nodes live in a single array
+// addressed by index, and children are found by hashing the parent index
+// and first character into an open addressed table, rather than scanning
+// a list of siblings.  Both are kept in the context for reuse from block
+// to block.
+//
+// Nodes are added by search_trie() as it goes, so each name is walked
+// once.  TRIE_MAX_NODES caps the memory used, at 28 bytes a node, and is
+// rounded down to a power of two.  Past that names are still searched for
+// but no longer added.  It may be at most 1<<24, as the child keys hold a
+// node index and a byte in 32 bits.
+
+#ifndef TRIE_MAX_NODES
+#define TRIE_MAX_NODES (1<<20)
+#endif
+
 typedef struct trie {
-    char c;
-    int count;
-    //struct trie *next[128];
-    struct trie *next, *sibling;
-    int n; // Nth line
+    uint32_t off, len; // label is t_base[off..off+len)
+    int n;             // last line through this node
 } trie_t;
 
-//static trie_t *t_head = NULL;
-
-void free_trie(trie_t *t) {
-    trie_t *x, *n;
-    for (x = t->next; x; x = n) {
-	n = x->sibling;
-	free_trie(x);
-    }
-    free(t);
+// Child table slot for key t<<8 | c, from node t and char c.  Entries
+// are key<<32 | child, with 0 for empty; c > '\n' so a key is never 0.
+// Chars are unsigned so 8-bit names are handled the same everywhere.
+static inline uint32_t trie_slot(name_context *ctx, uint32_t key) {
+    uint32_t h = key * 2654435761u;
+    return (h ^ (h >> 16)) & (2*ctx->t_alloc-1);
 }
 
-int build_trie(name_context *ctx, char *data, size_t len, int n) {
-    int nlines = 0;
-    size_t i;
-    trie_t *t;
-
-    if (!ctx->t_head)
-	ctx->t_head = calloc(1, sizeof(*ctx->t_head));
-
-    // Build our trie, also counting input lines
-    for (nlines = i = 0; i < len; i++, nlines++) {
-	t = ctx->t_head;
-	t->count++;
-	while (i < len && data[i] > '\n') {
-	    unsigned char c = data[i++];
-	    if (c & 0x80)
-		//fprintf(stderr, "8-bit ASCII is unsupported\n");
-		abort();
-	    c &= 127;
-
+// The child of node t starting with c, or 0 if none.
+static inline uint32_t trie_child(name_context *ctx, uint32_t t, uint8_t c) {
+    uint32_t key = t<<8 | c, mask = 2*ctx->t_alloc-1;
+    uint32_t h = trie_slot(ctx, key);
+    uint64_t e;
 
-	    trie_t *x = t->next, *l = NULL;
-	    while (x && x->c != c) {
-		l = x; x = x->sibling;
-	    }
-	    if (!x) {
-		if (!ctx->pool)
-		    ctx->pool = pool_create(sizeof(trie_t));
-		x = (trie_t *)pool_alloc(ctx->pool);
-		memset(x, 0, sizeof(*x));
-		if (!l)
-		    x = t->next    = x;
-		else
-		    x = l->sibling = x;
-		x->n = n;
-		x->c = c;
-	    }
-	    t = x;
-	    t->c = c;
-	    t->count++;
-	}
+    while ((e = ctx->t_kids[h])) {
+	if (e>>32 == key)
+	    return (uint32_t)e;
+	h = (h+1) & mask;
     }
 
     return 0;
 }
 
-#if 0
-void dump_trie(trie_t *t, int depth) {
-    if (depth == 0) {
-	printf("graph x_%p {\n    splines = ortho\n    ranksep=2\n", t);
-	printf("    p_%p [label=\"\"];\n", t);
-	dump_trie(t, 1);
-	printf("}\n");
-    } else {
-	int j, k, count;//, cj;
-	char label[100], *cp;
-	trie_t *tp = t;
-
-//    patricia:
-//	for (count = j = 0; j < 128; j++)
-//	    if (t->next[j])
-//		count++, cj=j;
-//
-//	if (count == 1) {
-//	    t = t->next[cj];
-//	    *cp++ = cj;
-//	    goto patricia;
-//	}
-
-	trie_t *x;
-	for (x = t->next; x; x = x->sibling) {
-	    printf("    p_%p [label=\"%c\"];\n", x, x->c);
-	    printf("    p_%p -- p_%p [label=\"%d\", penwidth=\"%f\"];\n", tp, x, x->count, MAX((log(x->count)-3)*2,1));
-	    //if (depth <= 11)
-		dump_trie(x, depth+1);
-	}
+// Sets the child of node t starting with c to x.
+static void trie_set_child(name_context *ctx, uint32_t t, uint8_t c,
+			   uint32_t x) {
+    uint32_t key = t<<8 | c, mask = 2*ctx->t_alloc-1;
+    uint32_t h = trie_slot(ctx, key);
 
-#if 0	    
-	for (j = 0; j < 128; j++) {
-	    trie_t *tn;
+    while (ctx->t_kids[h] && ctx->t_kids[h]>>32 != key)
+	h = (h+1) & mask;
+    ctx->t_kids[h] = (uint64_t)key<<32 | x;
+}
 
-	    if (!t->next[j])
-		continue;
+// Adds a node, returning its index or -1 if full.
+static int trie_node(name_context *ctx, uint32_t off, uint32_t len, int n) {
+    if (ctx->t_nodes == ctx->t_alloc) {
+	uint32_t a = ctx->t_alloc ? ctx->t_alloc*2 : 1024, old_a = ctx->t_alloc;
+	if (a > TRIE_MAX_NODES)
+	    return -1;
+	trie_t *t = realloc(ctx->trie, a * sizeof(*t));
+	uint64_t *old = ctx->t_kids, *kids = calloc(2*a, sizeof(*kids)), e;
+	if (t)
+	    ctx->trie = t;
+	if (!t || !kids) {
+	    free(kids);
+	    return -1;
+	}
 
-	    cp = label;
-	    tn = t->next[j];
-	    *cp++ = j;
-//	patricia:
-
-	    for (count = k = 0; k < 128; k++)
-		if (tn->next[k])
-		    count++;//, cj=k;
-
-//	    if (count == 1) {
-//		tn = tn->next[cj];
-//		*cp++ = cj;
-//		goto patricia;
-//	    }
-	    *cp++ = 0;
-
-	    printf("    p_%p [label=\"%s\"];\n", tn, label);
-	    printf("    p_%p -- p_%p [label=\"%d\", penwidth=\"%f\"];\n", tp, tn, tn->count, MAX((log(tn->count)-3)*2,1));
-	    if (depth <= 11)
-		dump_trie(tn, depth+1);
+	// Rehash the children
+	ctx->t_kids = kids;
+	ctx->t_alloc = a;
+	for (a = 0; a < 2*old_a; a++) {
+	    if (!(e = old[a]))
+		continue;
+	    uint32_t h = trie_slot(ctx, e>>32);
+	    while (kids[h])
+		h = (h+1) & (2*ctx->t_alloc-1);
+	    kids[h] = e;
 	}
-#endif
+	free(old);
     }
+
+    trie_t *t = &ctx->trie[ctx->t_nodes];
+    t->off = off;
+    t->len = len;
+    t->n = n;
+
+    return ctx->t_nodes++;
 }
-#endif
 
-int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, int *is_fixed, int *fixed_len) {
-    int nlines = 0;
-    size_t i, j = -1;
-    trie_t *t;
+static int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, int *is_fixed, int *fixed_len) {
+    size_t i;
     int from = -1, p3 = -1;
 
     // Horrid hack for the encoder only.
@@ -599,6 +591,7 @@ int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, in
     int f = (*data == '>') ? 1 : 0;
     if (l > 70 && d[f+0] == 'm' && d[7] == '_' && d[f+14] == '_' && d[f+61] == '/') {
 	prefix_len = 60; // PacBio
+	*fixed_len = 0;
 	*is_fixed = 0;
     } else if (l == 17 && d[f+5] == ':' && d[f+11] == ':') {
 	prefix_len = 7;  // IonTorrent
@@ -615,37 +608,72 @@ int search_trie(name_context *ctx, char *data, size_t len, int n, int *exact, in
 	// Anything else we give up on the trie method, but we still want to search
 	// for exact matches;
 	prefix_len = INT_MAX;
+	*fixed_len = 0;
 	*is_fixed = 0;
     }
     //prefix_len = INT_MAX;
 
-    if (!ctx->t_head)
-	ctx->t_head = calloc(1, sizeof(*ctx->t_head));
-
-    // Find an item in the trie
-    for (nlines = i = 0; i < len; i++, nlines++) {
-	t = ctx->t_head;
-	while (i < len && data[i] > '\n') {
-	    unsigned char c = data[i++];
-	    if (c & 0x80)
-		//fprintf(stderr, "8-bit ASCII is unsupported\n");
-		abort();
-	    c &= 127;
+    if (!ctx->t_nodes && trie_node(ctx, data - ctx->t_base, 0, n) < 0) {
+	*exact = 0;
+	return -1;
+    }
 
-	    trie_t *x = t->next;
-	    while (x && x->c != c)
-		x = x->sibling;
-	    t = x;
+    // Find an item in the trie, adding it as we go.  Each node on the way
+    // gives the last earlier line through it, or our own if none.  Chars
+    // <= '\n' split the name into separately rooted parts.
+    uint32_t base = data - ctx->t_base;
+    uint8_t *udata = (uint8_t *)data;
+    for (i = 0; i < len; i++) {
+	size_t e = i;
+	int t = 0, x, y;
+	while (e < len && udata[e] > '\n')
+	    e++;
+
+	while (i < e) {
+	    trie_t *T = ctx->trie;
+	    uint32_t m, ml;
+
+	    if (!(x = trie_child(ctx, t, data[i]))) {
+		// New suffix
+		if ((y = trie_node(ctx, base+i, e-i, n)) >= 0)
+		    trie_set_child(ctx, t, data[i], y);
+		if (prefix_len > i && prefix_len <= e)
+		    p3 = n;
+		from = n;
+		i = e;
+		break;
+	    }
 
-//	    t = t->next[c];
+	    char *lab = ctx->t_base + T[x].off;
+	    ml = T[x].len < e-i ? T[x].len : e-i;
+	    for (m = 1; m < ml && lab[m] == data[i+m]; m++)
+		;
+
+	    if (m < T[x].len) {
+		// Split x, with y taking its first m chars
+		if ((y = trie_node(ctx, T[x].off, m, T[x].n)) < 0) {
+		    if (prefix_len > i && prefix_len <= i+m)
+			p3 = T[x].n;
+		    from = i+m == e ? T[x].n : n;
+		    i = e;
+		    break;
+		}
+		T = ctx->trie;
+		T[x].off += m;
+		T[x].len -= m;
+		trie_set_child(ctx, t, data[i], y);
+		trie_set_child(ctx, y, ctx->t_base[T[x].off], x);
+		x = y;
+	    }
 
-	    from = t->n;
-	    if (i == prefix_len) p3 = t->n;
-	    //if (t->count >= .0035*ctx->t_head->count && t->n != n) p3 = t->n; // pacbio
-	    //if (i == 60) p3 = t->n; // pacbio
-	    //if (i == 7) p3 = t->n; // iontorrent
-	    t->n = n;
+	    if (prefix_len > i && prefix_len <= i+m)
+		p3 = T[x].n;
+	    from = T[x].n;
+	    T[x].n = n;
+	    t = x;
+	    i += m;
 	}
+	i = e;
     }
 
     //printf("Looked for %d, found %d, prefix %d\n", n, from, p3);
@@ -914,6 +942,8 @@ static int encode_name(name_context *ctx, char *name, int len) {
 // Name decoder
 
 // FIXME: should know the maximum name length for safety.
+// Returns the length of the name including its nul terminator, 0 at the
+// end of the block, or -1 on error.
 static int decode_name(name_context *ctx, char *name) {
     int t0 = decode_token_type(ctx, 0);
     uint32_t dist;
@@ -937,7 +967,7 @@ static int decode_name(name_context *ctx, char *name) {
 	memcpy(ctx->lc[cnum].last_token_int , ctx->lc[pnum].last_token_int , nc * sizeof(int));
 	memcpy(ctx->lc[cnum].last_token_str , ctx->lc[pnum].last_token_str , nc * sizeof(int));
 
-	return strlen(name);
+	return strlen(name)+1;
     }
 
     *name = 0;
@@ -1062,265 +1092,743 @@ static int decode_name(name_context *ctx, char *name) {
 }
 
 // Large enough for whole file for now.
-#define BLK_SIZE 1*1024*1024
-static char blk[BLK_SIZE*2]; // temporary fix for decoder, which needs more space
+#define BLK_SIZE TOK3_MAX_LEN
+
+int codec_compress_m(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len, int no_XN, int level, int *method);
+int codec_compress_with(uint8_t *in, uint64_t in_len, uint8_t *out,
+			uint64_t *out_len, int method, int level);
+int codec_uncompress(uint8_t *in, uint64_t in_len, uint8_t *out,
+		     uint64_t *out_len);
+uint64_t codec_uncompressed_size(uint8_t *in, uint64_t in_len);
+int i7put(uint8_t *buf, uint64_t val);
+int i7get(uint8_t *buf, uint64_t *val);
+int i7len(uint64_t val);
 
-static int decode(int argc, char **argv) {
-    uint32_t sz;
-    while (fread(&sz, 1, 4, stdin) == 4) {
-	uint8_t *in = malloc(sz);
-	if (!in)
-	    return -1;
+/*
+ * The best method for a descriptor rarely changes from one block to the
+ * next, so the encoder remembers it and skips the search.  A full search
+ * is redone every METHOD_REVERIFY blocks, or sooner if the compression
+ * ratio gets noticeably worse or the descriptor size changes a lot.
+ * Set METHOD_REVERIFY to 0 to search every time.
+ */
+#ifndef METHOD_REVERIFY
+#define METHOD_REVERIFY 8
+#endif
+
+typedef struct {
+    int method;       // from codec_compress_m(), or -1 if none yet
+    int age;          // blocks since the last search
+    uint64_t in_len;  // size at the last search
+    double ratio;     // out/in at the last search
+} desc_method;
+
+#ifndef NO_THREADS
+/*
+ * Method history shared by several contexts, as used by the threaded
+ * command line encoder.  Block seq may use meth[i] once block seq-1 is
+ * done with it, so each block sees the history a single context would
+ * have and the output doesn't depend on the number of threads.  Blocks
+ * still tokenise concurrently and their descriptor compression overlaps.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    desc_method meth[MAX_DESCRIPTORS];
+    int64_t done[MAX_DESCRIPTORS];  // last block finished with meth[i]
+} meth_shared;
+#endif
+
+struct tok3_ctx {
+    int level;          // descriptor compression level, 1 to 9
+    int nthreads;       // threads per call
+    name_context *nctx; // reset for each block
+    char *names;        // encoder copy of the input, or decoder output
+    int *offsets;       // decoder name offsets
+    uint8_t *out;       // encoder output
+    size_t out_a;
+    desc_method meth[MAX_DESCRIPTORS];
+#ifndef NO_THREADS
+    meth_shared *shared; // used instead of meth, if set
+    int64_t seq;         // block number within shared
+    int meth_next;       // shared entries below this are finished with
+#endif
+};
+
+tok3_ctx *tok3_ctx_create(int level, int nthreads) {
+    tok3_ctx *ctx = calloc(1, sizeof(*ctx));
+    int i;
+    if (!ctx)
+	return NULL;
+
+    ctx->level = level;
+    ctx->nthreads = nthreads > 0 ? nthreads : 1;
+    for (i = 0; i < MAX_DESCRIPTORS; i++)
+	ctx->meth[i].method = -1;
+
+    // Names are at most BLK_SIZE, but leave the decoder room for bad input
+    ctx->nctx = create_context(MAX_NAMES);
+    ctx->names = malloc(BLK_SIZE*2);
+    if (!ctx->nctx || !ctx->names) {
+	tok3_ctx_destroy(ctx);
+	return NULL;
+    }
+
+    return ctx;
+}
+
+void tok3_ctx_destroy(tok3_ctx *ctx) {
+    if (!ctx)
+	return;
 
-	if (fread(in, 1, sz, stdin) != sz)
+    free_context(ctx->nctx);
+    free(ctx->names);
+    free(ctx->offsets);
+    free(ctx->out);
+    free(ctx);
+}
+
+// Compresses one descriptor, using and updating its method history dm.
+static int compress_desc(desc_method *dm, int level, uint8_t *in,
+			 uint64_t in_len, uint8_t *out, uint64_t *out_len) {
+    uint64_t olen = *out_len;
+
+    if (dm->method >= 0 && dm->age < METHOD_REVERIFY &&
+	in_len <= 2*dm->in_len && 2*in_len >= dm->in_len) {
+	if (codec_compress_with(in, in_len, out, out_len, dm->method,
+				level) < 0)
 	    return -1;
+	if (*out_len <= 1.1 * dm->ratio * in_len + 8) {
+	    dm->age++;
+	    return 0;
+	}
+	*out_len = olen;
+    }
 
-	name_context *ctx;
-	char *line;
-	int i, c, o = 0;
-
-	// Unpack descriptors
-	int tnum = -1;
-	while (o < sz) {
-	    uint8_t ttype = in[o++];
-	    if (ttype == 255) {
-		uint16_t j = *(uint16_t *)&in[o];
-		o += 2;
-		ttype = in[o++];
-		if (ttype == 0)
-		    tnum++;
-		i = (tnum<<4) | ttype;
-
-		desc[i].buf_l = 0;
-		desc[i].buf_a = desc[j].buf_a;
-		desc[i].buf = malloc(desc[i].buf_a);
-		memcpy(desc[i].buf, desc[j].buf, desc[i].buf_a);
-		//fprintf(stderr, "Copy ttype %d, i=%d,j=%d, size %d\n", ttype, i, j, (int)desc[i].buf_a);
-		continue;
-	    }
+    if (codec_compress_m(in, in_len, out, out_len, 0, level, &dm->method) < 0)
+	return -1;
+    dm->age = 0;
+    dm->in_len = in_len;
+    dm->ratio = (double)*out_len / in_len;
 
-	    if (ttype == 0)
-		tnum++;
+    return 0;
+}
 
-	    //fprintf(stderr, "Read %02x\n", c);
+#ifndef NO_THREADS
+static meth_shared *meth_shared_create(void) {
+    meth_shared *s = malloc(sizeof(*s));
+    int i;
+    if (!s)
+	return NULL;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    for (i = 0; i < MAX_DESCRIPTORS; i++) {
+	s->meth[i].method = -1;
+	s->done[i] = -1;
+    }
 
-	    // Load compressed block
-	    uint8_t ctype[10];
-	    int nb;
-	    uint64_t clen, ulen = uncompressed_size(&in[o], sz-o);
-	    if (ulen < 0)
-		return -1;
-	    i = (tnum<<4) | ttype;
+    return s;
+}
 
-	    desc[i].buf_l = 0;
-	    desc[i].buf = malloc(ulen);
+static void meth_shared_destroy(meth_shared *s) {
+    if (!s)
+	return;
 
-	    desc[i].buf_a = ulen;
-	    clen = uncompress(&in[o], sz-o, desc[i].buf, &desc[i].buf_a);
-	    assert(desc[i].buf_a == ulen);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
 
-//	    fprintf(stderr, "%d: Decode tnum %d type %d clen %d ulen %d via %d\n",
-//		    o, tnum, ttype, (int)clen, (int)desc[i].buf_a, desc[i].buf[0]);
+// Finishes with the shared entries below i, each once the previous block
+// has, and waits likewise for entry i which is returned for our use.
+// With i of MAX_DESCRIPTORS this finishes the block.
+static desc_method *meth_acquire(tok3_ctx *tctx, int i) {
+    meth_shared *s = tctx->shared;
+    int j;
+
+    pthread_mutex_lock(&s->lock);
+    for (j = tctx->meth_next; j <= i && j < MAX_DESCRIPTORS; j++) {
+	while (s->done[j] < tctx->seq-1)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	if (j < i)
+	    s->done[j] = tctx->seq;
+    }
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
 
-	    o += clen;
+    tctx->meth_next = i;
+    return i < MAX_DESCRIPTORS ? &s->meth[i] : NULL;
+}
+#endif
 
-	    // Encode tnum 0 type 0 ulen 100000 clen 12530 via 2
-	    // Encode tnum 0 type 6 ulen 196800 clen 43928 via 3
-	    // Encode tnum 0 type 7 ulen 203200 clen 17531 via 3
-	    // Encode tnum 1 type 0 ulen 50800 clen 10 via 1
-	    // Encode tnum 1 type 1 ulen 3 clen 5 via 0
-	    // Encode tnum 2 type 0 ulen 50800 clen 10 via 1
-	    // 	
-	}
+/*-----------------------------------------------------------------------------
+ * Block encoding.
+ *
+ * A block is its 4 byte size, the number of descriptor entries and the
+ * i7 length of each entry, then the entries.  Each entry is the token
+ * type and the compressed descriptor, or 255, the uint16 number of an
+ * identical earlier descriptor and the token type.
+ */
+int tok3_encode_names(tok3_ctx *tctx, char *buf, int len, uint8_t **out) {
+    name_context *ctx = tctx->nctx;
+    descriptor *desc = ctx->desc;
+    char *blk = tctx->names;
+    int i, j, ret = -1;
+
+    if (len < 0 || len > BLK_SIZE)
+	return -1;
+    reset_context(ctx);
+#ifndef NO_THREADS
+    tctx->meth_next = 0;
+#endif
+
+    // Our own copy, as names are nul terminated in place
+    memcpy(blk, buf, len);
+    if (len && blk[len-1] != '\n')
+	blk[len++] = '\n';
+
+    // Encode names
+    ctx->t_base = blk;
+    for (i = j = 0; i < len; j=++i) {
+	while (blk[i] != '\n')
+	    i++;
+	blk[i] = '\0';
+	if (ctx->counter == MAX_NAMES || encode_name(ctx, &blk[j], i-j) < 0)
+	    goto err;
+    }
+
+    // Compress descriptors
+    int last_tnum = -1, nent = 0;
+    uint32_t tot_size = 0;
+    for (i = 0; i < MAX_DESCRIPTORS; i++) {
+	if (!desc[i].buf_l) continue;
 
-	int ret;
-	ctx = create_context(MAX_NAMES);
+	int tnum = i>>4;
+	int ttype = i&15;
 
-	line = blk;
-	while ((ret = decode_name(ctx, line)) > 0) {
-	    puts(line);
-	    line += ret+1;
+	if (ttype == 0) {
+	    assert(tnum == last_tnum+1);
+	    last_tnum = tnum;
 	}
 
-	free_context(ctx);
+	uint64_t out_len = 1.5 * rans_compress_bound_4x16(desc[i].buf_l, 2); // guesswork
+	uint8_t *out = malloc(out_len);
+	if (!out)
+	    goto err;
 
-	for (i = 0; i < MAX_DESCRIPTORS; i++) {
-	    if (desc[i].buf) {
-		free(desc[i].buf);
-		desc[i].buf = 0;
-	    }
+	desc_method *dm = &tctx->meth[i];
+#ifndef NO_THREADS
+	if (tctx->shared)
+	    dm = meth_acquire(tctx, i);
+#endif
+	if (compress_desc(dm, tctx->level, desc[i].buf,
+			  desc[i].buf_l, out, &out_len) < 0) {
+	    free(out);
+	    goto err;
 	}
 
-	if (ret < 0)
-	    return -1;
+	free(desc[i].buf);
+	desc[i].buf = out;
+	desc[i].buf_l = out_len;
+	desc[i].tnum = tnum;
+	desc[i].ttype = ttype;
 
-	free(in);
+	// Find dups
+	for (j = 0; j < i; j++) {
+	    if (!desc[j].buf)
+		continue;
+	    if (desc[i].buf_l != desc[j].buf_l)
+		continue;
+	    if (memcmp(desc[i].buf, desc[j].buf, desc[i].buf_l) == 0)
+		break;
+	}
+	if (j < i) {
+	    desc[i].dup_from = j;
+	    tot_size += 4; // flag, dup_from, ttype
+	} else {
+	    desc[i].dup_from = 0;
+	    tot_size += out_len + 1; // ttype
+	}
+	tot_size += i7len(desc[i].dup_from ? 4 : out_len + 1);
+	nent++;
     }
-
-    return 0;
+    tot_size += i7len(nent);
+
+    // Serialise: size, entry table, entries
+    if (tctx->out_a < tot_size + 4) {
+	uint8_t *o = realloc(tctx->out, tot_size + 4);
+	if (!o)
+	    goto err;
+	tctx->out = o;
+	tctx->out_a = tot_size + 4;
+    }
+    uint8_t *cp = tctx->out;
+    memcpy(cp, &tot_size, 4); cp += 4;
+    cp += i7put(cp, nent);
+    for (i = 0; i < MAX_DESCRIPTORS; i++)
+	if (desc[i].buf_l)
+	    cp += i7put(cp, desc[i].dup_from ? 4 : desc[i].buf_l + 1);
+    for (i = 0; i < MAX_DESCRIPTORS; i++) {
+	if (!desc[i].buf_l) continue;
+	if (desc[i].dup_from) {
+	    uint16_t y = desc[i].dup_from;
+	    *cp++ = 255;
+	    memcpy(cp, &y, 2); cp += 2;
+	    *cp++ = desc[i].ttype;
+	} else {
+	    *cp++ = desc[i].ttype;
+	    memcpy(cp, desc[i].buf, desc[i].buf_l);
+	    cp += desc[i].buf_l;
+	}
+    }
+    *out = tctx->out;
+    ret = cp - tctx->out;
+
+ err:
+#ifndef NO_THREADS
+    // Later blocks wait on us, so we finish with the history even on error
+    if (tctx->shared)
+	meth_acquire(tctx, MAX_DESCRIPTORS);
+#endif
+    reset_context(ctx);
+    return ret;
 }
 
-static int encode(int argc, char **argv) {
-    FILE *fp;
-    char *prefix = "stdin";
-    int len, i, j;
-    name_context *ctx;
+/*-----------------------------------------------------------------------------
+ * Block decoding.
+ *
+ * The entry lengths let us find every entry without decompressing the
+ * ones before it, so a block's descriptors are uncompressed in
+ * parallel.  Duplicates are copied once all the others are done.
+ */
 
-    if (argc > 1) {
-	fp = fopen(argv[1], "r");
-	if (!fp) {
-	    perror(argv[1]);
-	    return 1;
+// Blocks smaller than this uncompress their descriptors in one thread.
+#ifndef DEC_MT_MIN
+#define DEC_MT_MIN 65536
+#endif
+
+// Maximum number of threads uncompressing one block's descriptors.
+#ifndef DEC_DESC_THREADS
+#define DEC_DESC_THREADS 4
+#endif
+
+// The descriptor entries of one block, shared by uncompress_descs()
+typedef struct {
+    descriptor *desc;
+    uint8_t *ent[MAX_DESCRIPTORS];     // start of each entry
+    uint64_t ent_len[MAX_DESCRIPTORS];
+    int idx[MAX_DESCRIPTORS];          // descriptor number of each entry
+    uint8_t seen[MAX_DESCRIPTORS];     // descriptors with an entry
+    int nent, next, err;
+} dec_descs;
+
+// Uncompresses the non-duplicate entries of d, taking the next unclaimed
+// entry until none are left.
+static void *uncompress_descs(void *arg) {
+    dec_descs *d = (dec_descs *)arg;
+    int e;
+
+    while ((e = __sync_fetch_and_add(&d->next, 1)) < d->nent) {
+	uint8_t *in = d->ent[e];
+	uint64_t len = d->ent_len[e];
+	descriptor *ds = &d->desc[d->idx[e]];
+	if (*in == 255)
+	    continue;
+
+	uint64_t ulen = codec_uncompressed_size(in+1, len-1);
+	if (ulen == (uint64_t)-1 || !(ds->buf = malloc(ulen ? ulen : 1))) {
+	    d->err = 1;
+	    continue;
 	}
-	prefix = argv[1];
-    } else {
-	fp = stdin;
+	ds->buf_l = 0;
+	ds->buf_a = ulen;
+	if (codec_uncompress(in+1, len-1, ds->buf, &ds->buf_a) < 0 ||
+	    ds->buf_a != ulen)
+	    d->err = 1;
     }
 
-    int blk_offset = 0;
-    int blk_num = 0;
-    for (;;) {
-	int last_start = 0;
+    return NULL;
+}
 
-	memset(&desc[0], 0, MAX_DESCRIPTORS * sizeof(desc[0]));
+int tok3_decode_names(tok3_ctx *tctx, uint8_t *in, char **out,
+		      int **offsets) {
+    name_context *ctx = tctx->nctx;
+    uint32_t in_len;
+    uint64_t nent, len;
+    int e, i, j, n, ret = -1;
+
+    if (!tctx->offsets &&
+	!(tctx->offsets = malloc((MAX_NAMES+1) * sizeof(int))))
+	return -1;
+
+    memcpy(&in_len, in, 4);
+    in += 4;
+    uint8_t *end = in + in_len;
+    if (in_len < 1)
+	return -1;
+    in += i7get(in, &nent);
+    if (nent > MAX_DESCRIPTORS || nent > end - in)
+	return -1;
+
+    dec_descs *d = calloc(1, sizeof(*d));
+    if (!d)
+	return -1;
+    reset_context(ctx);
+    d->desc = ctx->desc;
+    d->nent = nent;
+
+    // Entry table
+    for (e = 0; e < nent; e++) {
+	if (in >= end)
+	    goto err;
+	in += i7get(in, &d->ent_len[e]);
+    }
+    int tnum = -1;
+    for (e = 0; e < nent; e++) {
+	len = d->ent_len[e];
+	if (len < 2 || len > end - in || (*in == 255 && len != 4))
+	    goto err;
+	uint8_t ttype = *in == 255 ? in[3] : in[0];
+	if (ttype > 15)
+	    goto err;
+	if (ttype == 0)
+	    tnum++;
+	if (tnum < 0 || (i = (tnum<<4) | ttype) >= MAX_DESCRIPTORS)
+	    goto err;
+	// One entry per descriptor, else two threads would share its buf
+	if (d->seen[i]++)
+	    goto err;
+	d->ent[e] = in;
+	d->idx[e] = i;
+	in += len;
+    }
 
-	ctx = create_context(MAX_NAMES);
+    // Uncompress descriptors
+    int nt = tctx->nthreads < DEC_DESC_THREADS
+	? tctx->nthreads : DEC_DESC_THREADS;
+    if (nt > nent || in_len < DEC_MT_MIN)
+	nt = 1;
+#ifndef NO_THREADS
+    pthread_t tid[DEC_DESC_THREADS];
+    int started[DEC_DESC_THREADS] = {0};
+    for (i = 1; i < nt; i++)
+	started[i] = pthread_create(&tid[i], NULL, uncompress_descs, d) == 0;
+    uncompress_descs(d);
+    for (i = 1; i < nt; i++)
+	if (started[i])
+	    pthread_join(tid[i], NULL);
+#else
+    uncompress_descs(d);
+#endif
+    if (d->err)
+	goto err;
+
+    // Duplicates
+    for (e = 0; e < nent; e++) {
+	if (*d->ent[e] != 255)
+	    continue;
+	uint16_t k;
+	memcpy(&k, d->ent[e]+1, 2);
+	descriptor *ds = &ctx->desc[d->idx[e]];
+	if (k >= MAX_DESCRIPTORS || !ctx->desc[k].buf || ds->buf)
+	    goto err;
+	ds->buf_l = 0;
+	ds->buf_a = ctx->desc[k].buf_a;
+	if (!(ds->buf = malloc(ds->buf_a ? ds->buf_a : 1)))
+	    goto err;
+	memcpy(ds->buf, ctx->desc[k].buf, ds->buf_a);
+    }
 
-	len = fread(blk+blk_offset, 1, BLK_SIZE-blk_offset, fp);
-	if (len <= 0)
-	    break;
+    // Names
+    char *line = tctx->names;
+    for (n = 0; n < MAX_NAMES && (j = decode_name(ctx, line)) > 0; n++) {
+	tctx->offsets[n] = line - tctx->names;
+	line += j;
+    }
+    tctx->offsets[n] = line - tctx->names;
+    if (n < MAX_NAMES && j == 0) {
+	*out = tctx->names;
+	*offsets = tctx->offsets;
+	ret = n;
+    }
 
-	// Construct trie
-	int ctr = 0;
-	len += blk_offset;
-	for (i = j = 0; i < len; j=++i) {
-	    while (i < len && blk[i] != '\n')
-		i++;
-	    if (blk[i] != '\n')
-		break;
+ err:
+    reset_context(ctx);
+    free(d);
+    return ret;
+}
 
-	    //blk[i] = '\0';
-	    last_start = i+1;
-	    build_trie(ctx, &blk[j], i-j, ctr++);
-	}
+#ifndef NO_MAIN
+/*-----------------------------------------------------------------------------
+ * Command line driver.
+ *
+ * Blocks are independent of each other, so with -t N the encoder and
+ * decoder run as a pipeline: the main thread reads block n, up to N
+ * worker threads encode or decode earlier blocks, and the main thread
+ * writes the results back out in input order with one write per block.
+ *
+ * Blocks are dealt out round-robin to N slots, each with its own
+ * tok3_ctx, so memory use is bounded by N blocks in flight.  The slots
+ * share one method history, passed on in block order, so the output is
+ * the same for any N and matches the old serial encoder.
+ */
+typedef struct {
+    tok3_ctx *ctx;
+    int decode;         // or encode
+    uint8_t *in;        // input block
+    int in_len;
+    char *out;          // output block, owned by ctx
+    int out_len;
+    int err;
+    int pending;        // out needs writing
+#ifndef NO_THREADS
+    int threaded;       // pending via tid
+    pthread_t tid;
+#endif
+} tok3_block;
+
+static void *block_worker(void *arg) {
+    tok3_block *b = (tok3_block *)arg;
+
+    b->err = -1;
+    if (b->decode) {
+	int n, *offsets;
+	char *cp;
+	if ((n = tok3_decode_names(b->ctx, b->in, &b->out, &offsets)) < 0)
+	    return NULL;
+	b->out_len = offsets[n];
+	for (cp = b->out; (cp = memchr(cp, 0, b->out + b->out_len - cp)); )
+	    *cp++ = '\n';
+    } else {
+	uint8_t *out;
+	if ((b->out_len = tok3_encode_names(b->ctx, (char *)b->in, b->in_len,
+					    &out)) < 0)
+	    return NULL;
+	b->out = (char *)out;
+    }
 
-	//fprintf(stderr, "Processed %d of %d in block, line %d\n", last_start, len, ctr);
+    b->err = 0;
+    return NULL;
+}
 
-	// Encode name
-	for (i = j = 0; i < len; j=++i) {
-	    while (i < len && blk[i] != '\n')
-		i++;
-	    if (blk[i] != '\n')
-		break;
+// Encodes or decodes b, in a new thread if threaded is set.
+static int block_start(tok3_block *b, int threaded) {
+    b->pending = 1;
+#ifndef NO_THREADS
+    b->threaded = threaded;
+    if (threaded && pthread_create(&b->tid, NULL, block_worker, b) != 0) {
+	b->pending = b->threaded = 0;
+	return -1;
+    }
+    if (threaded)
+	return 0;
+#endif
+    block_worker(b);
+    return 0;
+}
 
-	    blk[i] = '\0';
-	    if (encode_name(ctx, &blk[j], i-j) < 0)
-		return 1;
-	}
+// Waits for b to finish, if started, and writes its output.
+static int block_flush(tok3_block *b) {
+    if (!b->pending)
+	return 0;
+    b->pending = 0;
 
-	//dump_trie(t_head, 0);
+#ifndef NO_THREADS
+    if (b->threaded && pthread_join(b->tid, NULL) != 0)
+	return -1;
+#endif
+    if (b->err)
+	return -1;
 
-	// Serialise descriptors
-	int last_tnum = -1;
-	uint32_t tot_size = 0;
-	int ndesc = 0;
-	for (i = 0; i < MAX_DESCRIPTORS; i++) {
-	    if (!desc[i].buf_l) continue;
+    return fwrite(b->out, 1, b->out_len, stdout) == b->out_len ? 0 : -1;
+}
 
-	    ndesc++;
+static tok3_block *block_slots(int nthreads, int level, int decode) {
+    tok3_block *slot = calloc(nthreads, sizeof(*slot));
+    int n;
 
-	    int tnum = i>>4;
-	    int ttype = i&15;
+#ifndef NO_THREADS
+    meth_shared *shared = NULL;
+    if (slot && !decode && nthreads > 1 && !(shared = meth_shared_create())) {
+	free(slot);
+	return NULL;
+    }
+#endif
 
-	    if (ttype == 0) {
-		assert(tnum == last_tnum+1);
-		last_tnum = tnum;
+    for (n = 0; slot && n < nthreads; n++) {
+	slot[n].decode = decode;
+	if (!(slot[n].ctx = tok3_ctx_create(level, nthreads)) ||
+	    !(slot[n].in = malloc(BLK_SIZE))) {
+	    for (; n >= 0; n--) {
+		tok3_ctx_destroy(slot[n].ctx);
+		free(slot[n].in);
 	    }
+	    free(slot);
+#ifndef NO_THREADS
+	    meth_shared_destroy(shared);
+#endif
+	    return NULL;
+	}
+#ifndef NO_THREADS
+	slot[n].ctx->shared = shared;
+#endif
+    }
 
-	    uint64_t out_len = 1.5 * rans_compress_bound_4x16(desc[i].buf_l, 1); // guesswork
-	    uint8_t *out = malloc(out_len);
-	    assert(out);
+    return slot;
+}
 
-	    //uint8_t ttype8 = ttype;
-	    //write(1, &ttype8, 1);
+// Drains the slots, oldest first from slot[n], and frees them.
+static int block_finish(tok3_block *slot, int nthreads, int n, int err) {
+    int i;
+
+    for (i = 0; i < nthreads; i++) {
+	tok3_block *b = &slot[(n+i) % nthreads];
+	if (!err && block_flush(b) < 0)
+	    err = 1;
+#ifndef NO_THREADS
+	if (b->pending && b->threaded)
+	    pthread_join(b->tid, NULL);
+#endif
+    }
+#ifndef NO_THREADS
+    meth_shared_destroy(slot[0].ctx->shared);
+#endif
+    for (i = 0; i < nthreads; i++) {
+	tok3_ctx_destroy(slot[i].ctx);
+	free(slot[i].in);
+    }
+    free(slot);
 
-	    if (compress(desc[i].buf, desc[i].buf_l, out, &out_len, 0) < 0)
-		abort();
+    if (fflush(stdout) != 0)
+	err = 1;
 
-	    free(desc[i].buf);
-	    desc[i].buf = out;
-	    desc[i].buf_l = out_len;
-	    desc[i].tnum = tnum;
-	    desc[i].ttype = ttype;
-
-	    // Find dups
-	    int j;
-	    for (j = 0; j < i; j++) {
-		if (!desc[j].buf)
-		    continue;
-		if (desc[i].buf_l != desc[j].buf_l)
-		    continue;
-		if (memcmp(desc[i].buf, desc[j].buf, desc[i].buf_l) == 0)
-		    break;
-	    }
-	    if (j < i) {
-		//fprintf(stderr, "Dup %d %d size %d\n", i, j, (int)desc[i].buf_l);
-		desc[i].dup_from = j;
-		tot_size += 4; // flag, dup_from, ttype
-		//fprintf(stderr, "Desc %d %d/%d => DUP %d\n", i, tnum, ttype, j);
-	    } else {
-		desc[i].dup_from = 0;
-		tot_size += out_len + 1; // ttype
-		//fprintf(stderr, "Desc %d %d/%d => %d\n", i, tnum, ttype, (int)desc[i].buf_l);
-	    }
-	    
-//	    fprintf(stderr, "Encode tnum %d type %d ulen %d clen %d via %d\n",
-//		    tnum, ttype, (int)desc[i].buf_l, (int)out_len, *out);
+    return err;
+}
+
+static int decode(int argc, char **argv) {
+    int n, nthreads = 1;
+    uint32_t sz;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0)
+	nthreads = atoi(argv[2]);
+#ifdef NO_THREADS
+    nthreads = 1;
+#endif
+    if (nthreads < 1)
+	nthreads = 1;
 
-	    //if (out_len != write(1, out, out_len))
-	    //    abort();
+    tok3_block *slot = block_slots(nthreads, 0, 1);
+    if (!slot)
+	return 1;
 
-	    //free(out);
-	    //free(desc[i].buf);
+    for (n = 0; fread(&sz, 1, 4, stdin) == 4; n++) {
+	tok3_block *b = &slot[n % nthreads];
+	if (block_flush(b) < 0)
+	    return block_finish(slot, nthreads, n, 1);
+
+	if (sz > b->in_len) {
+	    uint8_t *in = realloc(b->in, sz + 4);
+	    if (!in)
+		return block_finish(slot, nthreads, n, 1);
+	    b->in = in;
+	    b->in_len = sz;
 	}
-	//fprintf(stderr, "Serialised %d descriptors\n", ndesc);
-
-	// Write
-	write(1, &tot_size, 4);
-	for (i = 0; i < MAX_DESCRIPTORS; i++) {
-	    if (!desc[i].buf_l) continue;
-	    uint8_t ttype8 = desc[i].ttype;
-	    if (desc[i].dup_from) {
-		uint8_t x = 255;
-		write(1, &x, 1);
-		uint16_t y = desc[i].dup_from;
-		write(1, &y, 2);
-		write(1, &ttype8, 1);
-	    } else {
-		write(1, &ttype8, 1);
-		write(1, desc[i].buf, desc[i].buf_l);
-	    }
+	memcpy(b->in, &sz, 4);
+	if (fread(b->in+4, 1, sz, stdin) != sz ||
+	    block_start(b, nthreads > 1) < 0)
+	    return block_finish(slot, nthreads, n, 1);
+    }
+
+    return block_finish(slot, nthreads, n % nthreads, 0);
+}
+
+static int encode(int argc, char **argv) {
+    FILE *fp;
+    char *prefix = "stdin";
+    int len, i, n, nthreads = 1, level = 9;
+#ifndef NO_THREADS
+    int64_t seq = 0;
+#endif
+
+    for (;;) {
+	if (argc > 2 && strcmp(argv[1], "-l") == 0) {
+	    level = atoi(argv[2]);
+	} else if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+	    nthreads = atoi(argv[2]);
+	} else {
+	    break;
 	}
+	argc -= 2;
+	argv += 2;
+    }
+#ifdef NO_THREADS
+    nthreads = 1;
+#endif
+    if (nthreads < 1)
+	nthreads = 1;
 
-	for (i = 0; i < MAX_DESCRIPTORS; i++) {
-	    if (!desc[i].buf_l) continue;
-	    free(desc[i].buf);
+    if (argc > 1) {
+	fp = fopen(argv[1], "r");
+	if (!fp) {
+	    perror(argv[1]);
+	    return 1;
 	}
+	prefix = argv[1];
+    } else {
+	fp = stdin;
+    }
 
-	free_context(ctx);
+    tok3_block *slot = block_slots(nthreads, level, 0);
+    char *carry = malloc(BLK_SIZE);
+    int carry_len = 0, ret = 1;
+    if (!slot || !carry)
+	goto err;
+
+    // Read block n into slot n%nthreads once its previous contents
+    // have been written.  A partial last line is carried over.
+    for (n = 0;; n++) {
+	tok3_block *b = &slot[n % nthreads];
+	char *blk = (char *)b->in;
+	if (block_flush(b) < 0)
+	    break;
 
-	if (len > last_start)
-	    memmove(blk, &blk[last_start], len - last_start);
-	blk_offset = len - last_start;
-	blk_num++;
+	memcpy(blk, carry, carry_len);
+	len = fread(blk+carry_len, 1, BLK_SIZE-carry_len, fp);
+	if (len <= 0) {
+	    ret = 0;
+	    break;
+	}
+	len += carry_len;
+
+	for (i = len; i > 0 && blk[i-1] != '\n'; i--)
+	    ;
+	b->in_len = i;
+	carry_len = len - i;
+	memcpy(carry, blk + i, carry_len);
+
+	if (!b->in_len)
+	    continue;
+#ifndef NO_THREADS
+	b->ctx->seq = seq++;
+#endif
+	if (block_start(b, nthreads > 1) < 0)
+	    break;
     }
+    ret = block_finish(slot, nthreads, n, ret);
+    slot = NULL;
+
+ err:
+    if (slot)
+	block_finish(slot, nthreads, 0, 1);
+    free(carry);
 
     if (fclose(fp) < 0) {
 	perror("closing file");
 	return 1;
     }
 
-    return 0;
+    return ret;
 }
 
 int main(int argc, char **argv) {
@@ -1330,4 +1838,4 @@ int main(int argc, char **argv) {
     else
 	return encode(argc, argv);
 }
-
+#endif
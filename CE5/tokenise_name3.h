@@ -0,0 +1,38 @@
+#ifndef TOKENISE_NAME3_H
+#define TOKENISE_NAME3_H
+
+#include <stdint.h>
+
+// Maximum bytes of names in one block
+#define TOK3_MAX_LEN (1<<20)
+
+typedef struct tok3_ctx tok3_ctx;
+
+// All encoder and decoder state lives in a tok3_ctx, so independent
+// contexts may be used from different threads at once.  A context can be
+// reused for any number of blocks; reusing it avoids reallocating its
+// buffers, and the encoder remembers each descriptor's compression method
+// from block to block.
+//
+// Level is the descriptor compression level, 1 to 9, as per
+// codec_compress() in codec_orig.c.  Nthreads is the number of threads one
+// call may use to uncompress descriptors, or 1 for none.
+tok3_ctx *tok3_ctx_create(int level, int nthreads);
+void tok3_ctx_destroy(tok3_ctx *ctx);
+
+// Encodes len bytes of '\n' separated names from buf as one block.  Len
+// is at most TOK3_MAX_LEN and the final newline is optional.  buf is not
+// modified.  *out is set to the block, which belongs to ctx and is valid
+// until its next use.
+// Returns the block size on success, -1 on failure.
+int tok3_encode_names(tok3_ctx *ctx, char *buf, int len, uint8_t **out);
+
+// Decodes the block in, as made by tok3_encode_names; its first 4 bytes
+// give the size of the rest.  *out is set to the names, each nul
+// terminated, and *offsets to the start of each name within *out, plus
+// one more entry for the end of the last.  Both belong to ctx and are
+// valid until its next use.
+// Returns the number of names on success, -1 on failure.
+int tok3_decode_names(tok3_ctx *ctx, uint8_t *in, char **out, int **offsets);
+
+#endif /* TOKENISE_NAME3_H */
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
 
 #include "rANS_static4x16.h"
 
@@ -25,7 +26,15 @@ typedef enum {
     RLE0, RLE1, PACK0, PACK1,
 } codec_t;
 
-int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int no_X4);
+// Compression levels.  Up to CODEC_LEVEL_EST the method is picked from
+// size estimates alone; up to CODEC_LEVEL_TRIAL close calls between the
+// two best estimates are trial encoded; above that every method is tried.
+#define CODEC_LEVEL_EST     3
+#define CODEC_LEVEL_TRIAL   6
+#define CODEC_LEVEL_DEFAULT 9
+
+int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+	     int no_X4, int level);
 int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len);
 
 //#define DEBUG
@@ -387,7 +396,8 @@ int64_t rans1_decode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_l
 //-----------------------------------------------------------------------------
 // X4: splitting 32-bit data into 4 8-bit data streams and encoding
 // separately.
-int x4_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
+int x4_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+	      int level) {
     uint64_t j, i4[4];
     uint64_t len4 = (in_len+3)&~3, olen4, olen4_space;
     uint8_t *in4 = malloc(len4);
@@ -414,7 +424,7 @@ int x4_encode(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
 
     for (j = 0; j < 4; j++) {
 	olen4_space = *out_len - olen4;
-	if (compress(in4 + j*len4, len4, out4, &olen4_space, 1) < 0) return -1;
+	if (compress(in4 + j*len4, len4, out4, &olen4_space, 1, level) < 0) return -1;
 	olen4 += olen4_space;
 	out4  += olen4_space;
     }
@@ -499,11 +509,218 @@ static unsigned char *load(char *fn, uint64_t *lenp) {
     return data;
 }
 
-int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int no_X4) {
+//-----------------------------------------------------------------------------
+// Size estimates, used by the lower levels to pick a method without
+// trial encoding.  RLE and PACK are cheap so are run for real, with rANS
+// on top of them estimated from the entropy of their output.
+
+// sum F log2(T/F) for one frequency row, in bits.
+static double est_row(int *F, int T, int *nnz) {
+    double bits = 0;
+    int j;
+    for (j = 0; j < 256; j++) {
+	if (F[j]) {
+	    bits += F[j] * log2((double)T / F[j]);
+	    (*nnz)++;
+	}
+    }
+    return bits;
+}
+
+// Order-0 and order-1 rans0_encode / rans1_encode sizes.  Table costs are
+// approximate, at one or two bytes per stored frequency.
+static void est_rans01(uint8_t *in, uint64_t in_len, double *o0, double *o1) {
+    int F1[256][256], T1[256] = {0};
+    int F0[256] = {0}, i, nnz0 = 0, nnz1 = 0, nctx = 0;
+    uint64_t j;
+    double b0, b1 = 0;
+    unsigned char last = 0;
+
+    // Only rows for symbols present (plus 0, the initial context) are used
+    for (j = 0; j < in_len; j++)
+	F0[in[j]]++;
+    for (i = 0; i < 256; i++)
+	if (F0[i] || i == 0)
+	    memset(F1[i], 0, sizeof(F1[i]));
+
+    for (j = 0; j < in_len; j++) {
+	F1[last][in[j]]++;
+	T1[last]++;
+	last = in[j];
+    }
+
+    b0 = est_row(F0, in_len, &nnz0);
+    for (i = 0; i < 256; i++) {
+	if (T1[i]) {
+	    b1 += est_row(F1[i], T1[i], &nnz1);
+	    nctx++;
+	}
+    }
+
+    // 5 byte header, order byte, 4 states
+    *o0 = b0/8 + 1.5*nnz0 + 22;
+    *o1 = b1/8 + 1.2*nnz1 + 2*nctx + nnz0 + 22;
+}
+
+// Estimated output size for each method, using tmp (of size tmp_sz) as
+// scratch space.  Methods not applicable are left as a huge size.
+static void est_methods(uint8_t *in, uint64_t in_len, int no_X4,
+			uint8_t *tmp, uint64_t tmp_sz, double *est) {
+    uint64_t tmp_len;
+    int m;
+
+    for (m = 0; m <= PACK1; m++)
+	est[m] = 1e30;
+
+    tmp_len = tmp_sz;
+    cat_encode(in, in_len, tmp, &tmp_len);
+    est[CAT] = tmp_len;
+    est_rans01(in, in_len, &est[RANS0], &est[RANS1]);
+    if (in_len < 4)
+	est[RANS1] = 1e30;
+
+    tmp_len = tmp_sz;
+    rle_encode(in, in_len, tmp, &tmp_len);
+    est[RLE] = tmp_len;
+    if (in_len >= 16) {
+	est_rans01(tmp, tmp_len, &est[RLE0], &est[RLE1]);
+	est[RLE0] += 5; est[RLE1] += 5;
+    }
+
+    if (in_len >= 4) {
+	tmp_len = tmp_sz;
+	pack_encode(in, in_len, tmp, &tmp_len);
+	est[PACK] = tmp_len;
+	if (in_len >= 16) {
+	    est_rans01(tmp, tmp_len, &est[PACK0], &est[PACK1]);
+	    est[PACK0] += 5; est[PACK1] += 5;
+	}
+    }
+
+    if (!no_X4 && in_len%4 == 0 && in_len >= 32) {
+	// Each quarter gets the best of the other methods
+	uint64_t len4 = in_len/4, i;
+	uint8_t *in4 = malloc(len4);
+	double sub[PACK1+1];
+	int j;
+	if (!in4)
+	    return;
+	est[X4] = 1 + i7put(tmp, in_len);
+	for (j = 0; j < 4; j++) {
+	    for (i = 0; i < len4; i++)
+		in4[i] = in[i*4+j];
+	    est_methods(in4, len4, 1, tmp, tmp_sz, sub);
+	    double best = sub[0];
+	    for (m = 1; m <= PACK1; m++)
+		if (best > sub[m])
+		    best = sub[m];
+	    est[X4] += best;
+	}
+	free(in4);
+    }
+}
+
+// Encodes with a specific method, using tmp (of size tmp_sz) for the
+// transforms ahead of rANS.
+static int encode_method(codec_t m, uint8_t *in, uint64_t in_len,
+			 uint8_t *out, uint64_t *out_len,
+			 uint8_t *tmp, uint64_t tmp_sz, int level) {
+    uint64_t tmp_len = tmp_sz;
+
+    switch (m) {
+    case CAT:
+	return cat_encode(in, in_len, out, out_len);
+    case RLE:
+	return rle_encode(in, in_len, out, out_len);
+    case RANS0:
+	return rans0_encode(in, in_len, out, out_len);
+    case RANS1:
+	return rans1_encode(in, in_len, out, out_len);
+    case PACK:
+	return pack_encode(in, in_len, out, out_len);
+    case X4:
+	return x4_encode(in, in_len, out, out_len, level);
+
+    case RLE0:
+    case RLE1:
+	if (rle_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
+	return m == RLE0
+	    ? rans0_encode(tmp, tmp_len, out, out_len)
+	    : rans1_encode(tmp, tmp_len, out, out_len);
+
+    case PACK0:
+    case PACK1:
+	if (pack_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
+	return m == PACK0
+	    ? rans0_encode(tmp, tmp_len, out, out_len)
+	    : rans1_encode(tmp, tmp_len, out, out_len);
+
+    default:
+	return -1;
+    }
+}
+
+// Levels up to CODEC_LEVEL_TRIAL: choose from the estimates.
+static int compress_est(uint8_t *in, uint64_t in_len, uint8_t *out,
+			uint64_t *out_len, int no_X4, int level) {
+    double est[PACK1+1];
+    uint64_t olen = *out_len, sz1;
+    codec_t m1 = CAT, m2 = CAT;
+    int m, r = -1;
+
+    uint8_t *tmp = malloc(olen);
+    if (!tmp)
+	return -1;
+
+    est_methods(in, in_len, no_X4, tmp, olen, est);
+    for (m = 1; m <= PACK1; m++)
+	if (est[m1] > est[m])
+	    m1 = m;
+    for (m = 0; m <= PACK1; m++)
+	if (m != m1 && (m2 == m1 || est[m2] > est[m]))
+	    m2 = m;
+
+#ifdef DEBUG
+    fprintf(stderr, "Estimates %ld -> %d (%.0f), %d (%.0f)\n",
+	    (long)in_len, m1, est[m1], m2, est[m2]);
+#endif
+
+    if (level <= CODEC_LEVEL_EST || est[m2] > 1.1*est[m1]) {
+	r = encode_method(m1, in, in_len, out, out_len, tmp, olen, level);
+	goto done;
+    }
+
+    // Close call; try the runner up first so the likely winner is
+    // usually the last written and needs no re-encode.
+    if (encode_method(m2, in, in_len, out, out_len, tmp, olen, level) < 0)
+	goto done;
+    sz1 = *out_len;
+
+    *out_len = olen;
+    if (encode_method(m1, in, in_len, out, out_len, tmp, olen, level) < 0)
+	goto done;
+    if (*out_len <= sz1) {
+	r = 0;
+	goto done;
+    }
+
+    *out_len = olen;
+    r = encode_method(m2, in, in_len, out, out_len, tmp, olen, level);
+
+ done:
+    free(tmp);
+    return r;
+}
+
+int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len,
+	     int no_X4, int level) {
     uint64_t best_sz = UINT64_MAX;
     codec_t best = CAT;
     uint64_t olen = *out_len;
 
+    if (level <= CODEC_LEVEL_TRIAL)
+	return compress_est(in, in_len, out, out_len, no_X4, level);
+
     uint8_t *tmp = malloc(*out_len);
     uint64_t tmp_len;
 
@@ -617,7 +834,7 @@ int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int
 	fprintf(stderr, "\n");
 #endif
 	*out_len = olen;
-	if (x4_encode(in, in_len, out, out_len) < 0) return -1;
+	if (x4_encode(in, in_len, out, out_len, level) < 0) return -1;
 #ifdef DEBUG
 	fprintf(stderr, "X4    -> %ld\n", (long)*out_len);
 #endif
@@ -633,61 +850,11 @@ int compress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len, int
     fprintf(stderr, "Best method = %d, %ld -> %ld\n", best, (long)in_len, (long)best_sz);
 #endif
 
-    switch (best) {
-    case CAT:
-	if (cat_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
-
-    case RLE:
-	if (rle_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
-
-    case RANS0:
-	*out_len = olen;
-	if (rans0_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
-
-    case RANS1:
+    // X4 is tried last, so is already in out.
+    if (best != X4) {
 	*out_len = olen;
-	if (rans1_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
-
-    case PACK:
-	*out_len = olen;
-	if (pack_encode(in, in_len, out, out_len) < 0) return -1;
-	break;
-
-    case RLE0:
-	tmp_len = olen;
-	if (rle_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
-	*out_len = olen;
-	if (rans0_encode(tmp, tmp_len, out, out_len) < 0) return -1;
-	break;
-
-    case RLE1:
-	tmp_len = olen;
-	if (rle_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
-	*out_len = olen;
-	if (rans1_encode(tmp, tmp_len, out, out_len) < 0) return -1;
-	break;
-
-    case PACK0:
-	tmp_len = olen;
-	if (pack_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
-	*out_len = olen;
-	if (rans0_encode(tmp, tmp_len, out, out_len) < 0) return -1;
-	break;
-
-    case PACK1:
-	tmp_len = olen;
-	if (pack_encode(in, in_len, tmp, &tmp_len) < 0) return -1;
-	*out_len = olen;
-	if (rans1_encode(tmp, tmp_len, out, out_len) < 0) return -1;
-	break;
-
-
-    default:
-	break;
+	if (encode_method(best, in, in_len, out, out_len, tmp, olen, level) < 0)
+	    return -1;
     }
 
     free(tmp);
@@ -765,6 +932,13 @@ int uncompress(uint8_t *in, uint64_t in_len, uint8_t *out, uint64_t *out_len) {
 int main(int argc, char **argv) {
     uint8_t *in, *out;
     uint64_t in_len, out_len;
+    int level = CODEC_LEVEL_DEFAULT;
+
+    if (argc > 2 && strcmp(argv[1], "-l") == 0) {
+	level = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
+    }
 
     if (argc > 1 && strcmp(argv[1], "-d") == 0) {
 	// Unpack a serialised list of compressed blocks to separate filenames.
@@ -836,7 +1010,7 @@ int main(int argc, char **argv) {
 	    out = malloc(out_len);
 	    assert(out);
 
-	    if (compress(in, in_len, out, &out_len, 0) < 0)
+	    if (compress(in, in_len, out, &out_len, 0, level) < 0)
 		abort();
 
 	    uint8_t single = 255; // marker for single file format.
@@ -873,7 +1047,7 @@ int main(int argc, char **argv) {
 	    uint8_t ttype8 = ttype;
 	    write(1, &ttype8, 1);
 
-	    if (compress(in, in_len, out, &out_len, 0) < 0)
+	    if (compress(in, in_len, out, &out_len, 0, level) < 0)
 		abort();
 
 	    if (out_len != write(1, out, out_len))